@@ -1,6 +1,7 @@
 #define _USE_MATH_DEFINES
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
 #include <assert.h>
 #include "glad/glad.h"
@@ -65,6 +66,7 @@ static int bake(scene_t *scene)
 	int vp[4];
 	float view[16], projection[16];
 	double lastUpdateTime = 0.0;
+	lm_stats stats;
 	while (lmBegin(ctx, vp, view, projection))
 	{
 		// render to lightmapper framebuffer
@@ -76,27 +78,31 @@ static int bake(scene_t *scene)
 		if (time - lastUpdateTime > 1.0)
 		{
 			lastUpdateTime = time;
-			printf("\r%6.2f%%", lmProgress(ctx) * 100.0f);
+			lmGetStats(ctx, &stats);
+			printf("\r%6.2f%% (%.0fs left)", lmProgress(ctx) * 100.0f, stats.remainingTime);
 			fflush(stdout);
 		}
 
 		lmEnd(ctx);
 	}
 	printf("\rFinished baking %d triangles.\n", scene->indexCount / 3);
-	
+
+	lmGetStats(ctx, &stats);
+	for (int i = 0; i < stats.passCount; i++)
+		printf("pass %2d: %7u hemispheres rendered, %7u texels interpolated\n", i, stats.rendered[i], stats.interpolated[i]);
+	printf("%.1f%% of the texels were rendered\n", stats.renderedRatio * 100.0f);
+	printf("%u batches, %.2fs total, %.2fs rasterization, %.2fs gpu downsampling, %.2fs waiting for readbacks\n",
+		stats.batches, stats.elapsedTime, stats.rasterizationTime, stats.gpuTime, stats.transferStallTime);
+
+	// edge-aware smoothing guided by the geometry (has to be done before the context is destroyed)
+	lmImageDenoise(ctx, data, 2, 0.1f);
 	lmDestroy(ctx);
 
 	// postprocess texture
-	float *temp = calloc(w * h * 4, sizeof(float));
-	lmImageSmooth(data, temp, w, h, 4);
-	lmImageDilate(temp, data, w, h, 4);
-	for (int i = 0; i < 16; i++)
-	{
-		lmImageDilate(data, temp, w, h, 4);
-		lmImageDilate(temp, data, w, h, 4);
-	}
+	lmImagePadCharts(data, w, h, 4, 32);
+	if (lmImageSaveHDR("result.hdr", data, w, h, 4)) // linear values before the gamma correction
+		printf("Saved result.hdr\n");
 	lmImagePower(data, w, h, 4, 1.0f / 2.2f, 0x7); // gamma correct color channels
-	free(temp);
 
 	// save result to a file
 	if (lmImageSaveTGAf("result.tga", data, w, h, 4, 1.0f))
@@ -110,6 +116,130 @@ static int bake(scene_t *scene)
 	return 1;
 }
 
+// bakes the scene with different hemisphere batch sizes and framebuffer formats and prints the hemisphere throughput of each one.
+static void benchmark(scene_t *scene)
+{
+	int w = scene->w, h = scene->h;
+	float *data = calloc(w * h * 4, sizeof(float));
+	printf("format | hemisphere batch size | hemispheres per batch | batch MB | time [s] | hemispheres/s | framebuffer GB/s\n");
+	for (int format = 0; format <= 2; format++)
+	{
+		lm_bool halfFloat = format == 1, ambientOcclusion = format == 2;
+		for (int n = 1; n <= 32; n *= 2)
+		{
+			lm_create_options options = { 2, n * 3 * 64, n * 64, halfFloat, ambientOcclusion, LM_FALSE, LM_FALSE };
+			lm_context *ctx = lmCreateEx(64, 0.001f, 100.0f, 1.0f, 1.0f, 1.0f, 2, 0.01f, &options);
+			if (!ctx)
+			{
+				fprintf(stderr, "Error: Could not initialize lightmapper.\n");
+				break;
+			}
+			memset(data, 0, w * h * 4 * sizeof(float));
+			lmSetTargetLightmap(ctx, data, w, h, 4);
+			lmSetGeometry(ctx, NULL,
+				LM_FLOAT, (unsigned char*)scene->vertices + offsetof(vertex_t, p), sizeof(vertex_t),
+				LM_FLOAT, (unsigned char*)scene->vertices + offsetof(vertex_t, t), sizeof(vertex_t),
+				scene->indexCount, LM_UNSIGNED_SHORT, scene->indices);
+
+			int vp[4];
+			float view[16], projection[16];
+			long sides = 0;
+			glFinish();
+			double startTime = glfwGetTime();
+			while (lmBegin(ctx, vp, view, projection))
+			{
+				glViewport(vp[0], vp[1], vp[2], vp[3]);
+				drawScene(scene, view, projection);
+				lmEnd(ctx);
+				sides++;
+			}
+			double time = glfwGetTime() - startTime;
+			lmDestroy(ctx);
+
+			// every hemisphere is rendered in 5 parts. its 3 * 64 x 64 rgba (or depth) texels are written once and read once by the first pass.
+			long hemispheres = sides / 5;
+			double texelBytes = ambientOcclusion ? 4.0 : halfFloat ? 8.0 : 16.0;
+			double batchMB = (double)n * n * 3 * 64 * 64 * texelBytes / (1024.0 * 1024.0);
+			double gbPerSecond = (double)hemispheres * 3 * 64 * 64 * texelBytes * 2.0 / time / 1e9;
+			printf("%-6s | %9dx%-11d | %21d | %8.2f | %8.2f | %13.0f | %16.2f\n",
+				ambientOcclusion ? "AO" : halfFloat ? "16F" : "32F", n * 3 * 64, n * 64, n * n, batchMB, time, hemispheres / time, gbPerSecond);
+		}
+	}
+	free(data);
+}
+
+// bakes the scene once with the compute shader reduction and once with the downsampling passes and prints the largest differences.
+static void verifyReduction(scene_t *scene)
+{
+	GLint major = 0, minor = 0;
+	glGetIntegerv(GL_MAJOR_VERSION, &major);
+	glGetIntegerv(GL_MINOR_VERSION, &minor);
+	if (major < 4 || (major == 4 && minor < 3))
+	{
+		fprintf(stderr, "Error: The compute shader reduction needs an OpenGL 4.3 context (got %d.%d).\n", major, minor);
+		return;
+	}
+
+	int w = scene->w, h = scene->h;
+	float *data[2];
+	data[0] = calloc(w * h * 4, sizeof(float));
+	data[1] = calloc(w * h * 4, sizeof(float));
+	const int sizes[] = { 16, 64, 256 };
+	printf("format | hemisphere size | max difference | max relative difference\n");
+	for (int format = 0; format <= 2; format++)
+	{
+		lm_bool halfFloat = format == 1, ambientOcclusion = format == 2;
+		for (int s = 0; s < 3; s++)
+		{
+			for (int path = 0; path < 2; path++)
+			{
+				lm_create_options options = { 0, 0, 0, halfFloat, ambientOcclusion, LM_FALSE, path == 1 };
+				lm_context *ctx = lmCreateEx(sizes[s], 0.001f, 100.0f, 1.0f, 1.0f, 1.0f, 2, 0.01f, &options);
+				if (!ctx)
+				{
+					fprintf(stderr, "Error: Could not initialize lightmapper.\n");
+					free(data[0]);
+					free(data[1]);
+					return;
+				}
+				memset(data[path], 0, w * h * 4 * sizeof(float));
+				lmSetTargetLightmap(ctx, data[path], w, h, 4);
+				srand(1); // the hemisphere rotations are jittered with rand() from lmSetGeometry on. both paths have to render the same views
+				lmSetGeometry(ctx, NULL,
+					LM_FLOAT, (unsigned char*)scene->vertices + offsetof(vertex_t, p), sizeof(vertex_t),
+					LM_FLOAT, (unsigned char*)scene->vertices + offsetof(vertex_t, t), sizeof(vertex_t),
+					scene->indexCount, LM_UNSIGNED_SHORT, scene->indices);
+
+				int vp[4];
+				float view[16], projection[16];
+				while (lmBegin(ctx, vp, view, projection))
+				{
+					glViewport(vp[0], vp[1], vp[2], vp[3]);
+					drawScene(scene, view, projection);
+					lmEnd(ctx);
+				}
+				lmDestroy(ctx);
+			}
+
+			float maxDifference = 0.0f, maxRelativeDifference = 0.0f;
+			for (int i = 0; i < w * h * 4; i++)
+			{
+				float a = data[0][i], b = data[1][i];
+				float difference = fabsf(a - b);
+				maxDifference = difference > maxDifference ? difference : maxDifference;
+				if (difference > 0.0f)
+				{
+					float relativeDifference = difference / fmaxf(fabsf(a), fabsf(b));
+					maxRelativeDifference = relativeDifference > maxRelativeDifference ? relativeDifference : maxRelativeDifference;
+				}
+			}
+			printf("%-6s | %15d | %14g | %23g\n", ambientOcclusion ? "AO" : halfFloat ? "16F" : "32F", sizes[s], maxDifference, maxRelativeDifference);
+		}
+	}
+	free(data[0]);
+	free(data[1]);
+}
+
 static void error_callback(int error, const char *description)
 {
 	fprintf(stderr, "Error: %s\n", description);
@@ -128,8 +258,9 @@ int main(int argc, char* argv[])
 	glfwWindowHint(GLFW_ALPHA_BITS, 8);
 	glfwWindowHint(GLFW_DEPTH_BITS, 32);
 	glfwWindowHint(GLFW_STENCIL_BITS, GLFW_DONT_CARE);
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 2);
+	lm_bool verify = argc > 1 && !strcmp(argv[1], "--verify-reduction");
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, verify ? 4 : 3); // the compute shader reduction needs 4.3
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, verify ? 3 : 2);
 	glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
 	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
 	glfwWindowHint(GLFW_OPENGL_DEBUG_CONTEXT, GL_TRUE);
@@ -147,6 +278,24 @@ int main(int argc, char* argv[])
 		return 1;
 	}
 
+	if (argc > 1 && !strcmp(argv[1], "--benchmark"))
+	{
+		benchmark(&scene);
+		destroyScene(&scene);
+		glfwDestroyWindow(window);
+		glfwTerminate();
+		return 0;
+	}
+
+	if (verify)
+	{
+		verifyReduction(&scene);
+		destroyScene(&scene);
+		glfwDestroyWindow(window);
+		glfwTerminate();
+		return 0;
+	}
+
 	printf("Ambient Occlusion Baking Example.\n");
 	printf("Use your mouse and the W, A, S, D, E, Q keys to navigate.\n");
 	printf("Press SPACE to start baking one light bounce!\n");
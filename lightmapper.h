@@ -55,20 +55,142 @@ lm_context *lmCreate(
                                                                                                        // values around and below 0.01 are probably ok.
                                                                                                        // the lower the value, the more hemispheres are rendered -> slower, but possibly better quality.
 
+// optional lmCreateEx settings. zero members select the defaults.
+typedef struct
+{
+	int transferRingSize;        // number of hemisphere batch readbacks that can be in flight before the cpu has to wait for the oldest one (default: 2).
+	                             // 1: the gpu and cpu take turns. increase this if lmTransferStallTime is high.
+	int batchWidth, batchHeight; // size of the framebuffer that batches of (3 * hemisphereSize) x hemisphereSize hemisphere renderings are rendered to (default: 1536 x 512).
+	                             // every batch is downsampled and read back at once. larger batches amortize this fixed cost per batch.
+	                             // clamped to GL_MAX_TEXTURE_SIZE. the memory needed is about batchWidth * batchHeight * 24 bytes.
+	lm_bool halfFloat;           // GL_RGBA16F instead of GL_RGBA32F hemisphere and downsampling framebuffers (half the memory and bandwidth).
+	                             // the shaders sum in 32bit, but store and read back halfs (~3 digits, radiance < 65504). the downsampling passes
+	                             // store every level as halfs, the compute shader reduction only the result, so the two paths differ slightly.
+	lm_bool ambientOcclusion;    // ambient occlusion only: the hemispheres are depth-only renderings (color output is ignored and the clear color unused).
+	                             // the first pass turns the distances into visibility (occluders fade out linearly up to zFar) and the
+	                             // downsampling, readback and lightmap values have one channel (1: unoccluded). back faces occlude as well.
+	lm_bool directional;         // directional lightmaps (see lmSetTargetDirections). the first pass also projects the radiance onto the
+	                             // L1 spherical harmonics band into 3 more render targets, which quadruples the downsampling and readback.
+	lm_bool downsamplePasses;    // reduce the hemispheres with the downsampling passes even if the OpenGL 4.3 compute shader is available
+	                             // (LM_NO_COMPUTE at runtime, e.g. to compare both paths).
+} lm_create_options;
+
+// lmCreate with the settings above (options may be NULL).
+lm_context *lmCreateEx(
+	int hemisphereSize, float zNear, float zFar,
+	float clearR, float clearG, float clearB,
+	int interpolationPasses, float interpolationThreshold,
+	const lm_create_options *options);
+
+// creates a lightmapper instance that doesn't need an OpenGL context (parameters are the same as for lmCreate).
+// hemispheres are integrated by casting rays against the geometry set with lmSetGeometry on all cores
+// instead of rendering them. in this case lmBegin bakes the whole lightmap and always returns false.
+// each sample casts 3 * hemisphereSize^2 rays. typical hemisphereSize: 16-32.
+lm_context *lmCreateCPU(
+	int hemisphereSize, float zNear, float zFar,
+	float clearR, float clearG, float clearB,
+	int interpolationPasses, float interpolationThreshold);
+
 // optional: set material characteristics by specifying cos(theta)-dependent weights for incoming light.
 typedef float (*lm_weight_func)(float cos_theta, void *userdata);
 void lmSetHemisphereWeights(lm_context *ctx, lm_weight_func f, void *userdata);                        // precalculates weights for incoming light depending on its angle. (default: all weights are 1.0f)
 
+// optional: how the hemispheres are rendered (lmCreate contexts only; call before lmBegin/lmBeginBatch of a geometry).
+typedef enum
+{
+	LM_HEMICUBE,   // five sides with perspective projections per hemisphere (default).
+	LM_PARABOLOID  // one view per hemisphere with a paraboloid projection, that the vertex shader has to apply:
+	               //   vec3 v = (view * vec4(position, 1.0)).xyz; float d = length(v);
+	               //   gl_Position = projection * vec4(v.xy / (d - v.z), -v.z, 1.0);
+	               // the depth along the surface normal clips everything below the surface (like the near plane of the hemicube).
+	               // triangle edges are still rasterized as straight lines, so large triangles close to the sample need to be tessellated.
+} lm_hemisphere_projection;
+void lmSetHemisphereProjection(lm_context *ctx, lm_hemisphere_projection projection);                  // also recalculates the weights of lmSetHemisphereWeights for the projection.
+
+// optional: how the deviation of the interpolation neighbors from their average is compared to the interpolation threshold.
+typedef enum
+{
+	LM_ABSOLUTE_ERROR,  // |neighbor - average| of every channel (default).
+	LM_RELATIVE_ERROR,  // |neighbor - average| / |average| of every channel. bright and dark regions get the same relative precision.
+	LM_LUMINANCE_ERROR  // relative error of the luminance (Rec. 709 weights for RGB/RGBA, the first channel otherwise).
+} lm_interpolation_error;
+// refinementThreshold > 0 adds a final pass that renders the interpolated texels that differ by more than refinementThreshold
+// (same metric) from one of their direct neighbors. call before lmSetGeometry.
+void lmSetInterpolationError(lm_context *ctx, lm_interpolation_error metric, float refinementThreshold LM_DEFAULT_VALUE(0.0f));
+
+// optional: debug hooks. f gets the intermediate images of the selected stages. the images are only valid during the call.
+// nothing is read back or stored for stages that are not selected.
+typedef enum
+{
+	LM_DEBUG_FIRST_PASS         = 1, // rgba (weighted color sum, validity) of every batch after the first downsampling pass. costs a synchronous readback per batch!
+	LM_DEBUG_BATCH_RESULTS      = 2, // rgba of every batch after the integration. one pixel per hemisphere, the unused part of the last row is undefined.
+	                                 // ambient occlusion contexts pass the visibility in the red channel of the first pass and one channel batch results.
+	LM_DEBUG_INTERPOLATION_MASK = 4  // rgb lightmap sized mask after the last pass of a geometry. red: rendered texels, green: interpolated texels.
+} lm_debug_stage;
+typedef void (*lm_debug_func)(lm_debug_stage stage, const float *image, int w, int h, int c, void *userdata);
+void lmSetDebugCallback(lm_context *ctx, unsigned int stages, lm_debug_func f, void *userdata);         // stages: combination of lm_debug_stage flags or 0/NULL to disable.
+
 // specify an output lightmap image buffer with w * h * c * sizeof(float) bytes of memory.
 void lmSetTargetLightmap(lm_context *ctx, float *outLightmap, int w, int h, int c);                    // output HDR lightmap (linear 32bit float channels; c: 1->Greyscale, 2->Greyscale+Alpha, 3->RGB, 4->RGBA).
 
+// optional: texel state bitmaps that are kept beside the target lightmap (call after lmSetTargetLightmap).
+// without them, lightmap texels with a value of 0 are empty and baked values are clamped to FLT_MIN.
+// with them, black texels are valid: bit i of the first half of the buffer is set if texel i has a value,
+// bit i of the second half if that value was interpolated. clear the buffer together with the lightmap!
+int lmCoverageSize(int w, int h);                                                                      // size of the coverage buffer in bytes.
+void lmSetTargetCoverage(lm_context *ctx, unsigned char *coverage);                                    // coverage of the lightmap set with lmSetTargetLightmap. keep it alive while the lightmap is baked.
+
+// optional (contexts created with directional = LM_TRUE): w * h * 9 floats for the L1 spherical harmonics band of the lightmap set with
+// lmSetTargetLightmap (call after it, row layout only). every texel gets the world space x, y and z coefficients (rgb each) of the
+// same weighted average as its lightmap value: the average of radiance * direction. radiance(direction) ~ value + 3 * dot(L1, direction).
+// interpolated texels get the average of the same neighbors. texels that keep their previous value (lmBakeBounces, lmSetDirtyRegions) keep these as well.
+void lmSetTargetDirections(lm_context *ctx, float *outDirections);
+
+// optional: tiled target lightmaps for very large atlases (instead of lmSetTargetLightmap). the texels are stored in 64x64 texel tiles
+// (row by row, tiles in row major order), so that the memory touched by a triangle is a few contiguous blocks instead of many rows.
+// backed by a memory mapped file, only the tiles of the working set stay resident. without lmSetTargetCoverage, a tiled target starts
+// empty: its existing values are never read and get baked again (keep the coverage buffer to resume a bake). lmImageDenoise,
+// lmBakeBounces and lmSetDirtyRegions don't support them, since they need whole lightmap copies.
+#define LM_TILE_SIZE 64
+unsigned long long lmTiledLightmapSize(int w, int h, int c);                                           // size of a tiled lightmap in bytes (padded to whole tiles).
+void lmSetTargetLightmapTiled(lm_context *ctx, float *outTiledLightmap, int w, int h, int c);          // like lmSetTargetLightmap, but the buffer has the tiled layout.
+float *lmMapTiledLightmap(const char *filename, int w, int h, int c);                                  // maps (and creates or grows) a file as tiled lightmap. existing texels are kept (but see above). NULL on failure.
+void lmFlushTiledLightmap(float *tiledLightmap, int w, int h, int c);                                  // starts writing the changed tiles back to the file (can be called while baking).
+void lmUnmapTiledLightmap(float *tiledLightmap, int w, int h, int c);
+void lmImageUntile(const float *tiledImage, float *outImage, int w, int h, int c);                      // copies a tiled lightmap into a w * h * c image for the lmImage* functions.
+
 // set the geometry to map to the currently set target lightmap (set the target lightmap before calling this!).
+// the mesh is decoded and transformed once by this call. the buffers don't have to be kept alive afterwards.
 void lmSetGeometry(lm_context *ctx,
 	const float *transformationMatrix,                                                                 // 4x4 object-to-world transform for the geometry or NULL (no transformation).
 	lm_type positionsType, const void *positionsXYZ, int positionsStride,                              // triangle mesh in object space.
 	lm_type lightmapCoordsType, const void *lightmapCoordsUV, int lightmapCoordsStride,                // lightmap atlas texture coordinates for the mesh [0..1]x[0..1] (integer types are normalized to 0..1 range).
 	int count, lm_type indicesType LM_DEFAULT_VALUE(LM_NONE), const void *indices LM_DEFAULT_VALUE(0));// if mesh indices are used, count = number of indices else count = number of vertices.
 
+// optional: adds more geometry to the geometry set with lmSetGeometry, which is baked into the currently set target lightmap.
+// all geometry (and their target lightmaps) are baked in one go, so that hemisphere batches are filled across objects.
+// call lmSetTargetLightmap and lmAddGeometry for every additional object before lmBegin. (OpenGL contexts only)
+void lmAddGeometry(lm_context *ctx,
+	const float *transformationMatrix,
+	lm_type positionsType, const void *positionsXYZ, int positionsStride,
+	lm_type lightmapCoordsType, const void *lightmapCoordsUV, int lightmapCoordsStride,
+	int count, lm_type indicesType LM_DEFAULT_VALUE(LM_NONE), const void *indices LM_DEFAULT_VALUE(0));
+
+// optional: sample plans for multiple bounces. the sample positions only depend on the geometry and lightmap size.
+// a sample plan records the hemisphere positions, directions and (randomized) orientations of all passes once,
+// so that later bakes of the same geometry don't have to rasterize it again and produce reproducible results.
+typedef struct lm_sample_plan lm_sample_plan;
+lm_sample_plan *lmCreateSamplePlan(lm_context *ctx);                                                   // records the sample plan of the geometry set with lmSetGeometry (call before lmBegin).
+void lmSetSamplePlan(lm_context *ctx, const lm_sample_plan *plan);                                     // replays the plan for the geometry set with lmSetGeometry (call after every lmSetGeometry, before lmBegin).
+void lmDestroySamplePlan(lm_sample_plan *plan);
+
+// lmCreateCPU contexts only: surface properties of the geometry that the rays hit (call after lmSetGeometry).
+// a hit surface emits emission + albedo * bounceLightmap. back faces are invalid samples (like alpha = 0 when rendering).
+void lmSetGeometryMaterial(lm_context *ctx,
+	lm_type albedoType, const void *albedoRGB, int albedoStride,                                       // per-vertex diffuse reflectance or NULL (1.0f). integer types are normalized to 0..1.
+	lm_type emissionType, const void *emissionRGB, int emissionStride);                                // per-vertex emitted light or NULL (0.0f). integer types are normalized to 0..1.
+void lmSetBounceLightmap(lm_context *ctx, const float *lightmap, int w, int h, int c);                  // lighting of the previous bounce that is looked up at the hit points with the lightmap coordinates (or NULL).
+
 
 // as long as lmBegin returns true, the scene has to be rendered with the 
 // returned camera and view parameters to the currently bound framebuffer.
@@ -83,6 +205,80 @@ float lmProgress(lm_context *ctx);
 
 void lmEnd(lm_context *ctx);
 
+// optional: incremental baking for interactive applications (call instead of lmBegin/lmEnd, e.g. once per frame).
+// renders hemisphere sides with the render callback until about budgetMicroseconds have passed and returns, so that the
+// application can draw its own frame with the same OpenGL context in between. the hemisphere batches and transfers in flight
+// are kept by the context until the next lmBakeStep. returns true as long as the lightmap isn't finished.
+// a step takes longer than the budget when it has to wait for a batch readback (or ray trace a whole batch with lmCreateCPU contexts).
+typedef void (*lm_render_func)(const int *viewport4, const float *view4x4, const float *projection4x4, void *userdata); // render the scene like between lmBegin/lmEnd.
+lm_bool lmBakeStep(lm_context *ctx, unsigned int budgetMicroseconds, lm_render_func render, void *userdata);   // render may be NULL for lmCreateCPU contexts.
+
+// stops the bake of the current geometry (between lmBakeStep calls or instead of the next lmBegin/lmBeginBatch).
+// the unprocessed hemispheres and the batch transfers in flight are dropped. the texels that were finished stay in the target lightmaps.
+// the context can be used again after the next lmSetGeometry.
+void lmCancel(lm_context *ctx);
+
+// alternative to lmBegin/lmEnd that hands out the views of all hemisphere sides of a whole batch at once (OpenGL contexts only).
+// returns the number of views (5 per hemisphere with LM_HEMICUBE, 1 with LM_PARABOLOID) or 0 when the lightmap is done. for every view i, the scene has to be rendered
+// with outViewports4[i * 4], outViews4x4[i * 16] and outProjections4x4[i * 16] into the currently bound framebuffer.
+// this allows rendering many views per draw call, e.g. instanced with a geometry shader that selects gl_ViewportIndex
+// (in chunks of GL_MAX_VIEWPORTS views uploaded with glViewportArrayv). the arrays are owned by the context.
+// if lmBeginBatch returns a value > 0, it must be followed by lmEndBatch after rendering!
+int lmBeginBatch(lm_context *ctx, const int **outViewports4, const float **outViews4x4, const float **outProjections4x4);
+void lmEndBatch(lm_context *ctx);
+
+// optional: built-in bounce loop for the geometry set with lmSetGeometry/lmAddGeometry (call instead of lmBegin/lmEnd).
+// the context, its framebuffers and the sample positions (a sample plan, unless one is set already) are reused by every bounce.
+// the bake of every bounce goes into the target lightmaps, while the context keeps the previous bounce in its own buffers.
+// texels that changed by less than epsilon between two bounces are kept as they are instead of being rendered again,
+// so that the later bounces get cheaper. returns the number of baked bounces.
+typedef struct
+{
+	lm_render_func render;                                                                                  // lmCreate contexts: render the scene lit by the lightmaps of the previous bounce (like between lmBegin/lmEnd).
+	lm_bool (*bounceDone)(int bounce, void *userdata);                                                     // the target lightmaps contain the bounce: post process and upload them for the next one. LM_FALSE stops.
+	                                                                                                       // the context has kept the unprocessed bake for the convergence test and the converged texels already.
+	void *userdata;
+	float epsilon;                                                                                         // convergence threshold in the metric of lmSetInterpolationError (0: render every texel in every bounce).
+} lm_bounce_callbacks;
+int lmBakeBounces(lm_context *ctx, int bounceCount, const lm_bounce_callbacks *callbacks);             // lmCreateCPU contexts get the previous bounce through lmSetBounceLightmap (the first one uses the one that is set).
+
+// optional: rebakes only the texels whose hemisphere can see one of the changed regions, e.g. the old and the new bounds of a moved object.
+// call once per rebake after lmSetGeometry/lmAddGeometry (and lmSetSamplePlan), while the target lightmaps still contain the unprocessed
+// previous bake of the same geometry. the context keeps a copy of it until the next lmSetGeometry. a texel is rendered again if the
+// region is in front of its hemisphere and closer than zFar. the others keep their values and are used for interpolation as before.
+// regions that only changed in the lighting of the previous bounce (e.g. a shadow) are not found, add them as well if they matter.
+void lmSetDirtyRegions(lm_context *ctx, const float *boundsMinMax6, int count);                         // count world space AABBs of { minX, minY, minZ, maxX, maxY, maxZ }.
+
+// optional: content addressed cache of finished bakes in a directory (call after lmSetGeometry/lmAddGeometry, lmSetTargetDirections and lmSetSamplePlan).
+// the key is a hash of the decoded geometry (with its transforms and lightmap coordinates), the formats of the target lightmaps,
+// the lmCreate/lmCreateCPU parameters, the hemisphere weights and projection, the interpolation settings, the materials and bounce
+// lightmap of lmCreateCPU contexts and sceneHash, which has to cover everything else that is rendered (lights, other objects...).
+// only bakes into targets without covered texels are cached, since their values are not part of the key (see lmSetDirtyRegions).
+lm_bool lmCacheLoad(lm_context *ctx, const char *directory, unsigned long long sceneHash);             // reads all target lightmaps (with coverage and directions) of a stored bake. LM_TRUE: skip lmBegin/lmEnd.
+lm_bool lmCacheStore(lm_context *ctx, const char *directory, unsigned long long sceneHash);            // writes the baked target lightmaps (before any post processing). LM_FALSE on write errors or uncached bakes.
+
+double lmTransferStallTime(lm_context *ctx);                                                           // seconds spent waiting for hemisphere batch readbacks from the gpu since lmCreate (to tune lm_create_options transferRingSize).
+
+// bake statistics to tune interpolationPasses/interpolationThreshold, batch and transfer ring sizes.
+// counters and times are accumulated since lmCreate. elapsedTime and remainingTime refer to the current geometry.
+#define LM_MAX_PASSES 26 // 1 + 3 * 8 interpolation passes + 1 refinement pass
+typedef struct
+{
+	int passCount;                            // number of used entries of the per pass arrays (1 + 3 * interpolationPasses (+ 1 refinement pass, see lmSetInterpolationError))
+	unsigned int rendered[LM_MAX_PASSES];     // hemispheres rendered per pass
+	unsigned int interpolated[LM_MAX_PASSES]; // lightmap texels interpolated per pass
+	float renderedRatio;                      // rendered hemispheres / (rendered hemispheres + interpolated texels) of all passes
+	unsigned int batches;                     // hemisphere batches processed
+	double rasterizationTime;                 // cpu seconds spent finding sample positions and interpolating
+	double gpuTime;                           // gpu seconds spent downsampling and reading back batches (0 without OpenGL 3.3 timer queries)
+	double transferStallTime;                 // seconds spent waiting for batch readbacks (see lmTransferStallTime)
+	double elapsedTime;                       // seconds since the first lmBegin/lmBeginBatch of the current geometry
+	double remainingTime;                     // estimate based on elapsedTime and lmProgress (-1: unknown)
+	unsigned int cacheHits;                   // lmCacheLoad calls that found a stored bake
+	unsigned int cacheMisses;                 // lmCacheLoad calls that didn't
+} lm_stats;
+void lmGetStats(lm_context *ctx, lm_stats *outStats);
+
 // destroys the lightmapper instance. should be called to free resources.
 void lmDestroy(lm_context *ctx);
 
@@ -97,12 +293,24 @@ void lmImagePower(float *image, int w, int h, int c, float exponent, int m LM_DE
 void lmImageDilate(const float *image, float *outImage, int w, int h, int c);                                          // widen the populated non-zero areas by 1 pixel.
 void lmImageSmooth(const float *image, float *outImage, int w, int h, int c);                                          // simple box filter on only the non-zero values.
 void lmImageDownsample(const float *image, float *outImage, int w, int h, int c);                                      // downsamples [0..w]x[0..h] to [0..w/2]x[0..h/2] by avereging only the non-zero values
+void lmImagePadCharts(float *image, int w, int h, int c, int maxDistance);                                            // in-place fill of empty pixels with the nearest non-zero pixel up to maxDistance pixels away (replaces repeated lmImageDilate calls)
+void lmImageApplyCoverage(float *image, int w, int h, int c, const unsigned char *coverage);                          // sets empty pixels to 0 and black populated pixels to FLT_MIN, so that the filters above see exactly the baked pixels (see lmSetTargetCoverage).
 void lmImageFtoUB(const float *image, unsigned char *outImage, int w, int h, int c, float max LM_DEFAULT_VALUE(0.0f)); // casts a floating point image to an 8bit/channel image
 
+// edge-aware denoising of a lightmap that was baked with the geometry that is still set on ctx (call before the next lmSetGeometry).
+// the geometry is rasterized to a lightmap space g-buffer (position, normal and uv chart per texel) that guides an a-trous wavelet filter.
+// unlike lmImageSmooth, it doesn't blur across chart borders, creases or depth discontinuities. empty texels (see lmSetTargetCoverage) stay empty.
+// iterations: filter passes with step sizes 1, 2, 4, ... colorSigma: tolerated luminance difference relative to the texel luminance plus 1% of the lightmap average (halved every iteration).
+void lmImageDenoise(lm_context *ctx, float *lightmap, int iterations LM_DEFAULT_VALUE(2), float colorSigma LM_DEFAULT_VALUE(0.1f));
+
 // TGA file output helpers
 lm_bool lmImageSaveTGAub(const char *filename, const unsigned char *image, int w, int h, int c);
 lm_bool lmImageSaveTGAf(const char *filename, const float *image, int w, int h, int c, float max LM_DEFAULT_VALUE(0.0f));
 
+// HDR file output helpers that keep the float values. the images are written scanline by scanline (same orientation as the TGAs).
+lm_bool lmImageSaveHDR(const char *filename, const float *image, int w, int h, int c);                 // run length encoded Radiance RGBE (.hdr). c = 1/2: greyscale, alpha is dropped.
+lm_bool lmImageSaveEXR(const char *filename, const float *image, int w, int h, int c);                 // uncompressed 32bit float scanline OpenEXR (.exr). c = 1: Y, 2: YA, 3: RGB, 4: RGBA.
+
 #endif
 ////////////////////// END OF HEADER //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 #ifdef LIGHTMAPPER_IMPLEMENTATION
@@ -110,17 +318,55 @@ lm_bool lmImageSaveTGAf(const char *filename, const float *image, int w, int h,
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
 #include <float.h>
 #include <assert.h>
 #include <limits.h>
 
+#if defined(_WIN32)
+#include <windows.h> // threads and timers
+#else
+#include <time.h>
+#include <sys/time.h>
+#include <sys/mman.h> // tiled lightmap files
+#include <fcntl.h>
+#include <unistd.h>
+#ifndef LM_NO_THREADS // define LM_NO_THREADS to do all cpu work on the calling thread
+#include <pthread.h>
+#endif
+#endif
+
+#if !defined(LM_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define LM_SSE2 // used by the lmImage* functions. define LM_NO_SIMD to use plain scalar code.
+#include <emmintrin.h>
+#endif
+
+#if defined(LM_SSE2) && defined(__F16C__)
+#define LM_F16C // decodes half float readbacks (see lm_create_options halfFloat) 4 values at a time.
+#include <immintrin.h>
+#endif
+
+#if !defined(LM_NO_COMPUTE) && defined(GL_COMPUTE_SHADER)
+#define LM_COMPUTE // reduces the hemispheres with a compute shader if the context supports OpenGL 4.3. define LM_NO_COMPUTE to always use the downsampling passes.
+#endif
+
+#ifndef LM_MAX_THREADS
+#define LM_MAX_THREADS 64
+#endif
+
 #define LM_SWAP(type, a, b) { type tmp = (a); (a) = (b); (b) = tmp; }
 
 #if defined(_MSC_VER) && !defined(__cplusplus) // TODO: specific versions only?
 #define inline __inline
 #endif
 
+#if defined(_MSC_VER)
+#define LM_FORCE_INLINE __forceinline
+#else
+#define LM_FORCE_INLINE inline __attribute__((always_inline))
+#endif
+
 #if defined(_MSC_VER) && (_MSC_VER <= 1700)
 static inline lm_bool lm_finite(float a) { return _finite(a); }
 #else
@@ -252,21 +498,227 @@ static int lm_convexClip(lm_vec2 *poly, int nPoly, const lm_vec2 *clip, int nCli
 	return nRes;
 }
 
+static double lm_time(void) // seconds (for statistics and the lmBakeStep budget)
+{
+#if defined(_WIN32)
+	LARGE_INTEGER counter, frequency;
+	QueryPerformanceCounter(&counter);
+	QueryPerformanceFrequency(&frequency);
+	return (double)counter.QuadPart / (double)frequency.QuadPart;
+#elif defined(CLOCK_MONOTONIC)
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (double)t.tv_sec + (double)t.tv_nsec * 1e-9;
+#else // strict c99 without posix extensions
+	struct timeval t;
+	gettimeofday(&t, NULL);
+	return (double)t.tv_sec + (double)t.tv_usec * 1e-6;
+#endif
+}
+
+// runs func on [0, count) in chunks of grain indices on all cores. the calling thread works on chunks too.
+typedef void (*lm_parallel_func)(void *userdata, int begin, int end);
+
+#ifdef LM_NO_THREADS
+static void lm_parallelFor(int count, int grain, lm_parallel_func func, void *userdata)
+{
+	if (count > 0)
+		func(userdata, 0, count);
+}
+#else
+typedef struct
+{
+	lm_parallel_func func;
+	void *userdata;
+	int count;
+	int grain;
+	volatile int next; // start of the next chunk that hasn't been picked up by a thread yet
+} lm_parallelJob;
+
+static int lm_atomicAdd(volatile int *value, int add) // returns the previous value
+{
+#if defined(_MSC_VER)
+	return (int)InterlockedExchangeAdd((volatile LONG*)value, add);
+#else
+	return __sync_fetch_and_add(value, add);
+#endif
+}
+
+static void lm_parallelWorker(lm_parallelJob *job)
+{
+	for (;;)
+	{
+		int begin = lm_atomicAdd(&job->next, job->grain);
+		if (begin >= job->count)
+			break;
+		job->func(job->userdata, begin, lm_mini(begin + job->grain, job->count));
+	}
+}
+
+#if defined(_WIN32)
+static DWORD WINAPI lm_parallelThread(LPVOID job) { lm_parallelWorker((lm_parallelJob*)job); return 0; }
+#else
+static void *lm_parallelThread(void *job) { lm_parallelWorker((lm_parallelJob*)job); return NULL; }
+#endif
+
+static int lm_threadCount(void)
+{
+#if defined(_WIN32)
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	int n = (int)info.dwNumberOfProcessors;
+#else
+	int n = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	return lm_maxi(lm_mini(n, LM_MAX_THREADS), 1);
+}
+
+static void lm_parallelFor(int count, int grain, lm_parallel_func func, void *userdata)
+{
+	lm_parallelJob job;
+	job.func = func;
+	job.userdata = userdata;
+	job.count = count;
+	job.grain = lm_maxi(grain, 1);
+	job.next = 0;
+
+	int threadCount = lm_mini(lm_threadCount(), (count + job.grain - 1) / job.grain);
+	int started = 0;
+#if defined(_WIN32)
+	HANDLE threads[LM_MAX_THREADS];
+	for (int i = 1; i < threadCount; i++)
+		if ((threads[started] = CreateThread(NULL, 0, lm_parallelThread, &job, 0, NULL)) != NULL)
+			started++;
+	lm_parallelWorker(&job);
+	for (int i = 0; i < started; i++)
+	{
+		WaitForSingleObject(threads[i], INFINITE);
+		CloseHandle(threads[i]);
+	}
+#else
+	pthread_t threads[LM_MAX_THREADS];
+	for (int i = 1; i < threadCount; i++)
+		if (pthread_create(&threads[started], NULL, lm_parallelThread, &job) == 0)
+			started++;
+	lm_parallelWorker(&job); // if some threads couldn't be started, we just do more work here
+	for (int i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+#endif
+}
+#endif
+
+// bounding volume hierarchy for ray casting on the cpu
+#define LM_BVH_MAX_DEPTH 64 // nodes at this depth stay leaves, so that the traversal stack has a fixed size
+typedef struct lm_bvhNode
+{
+	lm_vec3 bmin; int first; // leaf: index of the first triangle. inner node: index of the left child (the right one follows it).
+	lm_vec3 bmax; int count; // leaf: number of triangles. inner node: 0.
+} lm_bvhNode;
+
+typedef struct lm_bvhTriangle
+{
+	lm_vec3 p0, e1, e2;
+	unsigned int index; // triangle index in the mesh
+} lm_bvhTriangle;
+
+typedef struct lm_hit
+{
+	unsigned int triangle;
+	float u, v; // barycentric coordinates (p = p0 + u * e1 + v * e2)
+	lm_bool frontFacing;
+} lm_hit;
+
+typedef struct lm_hemisphereSample
+{
+	lm_vec3 position;
+	lm_vec3 direction;
+	lm_vec3 up;
+} lm_hemisphereSample;
+
+typedef struct
+{
+	int width;
+	int height;
+	int channels;
+	float *data;
+	unsigned char *coverage; // has value bits followed by interpolated bits (lmSetTargetCoverage or internal)
+	lm_bool ownsCoverage;    // internal coverage: keep values non-zero, so that 0 still means empty outside of the bake
+	lm_bool tiled;           // LM_TILE_SIZE^2 texel tiles instead of rows (lmSetTargetLightmapTiled)
+	float *previous;         // previous bounce (lmBakeBounces) or previous bake (lmSetDirtyRegions). same layout as data
+	unsigned char *converged; // bits of the texels that can keep their previous value instead of being rendered again (lmBakeBounces: converged, lmSetDirtyRegions: covered by the previous bake)
+	float *directions;       // L1 band, 9 floats per texel (lmSetTargetDirections) or NULL
+	lm_bool prefilled;       // had covered texels when it was added to the geometry set. they are not baked, so the bake depends on them
+} lm_targetLightmap;
+
+typedef struct
+{
+	int x, y;
+	int target; // index into the target lightmaps of the geometry set
+} lm_lightmapLocation;
+
+typedef struct
+{
+	unsigned int first; // first mesh index of the geometry
+	int target;         // index into the target lightmaps of the geometry set
+} lm_geometry;
+
+typedef struct
+{
+	GLuint pbo;
+	GLuint timerQuery;                             // GL_TIME_ELAPSED of the downsampling and readback (if supported)
+	GLsync fence;                                  // signaled when the readback into the pbo is done
+	unsigned int fbHemiCount;
+	lm_lightmapLocation *fbHemiToLightmapLocation; // batch to lightmap locations of the transferred batch
+	lm_hemisphereSample *fbHemiSamples;            // orientations of the transferred batch hemispheres (directional only)
+} lm_hemisphereTransfer;
+
+typedef struct lm_samplePlanEntry
+{
+	int x, y;   // lightmap texel visited by the conservative rasterizer
+	int sample; // index of the texel's hemisphere sample or -1 if the texel can't be sampled
+} lm_samplePlanEntry;
+
+struct lm_sample_plan
+{
+	int width, height;          // lightmap size
+	int passCount;
+	unsigned int triangleCount;
+	unsigned int *triangleFirst; // entries of triangle t in pass p: [triangleFirst[p * triangleCount + t], triangleFirst[p * triangleCount + t + 1])
+	lm_samplePlanEntry *entries;
+	lm_hemisphereSample *samples;
+};
+
 struct lm_context
 {
 	struct
 	{
-		const float *transform;
-		const unsigned char *positions;
-		lm_type positionsType;
-		int positionsStride;
-		const unsigned char *uvs;
-		lm_type uvsType;
-		int uvsStride;
-		const unsigned char *indices;
-		lm_type indicesType;
-		unsigned int count;
-	} mesh;
+		unsigned int count;    // number of indices (3 per triangle)
+		unsigned int capacity; // allocated indices
+		unsigned int *indices; // decoded vertex indices (count)
+		lm_vec3 *positions;    // transformed positions (count)
+		lm_vec2 *uvs;          // lightmap coords scaled to the lightmap resolution (count)
+		lm_vec3 *normals;      // face normals (count / 3)
+		lm_ivec2 *rectMin;     // conservative rasterization bounds on the lightmap (count / 3)
+		lm_ivec2 *rectMax;
+	} mesh; // decoded by lmSetGeometry/lmAddGeometry
+
+	struct
+	{
+		lm_targetLightmap target;   // set by lmSetTargetLightmap for the geometry that is added next
+		lm_targetLightmap *targets; // target lightmaps of all geometries
+		int targetCount;
+		int targetCapacity;
+		lm_geometry *geometries;    // mesh index ranges of all geometries (ordered)
+		int geometryCount;
+		int geometryCapacity;
+		int current;                // geometry of the current mesh position
+	} geometry;
+
+	struct
+	{
+		lm_vec3 *bounds; // min and max of every changed region (lmSetDirtyRegions)
+		int count;       // 0: all texels are rendered
+	} dirty;
 
 	struct
 	{
@@ -278,6 +730,7 @@ struct lm_context
 			unsigned int baseIndex;
 			lm_vec3 p[3];
 			lm_vec2 uv[3];
+			lm_vec3 normal;
 		} triangle;
 
 		struct
@@ -298,34 +751,40 @@ struct lm_context
 		{
 			int side;
 		} hemisphere;
-	} meshPosition;
 
-	struct
-	{
-		int width;
-		int height;
-		int channels;
-		float *data;
+		struct
+		{
+			const lm_sample_plan *plan; // replay recorded sample positions instead of rasterizing (lmSetSamplePlan)
+			unsigned int entry;         // current entry of the current triangle
+			unsigned int end;           // end of the entries of the current triangle
+		} replay;
+	} meshPosition;
 
-#ifdef LM_DEBUG_INTERPOLATION
-		unsigned char *debug;
-#endif
-	} lightmap;
+	lm_targetLightmap lightmap; // target of the current mesh position
 
 	struct
 	{
 		unsigned int size;
 		float zNear, zFar;
 		struct { float r, g, b; } clearColor;
+		lm_hemisphere_projection projection;
+		lm_weight_func weightFunc; // of lmSetHemisphereWeights (to recalculate the weights for another projection)
+		void *weightUserdata;
 
 		unsigned int fbHemiCountX;
 		unsigned int fbHemiCountY;
 		unsigned int fbHemiIndex;
-		lm_ivec2 *fbHemiToLightmapLocation;
-		GLuint fbTexture[2];
-        int fbTextureSize[2][2];
-		GLuint fb[2];
+		lm_lightmapLocation *fbHemiToLightmapLocation;
+		lm_hemisphereSample *fbHemiSamples; // hemisphere orientations to rotate the L1 band into world space (directional only)
+		GLuint fbTexture[3];
+        int fbTextureSize[3][2];
+		lm_bool halfFloat; // GL_RGBA16F framebuffers and half float readbacks
+		lm_bool ambientOcclusion; // fb 0 is depth-only, fb 1 and 2 have one channel (the downsampling ping-pongs between them)
+		GLuint fb[3];
 		GLuint fbDepth;
+		GLuint fbDepthTexture; // instead of the fbDepth renderbuffer (ambientOcclusion only)
+		lm_bool directional; // fb 1 and 2 have 3 more color attachments for the L1 band (the downsampling ping-pongs between them)
+		GLuint fbDirectionTexture[3][3]; // x, y and z attachments of fb 1 and 2
 		GLuint vao;
 		struct
 		{
@@ -334,6 +793,7 @@ struct lm_context
 			GLuint hemispheresTextureSizeID;
 			GLuint weightsTextureID;
 			GLuint weightsTextureSizeID;
+			GLuint depthParametersID; // zNear, zFar, paraboloid (ambientOcclusion only)
 			GLuint weightsTexture;
 			int weightsTextureSize[2];
 		} firstPass;
@@ -343,16 +803,82 @@ struct lm_context
 			GLuint hemispheresTextureID;
 			GLuint hemispheresTextureSizeID;
 		} downsamplePass;
+#ifdef LM_COMPUTE
 		struct
 		{
-			GLuint pbo;
-			lm_bool pboTransferStarted;
-			unsigned int fbHemiCount;
-			lm_ivec2 *fbHemiToLightmapLocation;
+			GLuint programID; // 0 without OpenGL 4.3
+			GLuint resultOffsetID;
+		} reducePass;
+#endif
+		struct
+		{
+			int *viewports;     // 5 sides per batch hemisphere (lmBeginBatch only)
+			float *views;
+			float *projections;
+		} batch;
+		struct
+		{
+			lm_hemisphereTransfer *ring;
+			unsigned int count;   // ring size: max. number of batch transfers in flight
+			unsigned int first;   // oldest batch transfer in flight
+			unsigned int pending; // number of batch transfers in flight
+			double stallTime;     // seconds spent waiting for finished transfers
+			lm_bool timerQueries; // measure the gpu time of each transfer
+			float *results;       // decoded half float readback (halfFloat only)
 		} transfer;
 	} hemisphere;
 
+	struct
+	{
+		lm_bool enabled; // ray traced hemispheres instead of OpenGL rendering (lmCreateCPU)
+
+		lm_vec3 *directions; // hemicube texel directions (x: right, y: up, z: surface normal)
+		lm_vec2 *weights;    // weighted color and validity contribution of each direction
+		int directionCount;
+
+		lm_hemisphereSample *samples; // hemisphere batch (same indices as hemisphere.fbHemiToLightmapLocation)
+		float *results;      // rgba per batch sample
+
+		lm_bvhNode *nodes;
+		lm_bvhTriangle *triangles;
+		int triangleCount;
+
+		lm_vec2 *uvs;        // 3 normalized lightmap coords per mesh triangle
+		lm_vec3 *albedo;     // 3 per mesh triangle or NULL
+		lm_vec3 *emission;   // 3 per mesh triangle or NULL
+
+		struct
+		{
+			const float *data;
+			int width;
+			int height;
+			int channels;
+		} bounce;
+	} cpu;
+
 	float interpolationThreshold;
+	lm_interpolation_error interpolationError;
+	float refinementThreshold;
+
+	struct
+	{
+		lm_debug_func func;
+		void *userdata;
+		unsigned int stages;
+		float *image; // LM_DEBUG_FIRST_PASS readback
+	} debug;
+
+	struct
+	{
+		unsigned int rendered[LM_MAX_PASSES];
+		unsigned int interpolated[LM_MAX_PASSES];
+		unsigned int batches;
+		double rasterizationTime;
+		double gpuTime;
+		double geometryStartTime; // first lmBegin after lmSetGeometry or 0
+		unsigned int cacheHits;
+		unsigned int cacheMisses;
+	} stats;
 };
 
 // pass order of one 4x4 interpolation patch for two interpolation steps (and the next neighbors right of/below it)
@@ -361,6 +887,7 @@ struct lm_context
 // 2 4 3 4 2
 // 5 6 5 6 5
 // 0 4 1 4 0
+// the optional refinement pass after them visits every texel (step size 1)
 
 static unsigned int lm_passStepSize(lm_context *ctx)
 {
@@ -390,11 +917,24 @@ static unsigned int lm_passOffsetY(lm_context *ctx)
 
 static lm_bool lm_hasConservativeTriangleRasterizerFinished(lm_context *ctx)
 {
+	if (ctx->meshPosition.replay.plan)
+		return ctx->meshPosition.replay.entry >= ctx->meshPosition.replay.end;
 	return ctx->meshPosition.rasterizer.y >= ctx->meshPosition.rasterizer.maxy;
 }
 
 static void lm_moveToNextPotentialConservativeTriangleRasterizerPosition(lm_context *ctx)
 {
+	if (ctx->meshPosition.replay.plan)
+	{
+		if (++ctx->meshPosition.replay.entry < ctx->meshPosition.replay.end)
+		{
+			const lm_samplePlanEntry *entry = ctx->meshPosition.replay.plan->entries + ctx->meshPosition.replay.entry;
+			ctx->meshPosition.rasterizer.x = entry->x;
+			ctx->meshPosition.rasterizer.y = entry->y;
+		}
+		return;
+	}
+
 	unsigned int step = lm_passStepSize(ctx);
 	ctx->meshPosition.rasterizer.x += step;
 	while (ctx->meshPosition.rasterizer.x >= ctx->meshPosition.rasterizer.maxx)
@@ -406,102 +946,135 @@ static void lm_moveToNextPotentialConservativeTriangleRasterizerPosition(lm_cont
 	}
 }
 
+// float offset of a texel in the row or tile layout of the target
+static size_t lm_texelOffset(const lm_targetLightmap *target, int x, int y)
+{
+	if (!target->tiled)
+		return ((size_t)y * target->width + x) * target->channels;
+	size_t tile = (size_t)(y / LM_TILE_SIZE) * ((target->width + LM_TILE_SIZE - 1) / LM_TILE_SIZE) + x / LM_TILE_SIZE;
+	return ((tile * LM_TILE_SIZE + y % LM_TILE_SIZE) * LM_TILE_SIZE + x % LM_TILE_SIZE) * target->channels;
+}
+
 static float *lm_getLightmapPixel(lm_context *ctx, int x, int y)
 {
 	assert(x >= 0 && x < ctx->lightmap.width && y >= 0 && y < ctx->lightmap.height);
-	return ctx->lightmap.data + (y * ctx->lightmap.width + x) * ctx->lightmap.channels;
+	return ctx->lightmap.data + lm_texelOffset(&ctx->lightmap, x, y);
 }
 
-static void lm_setLightmapPixel(lm_context *ctx, int x, int y, float *in)
+static lm_bool lm_isTexelCovered(const lm_targetLightmap *target, int x, int y)
 {
-	assert(x >= 0 && x < ctx->lightmap.width && y >= 0 && y < ctx->lightmap.height);
-	float *p = ctx->lightmap.data + (y * ctx->lightmap.width + x) * ctx->lightmap.channels;
-	for (int j = 0; j < ctx->lightmap.channels; j++)
-		*p++ = *in++;
+	unsigned int i = y * target->width + x;
+	return (target->coverage[i >> 3] >> (i & 7)) & 1;
 }
 
-static lm_bool lm_trySamplingConservativeTriangleRasterizerPosition(lm_context *ctx)
+static void lm_setTexelCovered(const lm_targetLightmap *target, int x, int y, lm_bool interpolated)
 {
-	if (lm_hasConservativeTriangleRasterizerFinished(ctx))
-		return LM_FALSE;
+	unsigned int i = y * target->width + x;
+	target->coverage[i >> 3] |= 1 << (i & 7);
+	if (interpolated)
+		target->coverage[lmCoverageSize(target->width, target->height) / 2 + (i >> 3)] |= 1 << (i & 7);
+}
 
-	// check if lightmap pixel was already set
-	float *pixelValue = lm_getLightmapPixel(ctx, ctx->meshPosition.rasterizer.x, ctx->meshPosition.rasterizer.y);
-	for (int j = 0; j < ctx->lightmap.channels; j++)
-		if (pixelValue[j] != 0.0f)
-			return LM_FALSE;
+static lm_bool lm_isTexelInterpolated(const lm_targetLightmap *target, int x, int y)
+{
+	unsigned int i = y * target->width + x;
+	return (target->coverage[lmCoverageSize(target->width, target->height) / 2 + (i >> 3)] >> (i & 7)) & 1;
+}
 
-	// try to interpolate from neighbors:
-	if (ctx->meshPosition.pass > 0)
+static lm_bool lm_isRefinementPass(lm_context *ctx)
+{
+	return ctx->refinementThreshold > 0.0f && ctx->meshPosition.pass == ctx->meshPosition.passCount - 1;
+}
+
+// difference of a lightmap texel value to a reference value in the metric set with lmSetInterpolationError
+static float lm_interpolationError(lm_context *ctx, const float *value, const float *reference)
+{
+	int c = ctx->lightmap.channels;
+	if (ctx->interpolationError == LM_LUMINANCE_ERROR)
 	{
-		float *neighbors[4];
-		int neighborCount = 0;
-		int neighborsExpected = 0;
-		int d = (int)lm_passStepSize(ctx) / 2;
-		int dirs = ((ctx->meshPosition.pass - 1) % 3) + 1;
-		if (dirs & 1) // check x-neighbors with distance d
-		{
-			neighborsExpected += 2;
-			if (ctx->meshPosition.rasterizer.x - d >= ctx->meshPosition.rasterizer.minx &&
-				ctx->meshPosition.rasterizer.x + d <  ctx->meshPosition.rasterizer.maxx)
-			{
-				neighbors[neighborCount++] = lm_getLightmapPixel(ctx, ctx->meshPosition.rasterizer.x - d, ctx->meshPosition.rasterizer.y);
-				neighbors[neighborCount++] = lm_getLightmapPixel(ctx, ctx->meshPosition.rasterizer.x + d, ctx->meshPosition.rasterizer.y);
-			}
-		}
-		if (dirs & 2) // check y-neighbors with distance d
-		{
-			neighborsExpected += 2;
-			if (ctx->meshPosition.rasterizer.y - d >= ctx->meshPosition.rasterizer.miny &&
-				ctx->meshPosition.rasterizer.y + d <  ctx->meshPosition.rasterizer.maxy)
-			{
-				neighbors[neighborCount++] = lm_getLightmapPixel(ctx, ctx->meshPosition.rasterizer.x, ctx->meshPosition.rasterizer.y - d);
-				neighbors[neighborCount++] = lm_getLightmapPixel(ctx, ctx->meshPosition.rasterizer.x, ctx->meshPosition.rasterizer.y + d);
-			}
-		}
-		if (neighborCount == neighborsExpected) // are all interpolation neighbors available?
-		{
-			// calculate average neighbor pixel value
-			float avg[4] = { 0 };
-			for (int i = 0; i < neighborCount; i++)
-				for (int j = 0; j < ctx->lightmap.channels; j++)
-					avg[j] += neighbors[i][j];
-			float ni = 1.0f / neighborCount;
-			for (int j = 0; j < ctx->lightmap.channels; j++)
-				avg[j] *= ni;
+		float v = c >= 3 ? 0.2126f * value[0] + 0.7152f * value[1] + 0.0722f * value[2] : value[0];
+		float r = c >= 3 ? 0.2126f * reference[0] + 0.7152f * reference[1] + 0.0722f * reference[2] : reference[0];
+		return v != r ? lm_absf(v - r) / lm_maxf(lm_absf(r), FLT_MIN) : 0.0f;
+	}
 
-			// check if error from average pixel to neighbors is above the interpolation threshold
-			lm_bool interpolate = LM_TRUE;
-			for (int i = 0; i < neighborCount; i++)
-			{
-				lm_bool zero = LM_TRUE;
-				for (int j = 0; j < ctx->lightmap.channels; j++)
-				{
-					if (neighbors[i][j] != 0.0f)
-						zero = LM_FALSE;
-					if (fabs(neighbors[i][j] - avg[j]) > ctx->interpolationThreshold)
-						interpolate = LM_FALSE;
-				}
-				if (zero)
-					interpolate = LM_FALSE;
-				if (!interpolate)
-					break;
-			}
+	float error = 0.0f;
+	for (int j = 0; j < c; j++)
+	{
+		float e = lm_absf(value[j] - reference[j]);
+		if (ctx->interpolationError == LM_RELATIVE_ERROR && e > 0.0f)
+			e /= lm_maxf(lm_absf(reference[j]), FLT_MIN);
+		error = lm_maxf(error, e);
+	}
+	return error;
+}
 
-			// set interpolated value and return if interpolation is acceptable
-			if (interpolate)
-			{
-				lm_setLightmapPixel(ctx, ctx->meshPosition.rasterizer.x, ctx->meshPosition.rasterizer.y, avg);
-#ifdef LM_DEBUG_INTERPOLATION
-				// set interpolated pixel to green in debug output
-				ctx->lightmap.debug[(ctx->meshPosition.rasterizer.y * ctx->lightmap.width + ctx->meshPosition.rasterizer.x) * 3 + 1] = 255;
-#endif
-				return LM_FALSE;
-			}
-		}
+// an interpolated texel gets rendered in the refinement pass if it differs too much from one of its direct neighbors
+static lm_bool lm_needsRefinement(lm_context *ctx)
+{
+	int x = ctx->meshPosition.rasterizer.x, y = ctx->meshPosition.rasterizer.y;
+	if (!lm_isTexelInterpolated(&ctx->lightmap, x, y))
+		return LM_FALSE;
+
+	const float *value = lm_getLightmapPixel(ctx, x, y);
+	const int dx[] = { -1, 1, 0, 0 }, dy[] = { 0, 0, -1, 1 };
+	for (int i = 0; i < 4; i++)
+	{
+		int nx = x + dx[i], ny = y + dy[i];
+		if (nx >= ctx->meshPosition.rasterizer.minx && nx < ctx->meshPosition.rasterizer.maxx &&
+			ny >= ctx->meshPosition.rasterizer.miny && ny < ctx->meshPosition.rasterizer.maxy &&
+			lm_isTexelCovered(&ctx->lightmap, nx, ny) &&
+			lm_interpolationError(ctx, lm_getLightmapPixel(ctx, nx, ny), value) > ctx->refinementThreshold)
+			return LM_TRUE;
 	}
+	return LM_FALSE;
+}
 
-	// could not interpolate. must render a hemisphere:
+static lm_lightmapLocation lm_currentLightmapLocation(lm_context *ctx)
+{
+	lm_lightmapLocation location;
+	location.x = ctx->meshPosition.rasterizer.x;
+	location.y = ctx->meshPosition.rasterizer.y;
+	location.target = ctx->geometry.geometries[ctx->geometry.current].target;
+	return location;
+}
+
+static void lm_setLightmapPixel(lm_context *ctx, int x, int y, float *in)
+{
+	assert(x >= 0 && x < ctx->lightmap.width && y >= 0 && y < ctx->lightmap.height);
+	float *p = ctx->lightmap.data + lm_texelOffset(&ctx->lightmap, x, y);
+	for (int j = 0; j < ctx->lightmap.channels; j++)
+		*p++ = *in++;
+}
+
+// sets the L1 band of texel x, y to the average of its x-neighbors (dirs & 1) and/or y-neighbors (dirs & 2) with distance d
+static void lm_interpolateDirections(lm_context *ctx, int x, int y, int d, int dirs)
+{
+	const float *neighbors[4];
+	int neighborCount = 0;
+	float *l1 = ctx->lightmap.directions + ((size_t)y * ctx->lightmap.width + x) * 9;
+	if (dirs & 1)
+	{
+		neighbors[neighborCount++] = l1 - d * 9;
+		neighbors[neighborCount++] = l1 + d * 9;
+	}
+	if (dirs & 2)
+	{
+		neighbors[neighborCount++] = l1 - (size_t)d * ctx->lightmap.width * 9;
+		neighbors[neighborCount++] = l1 + (size_t)d * ctx->lightmap.width * 9;
+	}
+	for (int j = 0; j < 9; j++)
+	{
+		float sum = 0.0f;
+		for (int i = 0; i < neighborCount; i++)
+			sum += neighbors[i][j];
+		l1[j] = sum / neighborCount;
+	}
+}
+
+// calculates the hemisphere sample (position, direction and randomized up vector) for the current texel of the
+// current triangle. returns false if the triangle doesn't cover the texel or is degenerate.
+static lm_bool lm_computeSample(lm_context *ctx)
+{
 	lm_vec2 pixel[16];
 	pixel[0] = lm_v2i(ctx->meshPosition.rasterizer.x    , ctx->meshPosition.rasterizer.y    );
 	pixel[1] = lm_v2i(ctx->meshPosition.rasterizer.x + 1, ctx->meshPosition.rasterizer.y    );
@@ -541,7 +1114,7 @@ static lm_bool lm_trySamplingConservativeTriangleRasterizerPosition(lm_context *
 				lm_vec3 v1 = lm_sub3(p1, p0);
 				lm_vec3 v2 = lm_sub3(p2, p0);
 				ctx->meshPosition.sample.position = lm_add3(p0, lm_add3(lm_scale3(v2, uv.x), lm_scale3(v1, uv.y)));
-				ctx->meshPosition.sample.direction = lm_normalize3(lm_cross3(v1, v2));
+				ctx->meshPosition.sample.direction = ctx->meshPosition.triangle.normal;
 
 				if (lm_finite3(ctx->meshPosition.sample.position) &&
 					lm_finite3(ctx->meshPosition.sample.direction) &&
@@ -573,64 +1146,376 @@ static lm_bool lm_trySamplingConservativeTriangleRasterizerPosition(lm_context *
 	return LM_FALSE;
 }
 
-// returns true if a sampling position was found and
-// false if we finished rasterizing the current triangle
-static lm_bool lm_findFirstConservativeTriangleRasterizerPosition(lm_context *ctx)
+// true if one of the regions of lmSetDirtyRegions is within zFar and in front of the current sample position
+static lm_bool lm_hemisphereSeesDirtyRegion(lm_context *ctx)
 {
-	while (!lm_trySamplingConservativeTriangleRasterizerPosition(ctx))
+	lm_vec3 p = ctx->meshPosition.sample.position;
+	lm_vec3 n = ctx->meshPosition.sample.direction;
+	float zFar = ctx->hemisphere.zFar;
+	for (int i = 0; i < ctx->dirty.count; i++)
 	{
-		lm_moveToNextPotentialConservativeTriangleRasterizerPosition(ctx);
-		if (lm_hasConservativeTriangleRasterizerFinished(ctx))
-			return LM_FALSE;
+		lm_vec3 bmin = ctx->dirty.bounds[i * 2 + 0];
+		lm_vec3 bmax = ctx->dirty.bounds[i * 2 + 1];
+		lm_vec3 closest = lm_max3(bmin, lm_min3(p, bmax));
+		lm_vec3 d = lm_sub3(closest, p);
+		if (lm_dot3(d, d) > zFar * zFar)
+			continue;
+		// the box corner that is furthest along the hemisphere direction
+		lm_vec3 corner = lm_v3(n.x > 0.0f ? bmax.x : bmin.x, n.y > 0.0f ? bmax.y : bmin.y, n.z > 0.0f ? bmax.z : bmin.z);
+		if (lm_dot3(lm_sub3(corner, p), n) > 0.0f)
+			return LM_TRUE;
 	}
-	return LM_TRUE;
+	return LM_FALSE;
 }
 
-static lm_bool lm_findNextConservativeTriangleRasterizerPosition(lm_context *ctx)
+static lm_bool lm_trySamplingConservativeTriangleRasterizerPosition(lm_context *ctx)
 {
-	lm_moveToNextPotentialConservativeTriangleRasterizerPosition(ctx);
-	return lm_findFirstConservativeTriangleRasterizerPosition(ctx);
-}
+	if (lm_hasConservativeTriangleRasterizerFinished(ctx))
+		return LM_FALSE;
 
-static void lm_beginProcessHemisphereBatch(lm_context *ctx)
-{
-	if (!ctx->hemisphere.fbHemiIndex)
-		return; // nothing to do
+	// check if lightmap pixel was already set (the refinement pass renders some of the interpolated pixels again)
+	if (lm_isRefinementPass(ctx))
+	{
+		if (!lm_needsRefinement(ctx))
+			return LM_FALSE;
+	}
+	else if (lm_isTexelCovered(&ctx->lightmap, ctx->meshPosition.rasterizer.x, ctx->meshPosition.rasterizer.y))
+		return LM_FALSE;
 
-	glDisable(GL_DEPTH_TEST);
-	glBindVertexArray(ctx->hemisphere.vao);
+	// try to interpolate from neighbors:
+	else if (ctx->meshPosition.pass > 0)
+	{
+		float *neighbors[4];
+		int neighborCount = 0;
+		int neighborsExpected = 0;
+		int d = (int)lm_passStepSize(ctx) / 2;
+		int dirs = ((ctx->meshPosition.pass - 1) % 3) + 1;
+		int x = ctx->meshPosition.rasterizer.x, y = ctx->meshPosition.rasterizer.y;
+		if (dirs & 1) // check x-neighbors with distance d
+		{
+			neighborsExpected += 2;
+			if (x - d >= ctx->meshPosition.rasterizer.minx && x + d < ctx->meshPosition.rasterizer.maxx &&
+				lm_isTexelCovered(&ctx->lightmap, x - d, y) && lm_isTexelCovered(&ctx->lightmap, x + d, y))
+			{
+				neighbors[neighborCount++] = lm_getLightmapPixel(ctx, ctx->meshPosition.rasterizer.x - d, ctx->meshPosition.rasterizer.y);
+				neighbors[neighborCount++] = lm_getLightmapPixel(ctx, ctx->meshPosition.rasterizer.x + d, ctx->meshPosition.rasterizer.y);
+			}
+		}
+		if (dirs & 2) // check y-neighbors with distance d
+		{
+			neighborsExpected += 2;
+			if (y - d >= ctx->meshPosition.rasterizer.miny && y + d < ctx->meshPosition.rasterizer.maxy &&
+				lm_isTexelCovered(&ctx->lightmap, x, y - d) && lm_isTexelCovered(&ctx->lightmap, x, y + d))
+			{
+				neighbors[neighborCount++] = lm_getLightmapPixel(ctx, ctx->meshPosition.rasterizer.x, ctx->meshPosition.rasterizer.y - d);
+				neighbors[neighborCount++] = lm_getLightmapPixel(ctx, ctx->meshPosition.rasterizer.x, ctx->meshPosition.rasterizer.y + d);
+			}
+		}
+		if (neighborCount == neighborsExpected) // are all interpolation neighbors available?
+		{
+			// calculate average neighbor pixel value
+			float avg[4] = { 0 };
+			for (int i = 0; i < neighborCount; i++)
+				for (int j = 0; j < ctx->lightmap.channels; j++)
+					avg[j] += neighbors[i][j];
+			float ni = 1.0f / neighborCount;
+			for (int j = 0; j < ctx->lightmap.channels; j++)
+				avg[j] *= ni;
 
-	int fbRead = 0;
-	int fbWrite = 1;
+			// check if error from average pixel to neighbors is above the interpolation threshold
+			lm_bool interpolate = LM_TRUE;
+			for (int i = 0; i < neighborCount && interpolate; i++)
+				if (lm_interpolationError(ctx, neighbors[i], avg) > ctx->interpolationThreshold)
+					interpolate = LM_FALSE;
 
-	// weighted downsampling pass
-	int outHemiSize = ctx->hemisphere.size / 2;
-	glBindFramebuffer(GL_FRAMEBUFFER, ctx->hemisphere.fb[fbWrite]);
-	glViewport(0, 0, outHemiSize * ctx->hemisphere.fbHemiCountX, outHemiSize * ctx->hemisphere.fbHemiCountY);
-	glUseProgram(ctx->hemisphere.firstPass.programID);
-	glUniform1i(ctx->hemisphere.firstPass.hemispheresTextureID, 0);
-	glUniform2iv(ctx->hemisphere.firstPass.hemispheresTextureSizeID, 1, ctx->hemisphere.fbTextureSize[fbRead]);
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, ctx->hemisphere.fbTexture[fbRead]);
-	glUniform1i(ctx->hemisphere.firstPass.weightsTextureID, 1);
-	glUniform2iv(ctx->hemisphere.firstPass.weightsTextureSizeID, 1, ctx->hemisphere.firstPass.weightsTextureSize);
-	glActiveTexture(GL_TEXTURE1);
-	glBindTexture(GL_TEXTURE_2D, ctx->hemisphere.firstPass.weightsTexture);
-	glActiveTexture(GL_TEXTURE0);
-	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-	glBindTexture(GL_TEXTURE_2D, 0);
+			// set interpolated value and return if interpolation is acceptable
+			if (interpolate)
+			{
+				lm_setLightmapPixel(ctx, ctx->meshPosition.rasterizer.x, ctx->meshPosition.rasterizer.y, avg);
+				if (ctx->lightmap.directions)
+					lm_interpolateDirections(ctx, x, y, d, dirs);
+				lm_setTexelCovered(&ctx->lightmap, ctx->meshPosition.rasterizer.x, ctx->meshPosition.rasterizer.y, LM_TRUE);
+				ctx->stats.interpolated[ctx->meshPosition.pass]++;
+				return LM_FALSE;
+			}
+		}
+	}
 
-#if 1
-	// debug output
-	int w = outHemiSize * ctx->hemisphere.fbHemiCountX, h = outHemiSize * ctx->hemisphere.fbHemiCountY;
-	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
-	glBindFramebuffer(GL_READ_FRAMEBUFFER, ctx->hemisphere.fb[fbWrite]);
-	glReadBuffer(GL_COLOR_ATTACHMENT0);
-	float *image = new float[3 * w * h];
-	glReadPixels(0, 0, w, h, GL_RGB, GL_FLOAT, image);
-	lmImageSaveTGAf("debug_firstpass.tga", image, w, h, 3);
-	delete[] image;
-#endif
+	// could not interpolate. must render a hemisphere:
+	if (ctx->meshPosition.replay.plan)
+	{
+		const lm_sample_plan *plan = ctx->meshPosition.replay.plan;
+		int sample = plan->entries[ctx->meshPosition.replay.entry].sample;
+		if (sample < 0)
+			return LM_FALSE;
+		ctx->meshPosition.sample.position = plan->samples[sample].position;
+		ctx->meshPosition.sample.direction = plan->samples[sample].direction;
+		ctx->meshPosition.sample.up = plan->samples[sample].up;
+	}
+	else if (!lm_computeSample(ctx))
+		return LM_FALSE;
+
+	// ...unless the texel has converged in the previous bounces (lmBakeBounces) or doesn't see a changed region (lmSetDirtyRegions).
+	// it keeps its previous value then (texels without a valid previous value would be invalid again and stay empty).
+	if (ctx->lightmap.previous)
+	{
+		unsigned int i = ctx->meshPosition.rasterizer.y * ctx->lightmap.width + ctx->meshPosition.rasterizer.x;
+		lm_bool valid = (ctx->lightmap.converged[i >> 3] >> (i & 7)) & 1;
+		if (ctx->dirty.count ? !lm_hemisphereSeesDirtyRegion(ctx) : valid)
+		{
+			if (valid)
+			{
+				lm_setLightmapPixel(ctx, ctx->meshPosition.rasterizer.x, ctx->meshPosition.rasterizer.y,
+					ctx->lightmap.previous + lm_texelOffset(&ctx->lightmap, ctx->meshPosition.rasterizer.x, ctx->meshPosition.rasterizer.y));
+				lm_setTexelCovered(&ctx->lightmap, ctx->meshPosition.rasterizer.x, ctx->meshPosition.rasterizer.y, LM_FALSE);
+			}
+			return LM_FALSE;
+		}
+	}
+	return LM_TRUE;
+}
+
+// returns true if a sampling position was found and
+// false if we finished rasterizing the current triangle
+static lm_bool lm_findFirstConservativeTriangleRasterizerPosition(lm_context *ctx)
+{
+	while (!lm_trySamplingConservativeTriangleRasterizerPosition(ctx))
+	{
+		lm_moveToNextPotentialConservativeTriangleRasterizerPosition(ctx);
+		if (lm_hasConservativeTriangleRasterizerFinished(ctx))
+			return LM_FALSE;
+	}
+	return LM_TRUE;
+}
+
+static lm_bool lm_findNextConservativeTriangleRasterizerPosition(lm_context *ctx)
+{
+	lm_moveToNextPotentialConservativeTriangleRasterizerPosition(ctx);
+	return lm_findFirstConservativeTriangleRasterizerPosition(ctx);
+}
+
+// writes the integrated hemisphere value c (rgb: weighted sum, a: weighted valid sample count) to the lightmap
+// and the world space L1 band sums (x, y and z rgb) to the directions of the target if both are given
+static void lm_storeHemisphereResult(lm_context *ctx, lm_lightmapLocation location, const float *c, const float *directions)
+{
+	float validity = c[3];
+	const lm_targetLightmap *target = ctx->geometry.targets + location.target;
+	float *lm = target->data + lm_texelOffset(target, location.x, location.y);
+	lm_bool refine = lm_isRefinementPass(ctx) && lm_isTexelInterpolated(target, location.x, location.y);
+	if ((!lm_isTexelCovered(target, location.x, location.y) || refine) && validity > 0.9)
+	{
+		float scale = 1.0f / validity;
+		float minValue = target->ownsCoverage ? FLT_MIN : 0.0f; // without a coverage bitmap, 0 means empty
+		switch (target->channels)
+		{
+		case 1:
+			lm[0] = lm_maxf((c[0] + c[1] + c[2]) * scale / 3.0f, minValue);
+			break;
+		case 2:
+			lm[0] = lm_maxf((c[0] + c[1] + c[2]) * scale / 3.0f, minValue);
+			lm[1] = 1.0f; // do we want to support this format?
+			break;
+		case 3:
+			lm[0] = lm_maxf(c[0] * scale, minValue);
+			lm[1] = lm_maxf(c[1] * scale, minValue);
+			lm[2] = lm_maxf(c[2] * scale, minValue);
+			break;
+		case 4:
+			lm[0] = lm_maxf(c[0] * scale, minValue);
+			lm[1] = lm_maxf(c[1] * scale, minValue);
+			lm[2] = lm_maxf(c[2] * scale, minValue);
+			lm[3] = 1.0f;
+			break;
+		default:
+			assert(LM_FALSE);
+			break;
+		}
+		if (directions && target->directions)
+		{
+			float *l1 = target->directions + ((size_t)location.y * target->width + location.x) * 9;
+			for (int j = 0; j < 9; j++)
+				l1[j] = directions[j] * scale;
+		}
+
+		lm_setTexelCovered(target, location.x, location.y, LM_FALSE);
+		if (refine) // the texel is rendered now
+		{
+			unsigned int i = location.y * target->width + location.x;
+			target->coverage[lmCoverageSize(target->width, target->height) / 2 + (i >> 3)] &= ~(1 << (i & 7));
+		}
+	}
+}
+
+static lm_bool lm_intersectTriangle(const lm_bvhTriangle *t, lm_vec3 o, lm_vec3 d, float tMin, float *tMax, lm_hit *hit)
+{
+	// moeller-trumbore
+	lm_vec3 pvec = lm_cross3(d, t->e2);
+	float det = lm_dot3(t->e1, pvec);
+	if (lm_absf(det) < 1e-12f)
+		return LM_FALSE;
+	float invDet = 1.0f / det;
+	lm_vec3 tvec = lm_sub3(o, t->p0);
+	float u = lm_dot3(tvec, pvec) * invDet;
+	if (u < 0.0f || u > 1.0f)
+		return LM_FALSE;
+	lm_vec3 qvec = lm_cross3(tvec, t->e1);
+	float v = lm_dot3(d, qvec) * invDet;
+	if (v < 0.0f || u + v > 1.0f)
+		return LM_FALSE;
+	float dist = lm_dot3(t->e2, qvec) * invDet;
+	if (dist <= tMin || dist >= *tMax)
+		return LM_FALSE;
+	*tMax = dist;
+	hit->triangle = t->index;
+	hit->u = u;
+	hit->v = v;
+	hit->frontFacing = det > 0.0f; // same winding as the normal that is used for the hemisphere direction
+	return LM_TRUE;
+}
+
+static inline lm_bool lm_intersectBounds(const lm_bvhNode *node, lm_vec3 o, lm_vec3 invD, float tMin, float tMax)
+{
+	float tx0 = (node->bmin.x - o.x) * invD.x, tx1 = (node->bmax.x - o.x) * invD.x;
+	float ty0 = (node->bmin.y - o.y) * invD.y, ty1 = (node->bmax.y - o.y) * invD.y;
+	float tz0 = (node->bmin.z - o.z) * invD.z, tz1 = (node->bmax.z - o.z) * invD.z;
+	float t0 = lm_maxf(lm_maxf(lm_minf(tx0, tx1), lm_minf(ty0, ty1)), lm_maxf(lm_minf(tz0, tz1), tMin));
+	float t1 = lm_minf(lm_minf(lm_maxf(tx0, tx1), lm_maxf(ty0, ty1)), lm_minf(lm_maxf(tz0, tz1), tMax));
+	return t0 <= t1;
+}
+
+// finds the closest hit in (tMin, tMax)
+static lm_bool lm_cpuTrace(const lm_context *ctx, lm_vec3 o, lm_vec3 d, float tMin, float tMax, lm_hit *hit)
+{
+	if (!ctx->cpu.triangleCount)
+		return LM_FALSE;
+
+	lm_vec3 invD = lm_v3(1.0f / d.x, 1.0f / d.y, 1.0f / d.z);
+	lm_bool found = LM_FALSE;
+	int stack[LM_BVH_MAX_DEPTH + 1]; // one sibling per level and both children of the deepest inner node
+	int stackSize = 0;
+	stack[stackSize++] = 0;
+	while (stackSize)
+	{
+		const lm_bvhNode *node = ctx->cpu.nodes + stack[--stackSize];
+		if (!lm_intersectBounds(node, o, invD, tMin, tMax))
+			continue;
+		if (node->count)
+		{
+			for (int i = 0; i < node->count; i++)
+				found |= lm_intersectTriangle(ctx->cpu.triangles + node->first + i, o, d, tMin, &tMax, hit);
+		}
+		else
+		{
+			assert(stackSize + 2 <= LM_BVH_MAX_DEPTH + 1);
+			// visit the child on the side of the ray origin first
+			const lm_bvhNode *left = ctx->cpu.nodes + node->first;
+			const lm_bvhNode *right = left + 1;
+			lm_vec3 lc = lm_add3(left->bmin, left->bmax);
+			lm_vec3 rc = lm_add3(right->bmin, right->bmax);
+			lm_bool leftFirst = lm_dot3(lm_sub3(rc, lc), d) > 0.0f;
+			stack[stackSize++] = node->first + (leftFirst ? 1 : 0);
+			stack[stackSize++] = node->first + (leftFirst ? 0 : 1);
+		}
+	}
+	return found;
+}
+
+static lm_vec3 lm_cpuBounceLookup(const lm_context *ctx, lm_vec2 uv)
+{
+	// bilinear filtered lookup with clamp to edge
+	int w = ctx->cpu.bounce.width, h = ctx->cpu.bounce.height, c = ctx->cpu.bounce.channels;
+	float fx = uv.x * w - 0.5f, fy = uv.y * h - 0.5f;
+	float x0f = floorf(fx), y0f = floorf(fy);
+	float tx = fx - x0f, ty = fy - y0f;
+	int x0 = lm_mini(lm_maxi((int)x0f, 0), w - 1), x1 = lm_mini(lm_maxi((int)x0f + 1, 0), w - 1);
+	int y0 = lm_mini(lm_maxi((int)y0f, 0), h - 1), y1 = lm_mini(lm_maxi((int)y0f + 1, 0), h - 1);
+	const float *p[4] = {
+		ctx->cpu.bounce.data + (y0 * w + x0) * c, ctx->cpu.bounce.data + (y0 * w + x1) * c,
+		ctx->cpu.bounce.data + (y1 * w + x0) * c, ctx->cpu.bounce.data + (y1 * w + x1) * c };
+	float f[4] = { (1.0f - tx) * (1.0f - ty), tx * (1.0f - ty), (1.0f - tx) * ty, tx * ty };
+	lm_vec3 result = lm_v3(0.0f, 0.0f, 0.0f);
+	for (int i = 0; i < 4; i++)
+		result = lm_add3(result, lm_scale3(c >= 3 ? lm_v3(p[i][0], p[i][1], p[i][2]) : lm_v3(p[i][0], p[i][0], p[i][0]), f[i]));
+	return result;
+}
+
+static lm_vec3 lm_cpuRadiance(const lm_context *ctx, const lm_hit *hit)
+{
+	float w[3] = { 1.0f - hit->u - hit->v, hit->u, hit->v };
+	unsigned int t = 3 * hit->triangle;
+	lm_vec3 radiance = lm_v3(0.0f, 0.0f, 0.0f);
+	if (ctx->cpu.emission)
+		for (int i = 0; i < 3; i++)
+			radiance = lm_add3(radiance, lm_scale3(ctx->cpu.emission[t + i], w[i]));
+	if (ctx->cpu.bounce.data)
+	{
+		lm_vec2 uv = lm_v2(0.0f, 0.0f);
+		lm_vec3 albedo = lm_v3(0.0f, 0.0f, 0.0f);
+		for (int i = 0; i < 3; i++)
+		{
+			uv = lm_add2(uv, lm_scale2(ctx->cpu.uvs[t + i], w[i]));
+			albedo = lm_add3(albedo, lm_scale3(ctx->cpu.albedo ? ctx->cpu.albedo[t + i] : lm_v3(1.0f, 1.0f, 1.0f), w[i]));
+		}
+		radiance = lm_add3(radiance, lm_mul3(albedo, lm_cpuBounceLookup(ctx, uv)));
+	}
+	return radiance;
+}
+
+static void lm_cpuIntegrateHemispheres(void *userdata, int begin, int end)
+{
+	lm_context *ctx = (lm_context*)userdata;
+	for (int i = begin; i < end; i++)
+	{
+		const lm_hemisphereSample *sample = ctx->cpu.samples + i;
+		lm_vec3 right = lm_cross3(sample->direction, sample->up);
+		float sum[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+		for (int j = 0; j < ctx->cpu.directionCount; j++)
+		{
+			lm_vec3 t = ctx->cpu.directions[j];
+			lm_vec3 d = lm_add3(lm_add3(lm_scale3(right, t.x), lm_scale3(sample->up, t.y)), lm_scale3(sample->direction, t.z));
+			lm_vec2 w = ctx->cpu.weights[j];
+			lm_hit hit;
+			if (lm_cpuTrace(ctx, sample->position, d, ctx->hemisphere.zNear, ctx->hemisphere.zFar, &hit))
+			{
+				lm_vec3 radiance = lm_cpuRadiance(ctx, &hit);
+				sum[0] += radiance.x * w.x;
+				sum[1] += radiance.y * w.x;
+				sum[2] += radiance.z * w.x;
+				sum[3] += hit.frontFacing ? w.y : 0.0f;
+			}
+			else
+			{
+				sum[0] += ctx->hemisphere.clearColor.r * w.x;
+				sum[1] += ctx->hemisphere.clearColor.g * w.x;
+				sum[2] += ctx->hemisphere.clearColor.b * w.x;
+				sum[3] += w.y;
+			}
+		}
+		for (int j = 0; j < 4; j++)
+			ctx->cpu.results[i * 4 + j] = sum[j];
+	}
+}
+
+static void lm_cpuProcessHemisphereBatch(lm_context *ctx)
+{
+	lm_parallelFor(ctx->hemisphere.fbHemiIndex, 4, lm_cpuIntegrateHemispheres, ctx);
+	if (ctx->debug.stages & LM_DEBUG_BATCH_RESULTS)
+		ctx->debug.func(LM_DEBUG_BATCH_RESULTS, ctx->cpu.results, ctx->hemisphere.fbHemiCountX,
+			(ctx->hemisphere.fbHemiIndex + ctx->hemisphere.fbHemiCountX - 1) / ctx->hemisphere.fbHemiCountX, 4, ctx->debug.userdata);
+	for (unsigned int i = 0; i < ctx->hemisphere.fbHemiIndex; i++)
+		lm_storeHemisphereResult(ctx, ctx->hemisphere.fbHemiToLightmapLocation[i], ctx->cpu.results + i * 4, NULL);
+	ctx->hemisphere.fbHemiIndex = 0;
+}
+
+// color attachment i of fb (the lightmap values or the x, y and z L1 band of directional contexts)
+static GLuint lm_hemisphereBatchTexture(lm_context *ctx, int fb, int i)
+{
+	return i == 0 ? ctx->hemisphere.fbTexture[fb] : ctx->hemisphere.fbDirectionTexture[fb][i - 1];
+}
+
+static void lm_downsampleHemisphereBatch(lm_context *ctx, lm_hemisphereTransfer *transfer, int fbRead, int fbWrite, int outHemiSize)
+{
+	int attachments = ctx->hemisphere.directional ? 4 : 1;
 
 	// downsampling passes
 	glUseProgram(ctx->hemisphere.downsamplePass.programID);
@@ -641,42 +1526,165 @@ static void lm_beginProcessHemisphereBatch(lm_context *ctx)
 		outHemiSize /= 2;
 		glBindFramebuffer(GL_FRAMEBUFFER, ctx->hemisphere.fb[fbWrite]);
 		glViewport(0, 0, outHemiSize * ctx->hemisphere.fbHemiCountX, outHemiSize * ctx->hemisphere.fbHemiCountY);
-		glBindTexture(GL_TEXTURE_2D, ctx->hemisphere.fbTexture[fbRead]);
         glUniform2iv(ctx->hemisphere.downsamplePass.hemispheresTextureSizeID, 1, ctx->hemisphere.fbTextureSize[fbRead]);
-		glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+		for (int i = 0; i < attachments; i++)
+		{
+			if (ctx->hemisphere.directional)
+				glDrawBuffer(GL_COLOR_ATTACHMENT0 + i);
+			glBindTexture(GL_TEXTURE_2D, lm_hemisphereBatchTexture(ctx, fbRead, i));
+			glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+		}
 		glBindTexture(GL_TEXTURE_2D, 0);
 	}
 
-	if (fbWrite == 0) // copy to other fb if we end up in fb 0, so that fb 0 can be written to while the data is async transferred!
+	if (fbWrite != 1) // copy to fb 1 if we end up in fb 0 (or 2), so that fb 0 can be written to while the data is async transferred!
 	{
 		glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
 		LM_SWAP(int, fbRead, fbWrite);
 		glBindFramebuffer(GL_READ_FRAMEBUFFER, ctx->hemisphere.fb[fbRead]);
-		glReadBuffer(GL_COLOR_ATTACHMENT0);
 		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, ctx->hemisphere.fb[fbWrite]);
-		glDrawBuffer(GL_COLOR_ATTACHMENT0);
-		glBlitFramebuffer(
-			0, 0, ctx->hemisphere.fbHemiCountX, ctx->hemisphere.fbHemiCountY,
-			0, 0, ctx->hemisphere.fbHemiCountX, ctx->hemisphere.fbHemiCountY,
-			GL_COLOR_BUFFER_BIT, GL_NEAREST);
+		for (int i = 0; i < attachments; i++)
+		{
+			glReadBuffer(GL_COLOR_ATTACHMENT0 + i);
+			glDrawBuffer(GL_COLOR_ATTACHMENT0 + i);
+			glBlitFramebuffer(
+				0, 0, ctx->hemisphere.fbHemiCountX, ctx->hemisphere.fbHemiCountY,
+				0, 0, ctx->hemisphere.fbHemiCountX, ctx->hemisphere.fbHemiCountY,
+				GL_COLOR_BUFFER_BIT, GL_NEAREST);
+		}
 		glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
 		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
 
 		glBindFramebuffer(GL_FRAMEBUFFER, ctx->hemisphere.fb[fbWrite]);
 	}
 
-	// start GPU->CPU transfer of downsampled hemispheres
-	glBindBuffer(GL_PIXEL_PACK_BUFFER, ctx->hemisphere.transfer.pbo);
+	// start GPU->CPU transfer of downsampled hemispheres into the pbo
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, transfer->pbo);
 	glBindFramebuffer(GL_READ_FRAMEBUFFER, ctx->hemisphere.fb[1]);
-	glReadBuffer(GL_COLOR_ATTACHMENT0);
 	glClampColor(GL_CLAMP_READ_COLOR, GL_FALSE);
-	glReadPixels(0, 0, ctx->hemisphere.fbHemiCountX, ctx->hemisphere.fbHemiCountY, GL_RGBA, GL_FLOAT, 0);
+	if (ctx->hemisphere.ambientOcclusion)
+	{
+		glReadBuffer(GL_COLOR_ATTACHMENT0);
+		glReadPixels(0, 0, ctx->hemisphere.fbHemiCountX, ctx->hemisphere.fbHemiCountY, GL_RED, GL_FLOAT, 0);
+	}
+	else
+	{
+		size_t size = ctx->hemisphere.fbHemiCountX * ctx->hemisphere.fbHemiCountY * 4 * (ctx->hemisphere.halfFloat ? sizeof(unsigned short) : sizeof(float));
+		for (int i = 0; i < attachments; i++)
+		{
+			glReadBuffer(GL_COLOR_ATTACHMENT0 + i);
+			glReadPixels(0, 0, ctx->hemisphere.fbHemiCountX, ctx->hemisphere.fbHemiCountY, GL_RGBA, ctx->hemisphere.halfFloat ? GL_HALF_FLOAT : GL_FLOAT, (void*)(i * size));
+		}
+	}
 	glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+#ifdef LM_COMPUTE
+static void lm_reduceHemisphereBatch(lm_context *ctx, lm_hemisphereTransfer *transfer, int fbWrite)
+{
+	// one work group per hemisphere sums the weighted first pass results and writes them right into the pbo
+	glUseProgram(ctx->hemisphere.reducePass.programID);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, transfer->pbo);
+	for (int i = 0; i < (ctx->hemisphere.directional ? 4 : 1); i++)
+	{
+		glUniform1i(ctx->hemisphere.reducePass.resultOffsetID, i * ctx->hemisphere.fbHemiCountX * ctx->hemisphere.fbHemiCountY);
+		glBindTexture(GL_TEXTURE_2D, lm_hemisphereBatchTexture(ctx, fbWrite, i));
+		glDispatchCompute(ctx->hemisphere.fbHemiCountX, ctx->hemisphere.fbHemiCountY, 1);
+	}
+	glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT); // the results are read with glMapBuffer
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, 0);
+	glBindTexture(GL_TEXTURE_2D, 0);
+}
+#endif
+
+static void lm_beginProcessHemisphereBatch(lm_context *ctx)
+{
+	if (!ctx->hemisphere.fbHemiIndex)
+		return; // nothing to do
+
+	ctx->stats.batches++;
+	if (ctx->cpu.enabled)
+	{
+		lm_cpuProcessHemisphereBatch(ctx); // there is nothing to transfer. we are done after this.
+		return;
+	}
+
+	// the next free pbo of the transfer ring
+	assert(ctx->hemisphere.transfer.pending < ctx->hemisphere.transfer.count);
+	lm_hemisphereTransfer *transfer = ctx->hemisphere.transfer.ring +
+		(ctx->hemisphere.transfer.first + ctx->hemisphere.transfer.pending) % ctx->hemisphere.transfer.count;
+#ifdef GL_TIME_ELAPSED
+	if (transfer->timerQuery)
+		glBeginQuery(GL_TIME_ELAPSED, transfer->timerQuery);
+#endif
+
+	glDisable(GL_DEPTH_TEST);
+	glBindVertexArray(ctx->hemisphere.vao);
+
+	int fbRead = 0;
+	int fbWrite = 1;
+
+	// weighted downsampling pass
+	int outHemiSize = ctx->hemisphere.size / 2;
+	glBindFramebuffer(GL_FRAMEBUFFER, ctx->hemisphere.fb[fbWrite]);
+	if (ctx->hemisphere.directional)
+	{ // lightmap values and the L1 band at once
+		const GLenum buffers[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2, GL_COLOR_ATTACHMENT3 };
+		glDrawBuffers(4, buffers);
+	}
+	glViewport(0, 0, outHemiSize * ctx->hemisphere.fbHemiCountX, outHemiSize * ctx->hemisphere.fbHemiCountY);
+	glUseProgram(ctx->hemisphere.firstPass.programID);
+	glUniform1i(ctx->hemisphere.firstPass.hemispheresTextureID, 0);
+	glUniform2iv(ctx->hemisphere.firstPass.hemispheresTextureSizeID, 1, ctx->hemisphere.fbTextureSize[fbRead]);
+	glActiveTexture(GL_TEXTURE0);
+	if (ctx->hemisphere.ambientOcclusion)
+	{
+		glBindTexture(GL_TEXTURE_2D, ctx->hemisphere.fbDepthTexture);
+		glUniform3f(ctx->hemisphere.firstPass.depthParametersID, ctx->hemisphere.zNear, ctx->hemisphere.zFar,
+			ctx->hemisphere.projection == LM_PARABOLOID ? 1.0f : 0.0f);
+	}
+	else
+		glBindTexture(GL_TEXTURE_2D, ctx->hemisphere.fbTexture[fbRead]);
+	glUniform1i(ctx->hemisphere.firstPass.weightsTextureID, 1);
+	glUniform2iv(ctx->hemisphere.firstPass.weightsTextureSizeID, 1, ctx->hemisphere.firstPass.weightsTextureSize);
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, ctx->hemisphere.firstPass.weightsTexture);
+	glActiveTexture(GL_TEXTURE0);
+	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	if (ctx->debug.stages & LM_DEBUG_FIRST_PASS)
+	{
+		int w = outHemiSize * ctx->hemisphere.fbHemiCountX, h = outHemiSize * ctx->hemisphere.fbHemiCountY;
+		if (!ctx->debug.image)
+			ctx->debug.image = (float*)LM_CALLOC(w * h * 4, sizeof(float));
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, ctx->hemisphere.fb[fbWrite]);
+		glReadBuffer(GL_COLOR_ATTACHMENT0);
+		glClampColor(GL_CLAMP_READ_COLOR, GL_FALSE);
+		glReadPixels(0, 0, w, h, GL_RGBA, GL_FLOAT, ctx->debug.image);
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+		ctx->debug.func(LM_DEBUG_FIRST_PASS, ctx->debug.image, w, h, 4, ctx->debug.userdata);
+	}
+
+	// reduce every hemisphere to one value and start the GPU->CPU transfer into the pbo
+#ifdef LM_COMPUTE
+	if (ctx->hemisphere.reducePass.programID)
+		lm_reduceHemisphereBatch(ctx, transfer, fbWrite);
+	else
+#endif
+		lm_downsampleHemisphereBatch(ctx, transfer, ctx->hemisphere.ambientOcclusion || ctx->hemisphere.directional ? 2 : fbRead, fbWrite, outHemiSize); // ping-pong between fb 1 and 2
+#ifdef GL_TIME_ELAPSED
+	if (transfer->timerQuery)
+		glEndQuery(GL_TIME_ELAPSED);
+#endif
+	transfer->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
 
-	LM_SWAP(lm_ivec2*, ctx->hemisphere.transfer.fbHemiToLightmapLocation, ctx->hemisphere.fbHemiToLightmapLocation);
-	ctx->hemisphere.transfer.fbHemiCount = ctx->hemisphere.fbHemiIndex;
-	ctx->hemisphere.transfer.pboTransferStarted = LM_TRUE;
+	LM_SWAP(lm_lightmapLocation*, transfer->fbHemiToLightmapLocation, ctx->hemisphere.fbHemiToLightmapLocation);
+	LM_SWAP(lm_hemisphereSample*, transfer->fbHemiSamples, ctx->hemisphere.fbHemiSamples);
+	transfer->fbHemiCount = ctx->hemisphere.fbHemiIndex;
+	ctx->hemisphere.transfer.pending++;
 
 	glBindFramebuffer(GL_FRAMEBUFFER, 0);
 	glBindVertexArray(0);
@@ -685,21 +1693,74 @@ static void lm_beginProcessHemisphereBatch(lm_context *ctx)
 	ctx->hemisphere.fbHemiIndex = 0;
 }
 
+static float lm_halfToFloat(unsigned short h)
+{
+	union { unsigned int u; float f; } v;
+	unsigned int sign = (unsigned int)(h & 0x8000) << 16;
+	unsigned int exponent = (h >> 10) & 0x1f;
+	unsigned int mantissa = h & 0x3ff;
+	if (exponent == 0x1f) // inf/nan
+		v.u = sign | 0x7f800000 | (mantissa << 13);
+	else if (exponent) // normalized
+		v.u = sign | ((exponent + 112) << 23) | (mantissa << 13);
+	else // zero/denormalized: mantissa * 2^-24
+	{
+		v.f = (float)mantissa * (1.0f / 16777216.0f);
+		v.u |= sign;
+	}
+	return v.f;
+}
+
+static void lm_decodeHalfs(const unsigned short *in, float *out, int n)
+{
+	int i = 0;
+#ifdef LM_F16C
+	for (; i + 4 <= n; i += 4)
+		_mm_storeu_ps(out + i, _mm_cvtph_ps(_mm_loadl_epi64((const __m128i*)(in + i))));
+#endif
+	for (; i < n; i++)
+		out[i] = lm_halfToFloat(in[i]);
+}
+
 static void lm_finishProcessHemisphereBatch(lm_context *ctx)
 {
-	if (!ctx->hemisphere.transfer.pboTransferStarted)
+	if (!ctx->hemisphere.transfer.pending)
 		return; // nothing to do
 
-	// finish the GPU->CPU transfer of downsampled hemispheres
-	glBindBuffer(GL_PIXEL_PACK_BUFFER, ctx->hemisphere.transfer.pbo);
-	float *hemi = (float*)glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+	// finish the oldest GPU->CPU transfer of downsampled hemispheres
+	lm_hemisphereTransfer *transfer = ctx->hemisphere.transfer.ring + ctx->hemisphere.transfer.first;
+	double waitStart = lm_time();
+	while (glClientWaitSync(transfer->fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED);
+	glDeleteSync(transfer->fence);
+	transfer->fence = 0;
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, transfer->pbo);
+	void *mapped = glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+	ctx->hemisphere.transfer.stallTime += lm_time() - waitStart;
+#ifdef GL_TIME_ELAPSED
+	if (transfer->timerQuery)
+	{
+		GLuint64 gpuTime = 0; // available since the fence was signaled
+		glGetQueryObjectui64v(transfer->timerQuery, GL_QUERY_RESULT, &gpuTime);
+		ctx->stats.gpuTime += (double)gpuTime * 1e-9;
+	}
+#endif
 	//float *hemi = (float*)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, ctx->hemisphere.transfer.fbHemiCount * 4 * sizeof(float), GL_MAP_READ_BIT);
-	assert(hemi);
-	if (!hemi)
+	assert(mapped);
+	if (!mapped)
 	{
 		fprintf(stderr, "Fatal error! Could not map hemisphere buffer!\n");
 		exit(-1);
 	}
+	float *hemi = (float*)mapped;
+	int hemiChannels = ctx->hemisphere.ambientOcclusion ? 1 : 4;
+	if (ctx->hemisphere.halfFloat && !ctx->hemisphere.ambientOcclusion)
+	{
+		hemi = ctx->hemisphere.transfer.results;
+		lm_decodeHalfs((const unsigned short*)mapped, hemi, ctx->hemisphere.fbHemiCountX * ctx->hemisphere.fbHemiCountY * 4 * (ctx->hemisphere.directional ? 4 : 1));
+	}
+	if (ctx->debug.stages & LM_DEBUG_BATCH_RESULTS)
+		ctx->debug.func(LM_DEBUG_BATCH_RESULTS, hemi, ctx->hemisphere.fbHemiCountX,
+			(transfer->fbHemiCount + ctx->hemisphere.fbHemiCountX - 1) / ctx->hemisphere.fbHemiCountX, hemiChannels, ctx->debug.userdata);
 
 	// write results to lightmap texture
 	unsigned int hemiIndex = 0;
@@ -707,52 +1768,47 @@ static void lm_finishProcessHemisphereBatch(lm_context *ctx)
 	{
 		for (unsigned int hx = 0; hx < ctx->hemisphere.fbHemiCountX; hx++)
 		{
-			float *c = hemi + (hy * ctx->hemisphere.fbHemiCountX + hx) * 4;
-			float validity = c[3];
-
-			lm_ivec2 lmUV = ctx->hemisphere.transfer.fbHemiToLightmapLocation[hy * ctx->hemisphere.fbHemiCountX + hx];
-			float *lm = ctx->lightmap.data + (lmUV.y * ctx->lightmap.width + lmUV.x) * ctx->lightmap.channels;
-			if (!lm[0] && validity > 0.9)
-			{
-				float scale = 1.0f / validity;
-				switch (ctx->lightmap.channels)
+			unsigned int i = hy * ctx->hemisphere.fbHemiCountX + hx;
+			const float *result = hemi + i * hemiChannels;
+			float visibility[4];
+			if (ctx->hemisphere.ambientOcclusion)
+			{ // every direction is valid
+				visibility[0] = visibility[1] = visibility[2] = result[0];
+				visibility[3] = 1.0f;
+				result = visibility;
+			}
+			float directions[9];
+			if (ctx->hemisphere.directional)
+			{ // rotate the L1 band from the hemisphere frame into world space
+				unsigned int n = ctx->hemisphere.fbHemiCountX * ctx->hemisphere.fbHemiCountY;
+				const float *lx = hemi + (n + i) * 4, *ly = hemi + (2 * n + i) * 4, *lz = hemi + (3 * n + i) * 4;
+				const lm_hemisphereSample *sample = transfer->fbHemiSamples + i;
+				lm_vec3 right = lm_cross3(sample->direction, sample->up);
+				for (int j = 0; j < 3; j++)
 				{
-				case 1:
-					lm[0] = lm_maxf((c[0] + c[1] + c[2]) * scale / 3.0f, FLT_MIN);
-					break;
-				case 2:
-					lm[0] = lm_maxf((c[0] + c[1] + c[2]) * scale / 3.0f, FLT_MIN);
-					lm[1] = 1.0f; // do we want to support this format?
-					break;
-				case 3:
-					lm[0] = lm_maxf(c[0] * scale, FLT_MIN);
-					lm[1] = lm_maxf(c[1] * scale, FLT_MIN);
-					lm[2] = lm_maxf(c[2] * scale, FLT_MIN);
-					break;
-				case 4:
-					lm[0] = lm_maxf(c[0] * scale, FLT_MIN);
-					lm[1] = lm_maxf(c[1] * scale, FLT_MIN);
-					lm[2] = lm_maxf(c[2] * scale, FLT_MIN);
-					lm[3] = 1.0f;
-					break;
-				default:
-					assert(LM_FALSE);
-					break;
+					lm_vec3 d = lm_add3(lm_add3(lm_scale3(right, lx[j]), lm_scale3(sample->up, ly[j])), lm_scale3(sample->direction, lz[j]));
+					directions[j] = d.x;
+					directions[3 + j] = d.y;
+					directions[6 + j] = d.z;
 				}
-
-#ifdef LM_DEBUG_INTERPOLATION
-				// set sampled pixel to red in debug output
-				ctx->lightmap.debug[(lmUV.y * ctx->lightmap.width + lmUV.x) * 3 + 0] = 255;
-#endif
 			}
+			lm_storeHemisphereResult(ctx, transfer->fbHemiToLightmapLocation[i], result, ctx->hemisphere.directional ? directions : NULL);
 
-			if (++hemiIndex == ctx->hemisphere.transfer.fbHemiCount)
+			if (++hemiIndex == transfer->fbHemiCount)
 				goto done;
 		}
 	}
 done:
 	glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
-	ctx->hemisphere.transfer.pboTransferStarted = LM_FALSE;
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	ctx->hemisphere.transfer.first = (ctx->hemisphere.transfer.first + 1) % ctx->hemisphere.transfer.count;
+	ctx->hemisphere.transfer.pending--;
+}
+
+static void lm_finishAllHemisphereBatches(lm_context *ctx)
+{
+	while (ctx->hemisphere.transfer.pending)
+		lm_finishProcessHemisphereBatch(ctx);
 }
 
 static void lm_setView(
@@ -780,12 +1836,44 @@ static void lm_setView(
 	proj[12] = 0.0f;          proj[13] = 0.0f;          proj[14] = f * n2 * ninf;  proj[15] = 0.0f;
 }
 
+static void lm_setParaboloidProjection(float* proj, float n, float f)
+{
+	// maps (paraboloid x, paraboloid y, depth along the view direction, 1) to clip space
+	for (int i = 0; i < 16; i++)
+		proj[i] = 0.0f;
+	proj[ 0] = 1.0f;
+	proj[ 5] = 1.0f;
+	proj[10] = 2.0f / (f - n);
+	proj[14] = -(f + n) / (f - n);
+	proj[15] = 1.0f;
+}
+
+static int lm_hemisphereSideCount(lm_context *ctx)
+{
+	return ctx->hemisphere.projection == LM_PARABOLOID ? 1 : 5;
+}
+
 // returns true if a hemisphere side was prepared for rendering and
 // false if we finished the current hemisphere
 static lm_bool lm_beginSampleHemisphere(lm_context *ctx, int* viewport, float* view, float* proj)
 {
-	if (ctx->meshPosition.hemisphere.side >= 5)
+	if (ctx->meshPosition.hemisphere.side >= lm_hemisphereSideCount(ctx))
+		return LM_FALSE;
+
+	if (ctx->cpu.enabled)
+	{
+		// queue the hemisphere for ray casting. there is nothing to render.
+		lm_hemisphereSample *sample = ctx->cpu.samples + ctx->hemisphere.fbHemiIndex;
+		sample->position = ctx->meshPosition.sample.position;
+		sample->direction = ctx->meshPosition.sample.direction;
+		sample->up = ctx->meshPosition.sample.up;
+		ctx->hemisphere.fbHemiToLightmapLocation[ctx->hemisphere.fbHemiIndex] = lm_currentLightmapLocation(ctx);
+		ctx->stats.rendered[ctx->meshPosition.pass]++;
+		if (++ctx->hemisphere.fbHemiIndex == ctx->hemisphere.fbHemiCountX * ctx->hemisphere.fbHemiCountY)
+			lm_beginProcessHemisphereBatch(ctx); // counts the batch and ray traces it
+		ctx->meshPosition.hemisphere.side = 5;
 		return LM_FALSE;
+	}
 
 	if (ctx->meshPosition.hemisphere.side == 0)
 	{
@@ -800,8 +1888,15 @@ static lm_bool lm_beginSampleHemisphere(lm_context *ctx, int* viewport, float* v
 				ctx->hemisphere.clearColor.b, 1.0f);
 			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 		}
-		ctx->hemisphere.fbHemiToLightmapLocation[ctx->hemisphere.fbHemiIndex] = 
-			lm_i2(ctx->meshPosition.rasterizer.x, ctx->meshPosition.rasterizer.y);
+		ctx->hemisphere.fbHemiToLightmapLocation[ctx->hemisphere.fbHemiIndex] = lm_currentLightmapLocation(ctx);
+		if (ctx->hemisphere.directional)
+		{
+			lm_hemisphereSample *sample = ctx->hemisphere.fbHemiSamples + ctx->hemisphere.fbHemiIndex;
+			sample->position = ctx->meshPosition.sample.position;
+			sample->direction = ctx->meshPosition.sample.direction;
+			sample->up = ctx->meshPosition.sample.up;
+		}
+		ctx->stats.rendered[ctx->meshPosition.pass]++;
 	}
 
 	// find the target position in the batch
@@ -817,6 +1912,15 @@ static lm_bool lm_beginSampleHemisphere(lm_context *ctx, int* viewport, float* v
 	lm_vec3 up = ctx->meshPosition.sample.up;
 	lm_vec3 right = lm_cross3(dir, up);
 
+	if (ctx->hemisphere.projection == LM_PARABOLOID)
+	{ // the whole hemisphere is projected into the center square by the vertex shader (the other sides have zero weights)
+		lm_setView(viewport, x, y, size, size,
+				   view,     pos, dir, up,
+				   proj,     -zNear, zNear, -zNear, zNear, zNear, zFar);
+		lm_setParaboloidProjection(proj, zNear, zFar);
+		return LM_TRUE;
+	}
+
 	// find the view parameters of the hemisphere side that we will render next
 	// hemisphere layout in the framebuffer:
 	//       +-------+---+---+-------+
@@ -859,18 +1963,21 @@ static lm_bool lm_beginSampleHemisphere(lm_context *ctx, int* viewport, float* v
 	return LM_TRUE;
 }
 
+static void lm_processHemisphereBatch(lm_context *ctx)
+{
+	if (ctx->hemisphere.transfer.pending == ctx->hemisphere.transfer.count)
+		lm_finishProcessHemisphereBatch(ctx); // read and process the oldest data to make room in the transfer ring
+	lm_beginProcessHemisphereBatch(ctx); // downsample new hemisphere batch and kick off transfer
+}
+
 static void lm_endSampleHemisphere(lm_context *ctx)
 {
-	if (++ctx->meshPosition.hemisphere.side == 5)
+	if (++ctx->meshPosition.hemisphere.side == lm_hemisphereSideCount(ctx))
 	{
 		// finish hemisphere
 		glBindFramebuffer(GL_FRAMEBUFFER, 0);
 		if (++ctx->hemisphere.fbHemiIndex == ctx->hemisphere.fbHemiCountX * ctx->hemisphere.fbHemiCountY)
-		{
-			// finish hemisphere batch and start a new one
-			lm_finishProcessHemisphereBatch(ctx); // read and process the previous data and finish the batch
-			lm_beginProcessHemisphereBatch(ctx); // downsample new hemisphere batch and kick off transfer
-		}
+			lm_processHemisphereBatch(ctx); // finish hemisphere batch and start a new one
 	}
 }
 
@@ -887,116 +1994,550 @@ static lm_vec3 lm_transform(const float *m, lm_vec3 v)
 	return r;
 }
 
-static void lm_setMeshPosition(lm_context *ctx, unsigned int indicesTriangleBaseIndex)
+// mesh decoders that are specialized for each input type, so that there are no type switches per element
+#define LM_DEFINE_INDEX_DECODER(name, type) \
+	static void name(const void *indices, unsigned int *out, unsigned int count) \
+	{ \
+		for (unsigned int i = 0; i < count; i++) \
+			out[i] = ((const type*)indices)[i]; \
+	}
+LM_DEFINE_INDEX_DECODER(lm_decodeIndicesUB, unsigned char)
+LM_DEFINE_INDEX_DECODER(lm_decodeIndicesUS, unsigned short)
+LM_DEFINE_INDEX_DECODER(lm_decodeIndicesUI, unsigned int)
+
+// decodes n components of the vertex of every index and divides them by divisor (to normalize integer types)
+typedef void (*lm_vertex_decoder)(const unsigned char *data, int stride, const unsigned int *indices, unsigned int count, float *out, int n, float divisor);
+#define LM_DEFINE_VERTEX_DECODER(name, type) \
+	static void name(const unsigned char *data, int stride, const unsigned int *indices, unsigned int count, float *out, int n, float divisor) \
+	{ \
+		for (unsigned int i = 0; i < count; i++) \
+		{ \
+			const type *v = (const type*)(data + indices[i] * stride); \
+			for (int j = 0; j < n; j++) \
+				out[i * n + j] = (float)v[j] / divisor; \
+		} \
+	}
+LM_DEFINE_VERTEX_DECODER(lm_decodeVerticesUB, unsigned char)
+LM_DEFINE_VERTEX_DECODER(lm_decodeVerticesUS, unsigned short)
+LM_DEFINE_VERTEX_DECODER(lm_decodeVerticesUI, unsigned int)
+LM_DEFINE_VERTEX_DECODER(lm_decodeVerticesF, float)
+
+static lm_vertex_decoder lm_vertexDecoder(lm_type type)
 {
-	// fetch triangle at the specified indicesTriangleBaseIndex
-	ctx->meshPosition.triangle.baseIndex = indicesTriangleBaseIndex;
+	switch (type)
+	{
+	// TODO: signed formats
+	case LM_UNSIGNED_BYTE:  return lm_decodeVerticesUB;
+	case LM_UNSIGNED_SHORT: return lm_decodeVerticesUS;
+	case LM_UNSIGNED_INT:   return lm_decodeVerticesUI;
+	case LM_FLOAT:          return lm_decodeVerticesF;
+	default:                assert(LM_FALSE); return NULL;
+	}
+}
 
-	// load and transform triangle to process next
-	lm_vec2 uvMin = lm_v2(FLT_MAX, FLT_MAX), uvMax = lm_v2(-FLT_MAX, -FLT_MAX);
-	lm_vec2 uvScale = lm_v2i(ctx->lightmap.width, ctx->lightmap.height);
-	for (int i = 0; i < 3; i++)
+static float lm_typeMax(lm_type type) // divisor that normalizes integer types to 0..1
+{
+	switch (type)
+	{
+	case LM_UNSIGNED_BYTE:  return (float)UCHAR_MAX;
+	case LM_UNSIGNED_SHORT: return (float)USHRT_MAX;
+	case LM_UNSIGNED_INT:   return (float)UINT_MAX;
+	default:                return 1.0f;
+	}
+}
+
+static int lm_typeSize(lm_type type)
+{
+	switch (type)
+	{
+	case LM_UNSIGNED_BYTE:  return sizeof(unsigned char);
+	case LM_UNSIGNED_SHORT: return sizeof(unsigned short);
+	case LM_UNSIGNED_INT:   return sizeof(unsigned int);
+	case LM_FLOAT:          return sizeof(float);
+	default:                assert(LM_FALSE); return 0;
+	}
+}
+
+static void lm_freeMesh(lm_context *ctx)
+{
+	LM_FREE(ctx->mesh.indices);
+	LM_FREE(ctx->mesh.positions);
+	LM_FREE(ctx->mesh.uvs);
+	LM_FREE(ctx->mesh.normals);
+	LM_FREE(ctx->mesh.rectMin);
+	LM_FREE(ctx->mesh.rectMax);
+}
+
+// copies count elements of size bytes into a new array with room for capacity elements
+static void *lm_growArray(void *data, unsigned int size, unsigned int count, unsigned int capacity)
+{
+	unsigned char *grown = (unsigned char*)LM_CALLOC(capacity, size);
+	for (unsigned int i = 0; i < count * size; i++)
+		grown[i] = ((unsigned char*)data)[i];
+	if (data)
+		LM_FREE(data);
+	return grown;
+}
+
+static void lm_reserveMesh(lm_context *ctx, unsigned int count)
+{
+	if (count <= ctx->mesh.capacity && ctx->mesh.indices)
+		return;
+	unsigned int capacity = 2 * ctx->mesh.capacity; // amortize adding many small geometries
+	if (capacity < count)
+		capacity = count;
+	if (capacity < 3)
+		capacity = 3;
+	ctx->mesh.indices   = (unsigned int*)lm_growArray(ctx->mesh.indices,   sizeof(unsigned int), ctx->mesh.count,     capacity);
+	ctx->mesh.positions = (lm_vec3*)     lm_growArray(ctx->mesh.positions, sizeof(lm_vec3),      ctx->mesh.count,     capacity);
+	ctx->mesh.uvs       = (lm_vec2*)     lm_growArray(ctx->mesh.uvs,       sizeof(lm_vec2),      ctx->mesh.count,     capacity);
+	ctx->mesh.normals   = (lm_vec3*)     lm_growArray(ctx->mesh.normals,   sizeof(lm_vec3),      ctx->mesh.count / 3, capacity / 3);
+	ctx->mesh.rectMin   = (lm_ivec2*)    lm_growArray(ctx->mesh.rectMin,   sizeof(lm_ivec2),     ctx->mesh.count / 3, capacity / 3);
+	ctx->mesh.rectMax   = (lm_ivec2*)    lm_growArray(ctx->mesh.rectMax,   sizeof(lm_ivec2),     ctx->mesh.count / 3, capacity / 3);
+	ctx->mesh.capacity = capacity;
+}
+
+// decodes and transforms the whole mesh once, so that the passes only have to walk through linear memory.
+// the mesh is appended to the mesh cache and mapped to the target lightmap.
+static void lm_decodeMesh(lm_context *ctx, const lm_targetLightmap *target,
+	const float *transform,
+	lm_type positionsType, const unsigned char *positions, int positionsStride,
+	lm_type uvsType, const unsigned char *uvs, int uvsStride,
+	unsigned int count, lm_type indicesType, const void *indices)
+{
+	count -= count % 3; // whole triangles only
+	lm_reserveMesh(ctx, ctx->mesh.count + count);
+	unsigned int first = ctx->mesh.count;
+	unsigned int *meshIndices = ctx->mesh.indices + first;
+	lm_vec3 *meshPositions = ctx->mesh.positions + first;
+	lm_vec2 *meshUVs = ctx->mesh.uvs + first;
+	ctx->mesh.count += count;
+
+	switch (indicesType)
+	{
+	case LM_NONE:           for (unsigned int i = 0; i < count; i++) meshIndices[i] = i; break;
+	case LM_UNSIGNED_BYTE:  lm_decodeIndicesUB(indices, meshIndices, count); break;
+	case LM_UNSIGNED_SHORT: lm_decodeIndicesUS(indices, meshIndices, count); break;
+	case LM_UNSIGNED_INT:   lm_decodeIndicesUI(indices, meshIndices, count); break;
+	default:                assert(LM_FALSE); break;
+	}
+
+	// decode and pre-transform vertex positions
+	lm_vertexDecoder(positionsType)(positions, positionsStride, meshIndices, count, &meshPositions->x, 3, 1.0f);
+	if (transform)
+		for (unsigned int i = 0; i < count; i++)
+			meshPositions[i] = lm_transform(transform, meshPositions[i]);
+
+	// decode and scale (to lightmap resolution) vertex lightmap texture coords
+	lm_vertexDecoder(uvsType)(uvs, uvsStride, meshIndices, count, &meshUVs->x, 2, lm_typeMax(uvsType));
+	lm_vec2 uvScale = lm_v2i(target->width, target->height);
+	for (unsigned int i = 0; i < count; i++)
+		meshUVs[i] = lm_mul2(meshUVs[i], uvScale);
+
+	for (unsigned int t = first / 3; t < ctx->mesh.count / 3; t++)
+	{
+		const lm_vec3 *p = ctx->mesh.positions + t * 3;
+		const lm_vec2 *uv = ctx->mesh.uvs + t * 3;
+		ctx->mesh.normals[t] = lm_normalize3(lm_cross3(lm_sub3(p[1], p[0]), lm_sub3(p[2], p[0])));
+
+		// calculate area of interest (on lightmap) for conservative rasterization
+		lm_vec2 bbMin = lm_floor2(lm_min2(lm_min2(uv[0], uv[1]), uv[2]));
+		lm_vec2 bbMax = lm_ceil2 (lm_max2(lm_max2(uv[0], uv[1]), uv[2]));
+		ctx->mesh.rectMin[t] = lm_i2(lm_maxi((int)bbMin.x - 1, 0), lm_maxi((int)bbMin.y - 1, 0));
+		ctx->mesh.rectMax[t] = lm_i2(lm_mini((int)bbMax.x + 1, target->width), lm_mini((int)bbMax.y + 1, target->height));
+	}
+}
+
+// adds a geometry that is baked into the lightmap set with lmSetTargetLightmap to the geometry set
+static void lm_addGeometry(lm_context *ctx,
+	const float *transform,
+	lm_type positionsType, const void *positions, int positionsStride,
+	lm_type uvsType, const void *uvs, int uvsStride,
+	int count, lm_type indicesType, const void *indices)
+{
+	assert(ctx->geometry.target.data);
+
+	// geometries that share a lightmap also share the target (and its coverage)
+	int target = 0;
+	while (target < ctx->geometry.targetCount && ctx->geometry.targets[target].data != ctx->geometry.target.data)
+		target++;
+	if (target == ctx->geometry.targetCount)
 	{
-		// decode index
-		unsigned int vIndex;
-		switch (ctx->mesh.indicesType)
+		if (ctx->geometry.targetCount == ctx->geometry.targetCapacity)
 		{
-		case LM_NONE:
-			vIndex = ctx->meshPosition.triangle.baseIndex + i;
-			break;
-		case LM_UNSIGNED_BYTE:
-			vIndex = ((const unsigned char*)ctx->mesh.indices + ctx->meshPosition.triangle.baseIndex)[i];
-			break;
-		case LM_UNSIGNED_SHORT:
-			vIndex = ((const unsigned short*)ctx->mesh.indices + ctx->meshPosition.triangle.baseIndex)[i];
-			break;
-		case LM_UNSIGNED_INT:
-			vIndex = ((const unsigned int*)ctx->mesh.indices + ctx->meshPosition.triangle.baseIndex)[i];
-			break;
-		default:
-			assert(LM_FALSE);
-			break;
+			ctx->geometry.targetCapacity = lm_maxi(2 * ctx->geometry.targetCapacity, 4);
+			ctx->geometry.targets = (lm_targetLightmap*)lm_growArray(ctx->geometry.targets,
+				sizeof(lm_targetLightmap), ctx->geometry.targetCount, ctx->geometry.targetCapacity);
 		}
+		lm_targetLightmap *t = ctx->geometry.targets + ctx->geometry.targetCount++;
+		*t = ctx->geometry.target;
+		if (!t->coverage && t->tiled)
+		{
+			// no coverage from the user: a tiled target starts empty. reading its values would fault in the whole file.
+			t->coverage = (unsigned char*)LM_CALLOC(lmCoverageSize(t->width, t->height), 1);
+			t->ownsCoverage = LM_TRUE;
+		}
+		else if (!t->coverage)
+		{
+			// no coverage from the user: every texel that already has a value is covered
+			t->coverage = (unsigned char*)LM_CALLOC(lmCoverageSize(t->width, t->height), 1);
+			t->ownsCoverage = LM_TRUE;
+			for (int y = 0; y < t->height; y++)
+			{
+				for (int x = 0; x < t->width; x++)
+				{
+					const float *texel = t->data + lm_texelOffset(t, x, y);
+					for (int j = 0; j < t->channels; j++)
+					{
+						if (texel[j] != 0.0f)
+						{
+							lm_setTexelCovered(t, x, y, LM_FALSE);
+							t->prefilled = LM_TRUE;
+							break;
+						}
+					}
+				}
+			}
+		}
+		else
+		{
+			int valueBytes = lmCoverageSize(t->width, t->height) / 2;
+			for (int i = 0; i < valueBytes && !t->prefilled; i++)
+				t->prefilled = t->coverage[i] != 0;
+		}
+	}
+	else
+		assert(ctx->geometry.targets[target].width == ctx->geometry.target.width &&
+		       ctx->geometry.targets[target].height == ctx->geometry.target.height &&
+		       ctx->geometry.targets[target].channels == ctx->geometry.target.channels &&
+		       ctx->geometry.targets[target].tiled == ctx->geometry.target.tiled);
 
-		// decode and pre-transform vertex position
-		const void *pPtr = ctx->mesh.positions + vIndex * ctx->mesh.positionsStride;
-		lm_vec3 p;
-		switch (ctx->mesh.positionsType)
-		{
-		// TODO: signed formats
-		case LM_UNSIGNED_BYTE: {
-			const unsigned char *uc = (const unsigned char*)pPtr;
-			p = lm_v3(uc[0], uc[1], uc[2]);
-		} break;
-		case LM_UNSIGNED_SHORT: {
-			const unsigned short *us = (const unsigned short*)pPtr;
-			p = lm_v3(us[0], us[1], us[2]);
-		} break;
-		case LM_UNSIGNED_INT: {
-			const unsigned int *ui = (const unsigned int*)pPtr;
-			p = lm_v3((float)ui[0], (float)ui[1], (float)ui[2]);
-		} break;
-		case LM_FLOAT: {
-			p = *(const lm_vec3*)pPtr;
-		} break;
-		default: {
-			assert(LM_FALSE);
-		} break;
-		}
-		ctx->meshPosition.triangle.p[i] = lm_transform(ctx->mesh.transform, p);
-
-		// decode and scale (to lightmap resolution) vertex lightmap texture coords
-		const void *uvPtr = ctx->mesh.uvs + vIndex * ctx->mesh.uvsStride;
-		lm_vec2 uv;
-		switch (ctx->mesh.uvsType)
-		{
-		case LM_UNSIGNED_BYTE: {
-			const unsigned char *uc = (const unsigned char*)uvPtr;
-			uv = lm_v2(uc[0] / (float)UCHAR_MAX, uc[1] / (float)UCHAR_MAX);
-		} break;
-		case LM_UNSIGNED_SHORT: {
-			const unsigned short *us = (const unsigned short*)uvPtr;
-			uv = lm_v2(us[0] / (float)USHRT_MAX, us[1] / (float)USHRT_MAX);
-		} break;
-		case LM_UNSIGNED_INT: {
-			const unsigned int *ui = (const unsigned int*)uvPtr;
-			uv = lm_v2(ui[0] / (float)UINT_MAX, ui[1] / (float)UINT_MAX);
-		} break;
-		case LM_FLOAT: {
-			uv = *(const lm_vec2*)uvPtr;
-		} break;
-		default: {
-			assert(LM_FALSE);
-		} break;
+	if (ctx->geometry.geometryCount == ctx->geometry.geometryCapacity)
+	{
+		ctx->geometry.geometryCapacity = lm_maxi(2 * ctx->geometry.geometryCapacity, 4);
+		ctx->geometry.geometries = (lm_geometry*)lm_growArray(ctx->geometry.geometries,
+			sizeof(lm_geometry), ctx->geometry.geometryCount, ctx->geometry.geometryCapacity);
+	}
+	lm_geometry *geometry = ctx->geometry.geometries + ctx->geometry.geometryCount++;
+	geometry->first = ctx->mesh.count;
+	geometry->target = target;
+
+	lm_decodeMesh(ctx, ctx->geometry.targets + target, transform,
+		positionsType, (const unsigned char*)positions, positionsStride == 0 ? (int)sizeof(lm_vec3) : positionsStride,
+		uvsType, (const unsigned char*)uvs, uvsStride == 0 ? (int)sizeof(lm_vec2) : uvsStride,
+		count, indicesType, indices);
+}
+
+static void lm_clearGeometry(lm_context *ctx)
+{
+	for (int i = 0; i < ctx->geometry.targetCount; i++)
+	{
+		if (ctx->geometry.targets[i].ownsCoverage)
+			LM_FREE(ctx->geometry.targets[i].coverage);
+		if (ctx->geometry.targets[i].previous) // of lmSetDirtyRegions
+		{
+			LM_FREE(ctx->geometry.targets[i].previous);
+			LM_FREE(ctx->geometry.targets[i].converged);
 		}
-		ctx->meshPosition.triangle.uv[i] = lm_mul2(uv, uvScale);
+	}
+	if (ctx->dirty.bounds)
+		LM_FREE(ctx->dirty.bounds);
+	ctx->dirty.bounds = NULL;
+	ctx->dirty.count = 0;
+	ctx->geometry.targetCount = 0;
+	ctx->geometry.geometryCount = 0;
+	ctx->geometry.current = -1;
+	ctx->mesh.count = 0;
+}
+
+static void lm_freeGeometry(lm_context *ctx)
+{
+	lm_clearGeometry(ctx);
+	if (ctx->geometry.targets)
+		LM_FREE(ctx->geometry.targets);
+	if (ctx->geometry.geometries)
+		LM_FREE(ctx->geometry.geometries);
+	lm_freeMesh(ctx);
+}
+
+static void lm_setMeshPosition(lm_context *ctx, unsigned int indicesTriangleBaseIndex)
+{
+	// switch to the target lightmap of the geometry that the triangle belongs to
+	int geometry = lm_maxi(ctx->geometry.current, 0);
+	if (indicesTriangleBaseIndex < ctx->geometry.geometries[geometry].first)
+		geometry = 0;
+	while (geometry + 1 < ctx->geometry.geometryCount && indicesTriangleBaseIndex >= ctx->geometry.geometries[geometry + 1].first)
+		geometry++;
+	if (geometry != ctx->geometry.current)
+	{
+		ctx->geometry.current = geometry;
+		ctx->lightmap = ctx->geometry.targets[ctx->geometry.geometries[geometry].target];
+	}
 
-		// update bounds on lightmap
-		uvMin = lm_min2(uvMin, ctx->meshPosition.triangle.uv[i]);
-		uvMax = lm_max2(uvMax, ctx->meshPosition.triangle.uv[i]);
+	// fetch triangle at the specified indicesTriangleBaseIndex
+	ctx->meshPosition.triangle.baseIndex = indicesTriangleBaseIndex;
+	unsigned int t = indicesTriangleBaseIndex / 3;
+	for (int i = 0; i < 3; i++)
+	{
+		ctx->meshPosition.triangle.p[i] = ctx->mesh.positions[indicesTriangleBaseIndex + i];
+		ctx->meshPosition.triangle.uv[i] = ctx->mesh.uvs[indicesTriangleBaseIndex + i];
 	}
+	ctx->meshPosition.triangle.normal = ctx->mesh.normals[t];
 
-	// calculate area of interest (on lightmap) for conservative rasterization
-	lm_vec2 bbMin = lm_floor2(uvMin);
-	lm_vec2 bbMax = lm_ceil2 (uvMax);
-	ctx->meshPosition.rasterizer.minx = lm_maxi((int)bbMin.x - 1, 0);
-	ctx->meshPosition.rasterizer.miny = lm_maxi((int)bbMin.y - 1, 0);
-	ctx->meshPosition.rasterizer.maxx = lm_mini((int)bbMax.x + 1, ctx->lightmap.width);
-	ctx->meshPosition.rasterizer.maxy = lm_mini((int)bbMax.y + 1, ctx->lightmap.height);
+	ctx->meshPosition.rasterizer.minx = ctx->mesh.rectMin[t].x;
+	ctx->meshPosition.rasterizer.miny = ctx->mesh.rectMin[t].y;
+	ctx->meshPosition.rasterizer.maxx = ctx->mesh.rectMax[t].x;
+	ctx->meshPosition.rasterizer.maxy = ctx->mesh.rectMax[t].y;
 	assert(ctx->meshPosition.rasterizer.minx < ctx->meshPosition.rasterizer.maxx &&
 		   ctx->meshPosition.rasterizer.miny < ctx->meshPosition.rasterizer.maxy);
 	ctx->meshPosition.rasterizer.x = ctx->meshPosition.rasterizer.minx + lm_passOffsetX(ctx);
 	ctx->meshPosition.rasterizer.y = ctx->meshPosition.rasterizer.miny + lm_passOffsetY(ctx);
 
+	lm_bool hasPositions = ctx->meshPosition.rasterizer.x < ctx->meshPosition.rasterizer.maxx &&
+	                       ctx->meshPosition.rasterizer.y < ctx->meshPosition.rasterizer.maxy;
+	if (ctx->meshPosition.replay.plan)
+	{ // the recorded positions of this triangle in this pass
+		const lm_sample_plan *plan = ctx->meshPosition.replay.plan;
+		unsigned int i = ctx->meshPosition.pass * plan->triangleCount + t;
+		ctx->meshPosition.replay.entry = plan->triangleFirst[i];
+		ctx->meshPosition.replay.end = plan->triangleFirst[i + 1];
+		hasPositions = ctx->meshPosition.replay.entry < ctx->meshPosition.replay.end;
+		if (hasPositions)
+		{
+			ctx->meshPosition.rasterizer.x = plan->entries[ctx->meshPosition.replay.entry].x;
+			ctx->meshPosition.rasterizer.y = plan->entries[ctx->meshPosition.replay.entry].y;
+		}
+	}
+
 	// try moving to first valid sample position
-	if (ctx->meshPosition.rasterizer.x <= ctx->meshPosition.rasterizer.maxx && 
-		ctx->meshPosition.rasterizer.y <= ctx->meshPosition.rasterizer.maxy &&
-		lm_findFirstConservativeTriangleRasterizerPosition(ctx))
+	if (hasPositions && lm_findFirstConservativeTriangleRasterizerPosition(ctx))
 		ctx->meshPosition.hemisphere.side = 0; // we can start sampling the hemisphere
 	else
 		ctx->meshPosition.hemisphere.side = 5; // no samples on this triangle! put hemisphere sampler into finished state
 }
 
+// walks the conservative rasterizer positions of all triangles in all passes.
+// records them (and their samples) if plan->entries is set or only counts them otherwise.
+static unsigned int lm_recordSamplePlan(lm_context *ctx, lm_sample_plan *plan)
+{
+	unsigned int entryCount = 0, sampleCount = 0;
+	for (int pass = 0; pass < plan->passCount; pass++)
+	{
+		ctx->meshPosition.pass = pass;
+		unsigned int step = lm_passStepSize(ctx);
+		for (unsigned int t = 0; t < plan->triangleCount; t++)
+		{
+			if (plan->entries)
+			{
+				plan->triangleFirst[pass * plan->triangleCount + t] = entryCount;
+				for (int i = 0; i < 3; i++)
+				{
+					ctx->meshPosition.triangle.p[i] = ctx->mesh.positions[t * 3 + i];
+					ctx->meshPosition.triangle.uv[i] = ctx->mesh.uvs[t * 3 + i];
+				}
+				ctx->meshPosition.triangle.normal = ctx->mesh.normals[t];
+			}
+
+			lm_ivec2 rectMin = ctx->mesh.rectMin[t], rectMax = ctx->mesh.rectMax[t];
+			int startx = rectMin.x + lm_passOffsetX(ctx);
+			if (startx >= rectMax.x)
+				continue; // same as lm_moveToNextPotentialConservativeTriangleRasterizerPosition: no positions in this triangle
+			for (int y = rectMin.y + lm_passOffsetY(ctx); y < rectMax.y; y += step)
+			{
+				for (int x = startx; x < rectMax.x; x += step)
+				{
+					if (plan->entries)
+					{
+						lm_samplePlanEntry *entry = plan->entries + entryCount;
+						entry->x = x;
+						entry->y = y;
+						entry->sample = -1;
+						ctx->meshPosition.rasterizer.x = x;
+						ctx->meshPosition.rasterizer.y = y;
+						if (lm_computeSample(ctx))
+						{
+							lm_hemisphereSample *sample = plan->samples + sampleCount;
+							sample->position = ctx->meshPosition.sample.position;
+							sample->direction = ctx->meshPosition.sample.direction;
+							sample->up = ctx->meshPosition.sample.up;
+							entry->sample = sampleCount++;
+						}
+					}
+					entryCount++;
+				}
+			}
+		}
+	}
+	if (plan->entries)
+		plan->triangleFirst[plan->passCount * plan->triangleCount] = entryCount;
+	return entryCount;
+}
+
+typedef struct
+{
+	lm_vec3 bmin, bmax, centroid;
+	unsigned int index;
+} lm_bvhBuildTriangle;
+
+static void lm_bvhSubdivide(lm_context *ctx, int *nodeCount, int nodeIndex, int depth, lm_bvhBuildTriangle *tris)
+{
+	lm_bvhNode *node = ctx->cpu.nodes + nodeIndex;
+	lm_vec3 cmin = lm_v3(FLT_MAX, FLT_MAX, FLT_MAX), cmax = lm_v3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+	node->bmin = cmin;
+	node->bmax = cmax;
+	for (int i = node->first; i < node->first + node->count; i++)
+	{
+		node->bmin = lm_min3(node->bmin, tris[i].bmin);
+		node->bmax = lm_max3(node->bmax, tris[i].bmax);
+		cmin = lm_min3(cmin, tris[i].centroid);
+		cmax = lm_max3(cmax, tris[i].centroid);
+	}
+	if (node->count <= 4 || depth == LM_BVH_MAX_DEPTH)
+		return; // leaf (skewed geometry can end up with bigger leaves at the maximum depth)
+
+	// split along the longest centroid axis with a binned surface area heuristic
+	lm_vec3 extent = lm_sub3(cmax, cmin);
+	int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+	float axisMin = axis == 0 ? cmin.x : axis == 1 ? cmin.y : cmin.z;
+	float axisExtent = axis == 0 ? extent.x : axis == 1 ? extent.y : extent.z;
+	if (axisExtent <= 0.0f)
+		return; // all centroids are in the same spot
+
+	#define LM_BVH_BINS 16
+	struct { lm_vec3 bmin, bmax; int count; } bins[LM_BVH_BINS];
+	for (int b = 0; b < LM_BVH_BINS; b++)
+	{
+		bins[b].bmin = lm_v3(FLT_MAX, FLT_MAX, FLT_MAX);
+		bins[b].bmax = lm_v3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+		bins[b].count = 0;
+	}
+	float binScale = LM_BVH_BINS / axisExtent;
+	#define LM_BVH_BIN(tri) lm_mini((int)((((axis == 0 ? (tri).centroid.x : axis == 1 ? (tri).centroid.y : (tri).centroid.z)) - axisMin) * binScale), LM_BVH_BINS - 1)
+	for (int i = node->first; i < node->first + node->count; i++)
+	{
+		int b = LM_BVH_BIN(tris[i]);
+		bins[b].bmin = lm_min3(bins[b].bmin, tris[i].bmin);
+		bins[b].bmax = lm_max3(bins[b].bmax, tris[i].bmax);
+		bins[b].count++;
+	}
+
+	// sweep from the right to get the right side areas, then from the left to find the best split
+	float rightArea[LM_BVH_BINS];
+	int rightCount[LM_BVH_BINS];
+	lm_vec3 bmin = lm_v3(FLT_MAX, FLT_MAX, FLT_MAX), bmax = lm_v3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+	int count = 0;
+	for (int b = LM_BVH_BINS - 1; b > 0; b--)
+	{
+		bmin = lm_min3(bmin, bins[b].bmin);
+		bmax = lm_max3(bmax, bins[b].bmax);
+		count += bins[b].count;
+		lm_vec3 e = lm_sub3(bmax, bmin);
+		rightArea[b] = count ? e.x * e.y + e.y * e.z + e.z * e.x : 0.0f;
+		rightCount[b] = count;
+	}
+	int bestSplit = 0;
+	float bestCost = FLT_MAX;
+	bmin = lm_v3(FLT_MAX, FLT_MAX, FLT_MAX);
+	bmax = lm_v3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+	count = 0;
+	for (int b = 0; b < LM_BVH_BINS - 1; b++)
+	{
+		bmin = lm_min3(bmin, bins[b].bmin);
+		bmax = lm_max3(bmax, bins[b].bmax);
+		count += bins[b].count;
+		lm_vec3 e = lm_sub3(bmax, bmin);
+		float leftArea = count ? e.x * e.y + e.y * e.z + e.z * e.x : 0.0f;
+		float cost = leftArea * count + rightArea[b + 1] * rightCount[b + 1];
+		if (count && rightCount[b + 1] && cost < bestCost)
+		{
+			bestCost = cost;
+			bestSplit = b + 1;
+		}
+	}
+	if (!bestSplit)
+		return;
+
+	// partition triangles (left: bins < bestSplit)
+	int i = node->first, j = node->first + node->count - 1;
+	while (i <= j)
+	{
+		if (LM_BVH_BIN(tris[i]) < bestSplit)
+			i++;
+		else
+		{
+			LM_SWAP(lm_bvhBuildTriangle, tris[i], tris[j]);
+			j--;
+		}
+	}
+	#undef LM_BVH_BIN
+	#undef LM_BVH_BINS
+
+	int children = *nodeCount;
+	*nodeCount += 2;
+	ctx->cpu.nodes[children + 0].first = node->first;
+	ctx->cpu.nodes[children + 0].count = i - node->first;
+	ctx->cpu.nodes[children + 1].first = i;
+	ctx->cpu.nodes[children + 1].count = node->first + node->count - i;
+	node->first = children;
+	node->count = 0;
+	lm_bvhSubdivide(ctx, nodeCount, children + 0, depth + 1, tris);
+	lm_bvhSubdivide(ctx, nodeCount, children + 1, depth + 1, tris);
+}
+
+// builds the ray casting acceleration structure and the per-triangle lightmap coords for the current mesh
+static void lm_cpuBuildScene(lm_context *ctx)
+{
+	LM_FREE(ctx->cpu.nodes);
+	LM_FREE(ctx->cpu.triangles);
+	LM_FREE(ctx->cpu.uvs);
+	LM_FREE(ctx->cpu.albedo);
+	LM_FREE(ctx->cpu.emission);
+	ctx->cpu.albedo = NULL;
+	ctx->cpu.emission = NULL;
+
+	int triangleCount = ctx->mesh.count / 3;
+	lm_bvhBuildTriangle *tris = (lm_bvhBuildTriangle*)LM_CALLOC(lm_maxi(triangleCount, 1), sizeof(lm_bvhBuildTriangle));
+	ctx->cpu.triangles = (lm_bvhTriangle*)LM_CALLOC(lm_maxi(triangleCount, 1), sizeof(lm_bvhTriangle));
+	ctx->cpu.nodes = (lm_bvhNode*)LM_CALLOC(lm_maxi(2 * triangleCount - 1, 1), sizeof(lm_bvhNode));
+	ctx->cpu.uvs = (lm_vec2*)LM_CALLOC(lm_maxi(3 * triangleCount, 1), sizeof(lm_vec2));
+	ctx->cpu.triangleCount = triangleCount;
+
+	for (int t = 0; t < triangleCount; t++)
+	{
+		lm_bvhTriangle *tri = ctx->cpu.triangles + t;
+		const lm_vec3 *p = ctx->mesh.positions + t * 3;
+		for (int i = 0; i < 3; i++)
+		{
+			lm_vec2 uv = ctx->mesh.uvs[t * 3 + i];
+			ctx->cpu.uvs[t * 3 + i] = lm_v2(uv.x / (float)ctx->geometry.targets[0].width, uv.y / (float)ctx->geometry.targets[0].height);
+		}
+		tri->p0 = p[0];
+		tri->e1 = lm_sub3(p[1], p[0]);
+		tri->e2 = lm_sub3(p[2], p[0]);
+		tri->index = t;
+		tris[t].bmin = lm_min3(lm_min3(p[0], p[1]), p[2]);
+		tris[t].bmax = lm_max3(lm_max3(p[0], p[1]), p[2]);
+		tris[t].centroid = lm_scale3(lm_add3(tris[t].bmin, tris[t].bmax), 0.5f);
+		tris[t].index = t;
+	}
+
+	if (triangleCount)
+	{
+		int nodeCount = 1;
+		ctx->cpu.nodes[0].first = 0;
+		ctx->cpu.nodes[0].count = triangleCount;
+		lm_bvhSubdivide(ctx, &nodeCount, 0, 0, tris);
+
+		// reorder the triangles to match the leaves
+		lm_bvhTriangle *ordered = (lm_bvhTriangle*)LM_CALLOC(triangleCount, sizeof(lm_bvhTriangle));
+		for (int t = 0; t < triangleCount; t++)
+			ordered[t] = ctx->cpu.triangles[tris[t].index];
+		LM_FREE(ctx->cpu.triangles);
+		ctx->cpu.triangles = ordered;
+	}
+	LM_FREE(tris);
+}
+
 static GLuint lm_LoadShader(GLenum type, const char *source)
 {
 	GLuint shader = glCreateShader(type);
@@ -1062,12 +2603,42 @@ static GLuint lm_LoadProgram(const char *vp, const char *fp)
 	return program;
 }
 
+#ifdef LM_COMPUTE
+static GLuint lm_LoadComputeProgram(const char *cp)
+{
+	GLuint program = glCreateProgram();
+	if (program == 0)
+	{
+		fprintf(stderr, "Could not create program!\n");
+		return 0;
+	}
+	GLuint computeShader = lm_LoadShader(GL_COMPUTE_SHADER, cp);
+	if (!computeShader)
+	{
+		glDeleteProgram(program);
+		return 0;
+	}
+	glAttachShader(program, computeShader);
+	glLinkProgram(program);
+	glDeleteShader(computeShader);
+	GLint linked;
+	glGetProgramiv(program, GL_LINK_STATUS, &linked);
+	if (!linked)
+	{
+		fprintf(stderr, "Could not link program!\n");
+		glDeleteProgram(program);
+		return 0;
+	}
+	return program;
+}
+#endif
+
 static float lm_defaultWeights(float cos_theta, void *userdata)
 {
 	return 1.0f;
 }
 
-lm_context *lmCreate(int hemisphereSize, float zNear, float zFar,
+static lm_context *lm_createContext(int hemisphereSize, float zNear, float zFar,
 	float clearR, float clearG, float clearB,
 	int interpolationPasses, float interpolationThreshold)
 {
@@ -1087,50 +2658,130 @@ lm_context *lmCreate(int hemisphereSize, float zNear, float zFar,
 	ctx->hemisphere.clearColor.r = clearR;
 	ctx->hemisphere.clearColor.g = clearG;
 	ctx->hemisphere.clearColor.b = clearB;
+	return ctx;
+}
+
+lm_context *lmCreate(int hemisphereSize, float zNear, float zFar,
+	float clearR, float clearG, float clearB,
+	int interpolationPasses, float interpolationThreshold)
+{
+	return lmCreateEx(hemisphereSize, zNear, zFar, clearR, clearG, clearB, interpolationPasses, interpolationThreshold, NULL);
+}
+
+lm_context *lmCreateEx(int hemisphereSize, float zNear, float zFar,
+	float clearR, float clearG, float clearB,
+	int interpolationPasses, float interpolationThreshold,
+	const lm_create_options *options)
+{
+	lm_create_options defaults = { 0, 0, 0, LM_FALSE, LM_FALSE, LM_FALSE, LM_FALSE };
+	if (!options)
+		options = &defaults;
+	int transferRingSize = options->transferRingSize ? options->transferRingSize : 2;
+	int batchWidth = options->batchWidth ? options->batchWidth : 1536;
+	int batchHeight = options->batchHeight ? options->batchHeight : 512;
+	lm_bool halfFloat = options->halfFloat;
+	lm_bool ambientOcclusion = options->ambientOcclusion;
+	lm_bool directional = options->directional;
+	assert(transferRingSize > 0);
+	assert(batchWidth >= 3 * hemisphereSize && batchHeight >= hemisphereSize);
+	lm_context *ctx = lm_createContext(hemisphereSize, zNear, zFar, clearR, clearG, clearB, interpolationPasses, interpolationThreshold);
 
 	// TODO: test for all needed extensions!
 
-	// calculate hemisphere batch size
-	ctx->hemisphere.fbHemiCountX = 1536 / (3 * ctx->hemisphere.size);
-	ctx->hemisphere.fbHemiCountY = 512 / ctx->hemisphere.size;
+	// calculate hemisphere batch size (the batch framebuffer has to fit into a texture, the depth buffer and the viewport)
+	GLint maxTextureSize, maxRenderbufferSize, maxViewportDims[2];
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTextureSize);
+	glGetIntegerv(GL_MAX_RENDERBUFFER_SIZE, &maxRenderbufferSize);
+	glGetIntegerv(GL_MAX_VIEWPORT_DIMS, maxViewportDims);
+	batchWidth = lm_mini(batchWidth, lm_mini(lm_mini(maxTextureSize, maxRenderbufferSize), maxViewportDims[0]));
+	batchHeight = lm_mini(batchHeight, lm_mini(lm_mini(maxTextureSize, maxRenderbufferSize), maxViewportDims[1]));
+	ctx->hemisphere.fbHemiCountX = lm_maxi(batchWidth / (3 * ctx->hemisphere.size), 1);
+	ctx->hemisphere.fbHemiCountY = lm_maxi(batchHeight / ctx->hemisphere.size, 1);
+	ctx->hemisphere.halfFloat = halfFloat;
+	ctx->hemisphere.ambientOcclusion = ambientOcclusion;
+	ctx->hemisphere.directional = directional;
+	assert(!ambientOcclusion || !directional); // there is no radiance to project
 
 	// hemisphere batch framebuffers
 	int w[] = {
-		ctx->hemisphere.fbHemiCountX * ctx->hemisphere.size * 3,
-		ctx->hemisphere.fbHemiCountX * ctx->hemisphere.size / 2 };
+		(int)(ctx->hemisphere.fbHemiCountX * ctx->hemisphere.size * 3),
+		(int)(ctx->hemisphere.fbHemiCountX * ctx->hemisphere.size / 2),
+		(int)(ctx->hemisphere.fbHemiCountX * ctx->hemisphere.size / 4) };
 	int h[] = {
-		ctx->hemisphere.fbHemiCountY * ctx->hemisphere.size,
-		ctx->hemisphere.fbHemiCountY * ctx->hemisphere.size / 2 };
+		(int)(ctx->hemisphere.fbHemiCountY * ctx->hemisphere.size),
+		(int)(ctx->hemisphere.fbHemiCountY * ctx->hemisphere.size / 2),
+		(int)(ctx->hemisphere.fbHemiCountY * ctx->hemisphere.size / 4) };
+	int fbCount = ambientOcclusion || directional ? 3 : 2;
 
-	glGenTextures(2, ctx->hemisphere.fbTexture);
-	glGenFramebuffers(2, ctx->hemisphere.fb);
-	glGenRenderbuffers(1, &ctx->hemisphere.fbDepth);
-
-	glBindRenderbuffer(GL_RENDERBUFFER, ctx->hemisphere.fbDepth);
-	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, w[0], h[0]);
+	glGenFramebuffers(fbCount, ctx->hemisphere.fb);
 	glBindFramebuffer(GL_FRAMEBUFFER, ctx->hemisphere.fb[0]);
-	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, ctx->hemisphere.fbDepth);
-	for (int i = 0; i < 2; i++)
+	if (ambientOcclusion)
+	{ // depth-only hemispheres, which are read by the first pass
+		glGenTextures(1, &ctx->hemisphere.fbDepthTexture);
+		glBindTexture(GL_TEXTURE_2D, ctx->hemisphere.fbDepthTexture);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT32F, w[0], h[0], 0, GL_DEPTH_COMPONENT, GL_FLOAT, 0);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, ctx->hemisphere.fbDepthTexture, 0);
+		glDrawBuffer(GL_NONE);
+		glReadBuffer(GL_NONE);
+		ctx->hemisphere.fbTextureSize[0][0] = w[0];
+		ctx->hemisphere.fbTextureSize[0][1] = h[0];
+	}
+	else
+	{
+		glGenRenderbuffers(1, &ctx->hemisphere.fbDepth);
+		glBindRenderbuffer(GL_RENDERBUFFER, ctx->hemisphere.fbDepth);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, w[0], h[0]);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, ctx->hemisphere.fbDepth);
+	}
+	glGenTextures(fbCount, ctx->hemisphere.fbTexture);
+	for (int i = ambientOcclusion ? 1 : 0; i < fbCount; i++)
 	{
 		glBindTexture(GL_TEXTURE_2D, ctx->hemisphere.fbTexture[i]);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, w[i], h[i], 0, GL_RGBA, GL_FLOAT, 0);
+		if (ambientOcclusion)
+			glTexImage2D(GL_TEXTURE_2D, 0, halfFloat ? GL_R16F : GL_R32F, w[i], h[i], 0, GL_RED, GL_FLOAT, 0);
+		else
+			glTexImage2D(GL_TEXTURE_2D, 0, halfFloat ? GL_RGBA16F : GL_RGBA32F, w[i], h[i], 0, GL_RGBA, GL_FLOAT, 0);
 
         ctx->hemisphere.fbTextureSize[i][0] = w[i];
         ctx->hemisphere.fbTextureSize[i][1] = h[i];
 
 		glBindFramebuffer(GL_FRAMEBUFFER, ctx->hemisphere.fb[i]);
 		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, ctx->hemisphere.fbTexture[i], 0);
+		if (directional && i > 0)
+		{ // the first pass writes the L1 band of every color channel into attachments 1-3
+			glGenTextures(3, ctx->hemisphere.fbDirectionTexture[i]);
+			for (int j = 0; j < 3; j++)
+			{
+				glBindTexture(GL_TEXTURE_2D, ctx->hemisphere.fbDirectionTexture[i][j]);
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+				glTexImage2D(GL_TEXTURE_2D, 0, halfFloat ? GL_RGBA16F : GL_RGBA32F, w[i], h[i], 0, GL_RGBA, GL_FLOAT, 0);
+				glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1 + j, GL_TEXTURE_2D, ctx->hemisphere.fbDirectionTexture[i][j], 0);
+			}
+		}
+	}
+	for (int i = 0; i < fbCount; i++)
+	{
+		glBindFramebuffer(GL_FRAMEBUFFER, ctx->hemisphere.fb[i]);
 		GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
 		if (status != GL_FRAMEBUFFER_COMPLETE)
 		{
 			fprintf(stderr, "Could not create framebuffer!\n");
 			glDeleteRenderbuffers(1, &ctx->hemisphere.fbDepth);
-			glDeleteFramebuffers(2, ctx->hemisphere.fb);
-			glDeleteTextures(2, ctx->hemisphere.fbTexture);
+			glDeleteTextures(1, &ctx->hemisphere.fbDepthTexture);
+			glDeleteFramebuffers(3, ctx->hemisphere.fb);
+			glDeleteTextures(3, ctx->hemisphere.fbTexture);
+			glDeleteTextures(9, ctx->hemisphere.fbDirectionTexture[0]);
 			LM_FREE(ctx);
 			return NULL;
 		}
@@ -1196,34 +2847,137 @@ lm_context *lmCreate(int hemisphereSize, float zNear, float zFar,
 				"vec4 rt = threeWeightedSamples(h_uv, w_uv, ivec2(1, 1));\n"
 				"gl_FragColor = lb + rb + lt + rt;\n"
 			"}\n";
-		ctx->hemisphere.firstPass.programID = lm_LoadProgram(vs, fs);
-		if (!ctx->hemisphere.firstPass.programID)
-		{
-			fprintf(stderr, "Error loading the hemisphere first pass shader program... leaving!\n");
-			glDeleteVertexArrays(1, &ctx->hemisphere.vao);
-			glDeleteRenderbuffers(1, &ctx->hemisphere.fbDepth);
-			glDeleteFramebuffers(2, ctx->hemisphere.fb);
-			glDeleteTextures(2, ctx->hemisphere.fbTexture);
-			LM_FREE(ctx);
-			return NULL;
-		}
-		ctx->hemisphere.firstPass.hemispheresTextureID = glGetUniformLocation(ctx->hemisphere.firstPass.programID, "hemispheres");
-		ctx->hemisphere.firstPass.hemispheresTextureSizeID = glGetUniformLocation(ctx->hemisphere.firstPass.programID, "hemispheresTextureSize");
-		ctx->hemisphere.firstPass.weightsTextureID = glGetUniformLocation(ctx->hemisphere.firstPass.programID, "weights");
-		ctx->hemisphere.firstPass.weightsTextureSizeID = glGetUniformLocation(ctx->hemisphere.firstPass.programID, "weightsTextureSize");
-	}
-
-	// downsample shader
-	{
-		const char *vs =
+		const char *aofs =
 			"#version 120\n"
-        
-            "#extension GL_EXT_gpu_shader4 : require\n"
 
-            "const vec2 ps[4] = vec2[](vec2(1, -1), vec2(1, 1), vec2(-1, -1), vec2(-1, 1));\n"
-			"void main()\n"
+			"#extension GL_EXT_gpu_shader4 : require\n"
+
+			"uniform sampler2D hemispheres;\n" // depth
+			"uniform ivec2 hemispheresTextureSize;\n"
+			"uniform sampler2D weights;\n" // color weight, solid angle, distance per linear depth
+			"uniform ivec2 weightsTextureSize;\n"
+			"uniform vec3 depthParameters;\n" // zNear, zFar, paraboloid
+
+			"vec4 texelFetch(sampler2D tex, ivec2 size, ivec2 coord, int lod)\n"
 			"{\n"
-				"gl_Position = vec4(ps[gl_VertexID], 0, 1);\n"
+			"    vec2 fCoord = vec2((2.0*coord.x + 1.0)/(2.0*float(size.x)),(2.0*coord.y + 1.0)/(2.0*float(size.y)));\n"
+			"    return texture2D(tex, fCoord);\n"
+			"}\n"
+
+			"float weightedSample(ivec2 h_uv, ivec2 w_uv, ivec2 quadrant)\n"
+			"{\n" // visibility rises linearly with the distance of the occluder and is 1 beyond zFar
+				"float depth = texelFetch(hemispheres, hemispheresTextureSize, h_uv + quadrant, 0).r;\n"
+				"vec3 weight = texelFetch(weights, weightsTextureSize, w_uv + quadrant, 0).rgb;\n"
+				"float n = depthParameters.x, f = depthParameters.y;\n"
+				"float z = depthParameters.z > 0.5 ? mix(n, f, depth) : 2.0 * n * f / (f + n - (2.0 * depth - 1.0) * (f - n));\n"
+				"return min(z * weight.b / f, 1.0) * weight.r;\n"
+			"}\n"
+
+			"float threeWeightedSamples(ivec2 h_uv, ivec2 w_uv, ivec2 offset)\n"
+			"{\n" // horizontal triple sum
+				"float sum = weightedSample(h_uv, w_uv, offset);\n"
+				"offset.x += 2;\n"
+				"sum += weightedSample(h_uv, w_uv, offset);\n"
+				"offset.x += 2;\n"
+				"sum += weightedSample(h_uv, w_uv, offset);\n"
+				"return sum;\n"
+			"}\n"
+
+			"void main()\n"
+			"{\n" // this is a weighted sum downsampling pass of the visibility into a single channel
+				"vec2 in_uv = (gl_FragCoord.xy - vec2(0.5)) * vec2(6.0, 2.0) + vec2(0.01);\n"
+				"ivec2 h_uv = ivec2(in_uv);\n"
+				"ivec2 w_uv = ivec2(mod(in_uv, vec2(weightsTextureSize)));\n"
+				"float lb = threeWeightedSamples(h_uv, w_uv, ivec2(0, 0));\n"
+				"float rb = threeWeightedSamples(h_uv, w_uv, ivec2(1, 0));\n"
+				"float lt = threeWeightedSamples(h_uv, w_uv, ivec2(0, 1));\n"
+				"float rt = threeWeightedSamples(h_uv, w_uv, ivec2(1, 1));\n"
+				"gl_FragColor = vec4(lb + rb + lt + rt, 0.0, 0.0, 1.0);\n"
+			"}\n";
+		const char *dirfs =
+			"#version 120\n"
+
+			"#extension GL_EXT_gpu_shader4 : require\n"
+
+			"uniform sampler2D hemispheres;\n"
+			"uniform ivec2 hemispheresTextureSize;\n"
+			"uniform sampler2D weights;\n" // color weight, solid angle, direction xy in the hemisphere frame (z >= 0)
+			"uniform ivec2 weightsTextureSize;\n"
+
+			"vec4 texelFetch(sampler2D tex, ivec2 size, ivec2 coord, int lod)\n"
+			"{\n"
+			"    vec2 fCoord = vec2((2.0*coord.x + 1.0)/(2.0*float(size.x)),(2.0*coord.y + 1.0)/(2.0*float(size.y)));\n"
+			"    return texture2D(tex, fCoord);\n"
+			"}\n"
+
+			"vec4 sum, sumX, sumY, sumZ;\n"
+
+			"void weightedSample(ivec2 h_uv, ivec2 w_uv, ivec2 quadrant)\n"
+			"{\n"
+				"vec4 sample = texelFetch(hemispheres, hemispheresTextureSize, h_uv + quadrant, 0);\n"
+				"vec4 weight = texelFetch(weights, weightsTextureSize, w_uv + quadrant, 0);\n"
+				"vec3 radiance = sample.rgb * weight.r;\n"
+				"sum += vec4(radiance, sample.a * weight.g);\n"
+				"sumX.rgb += radiance * weight.b;\n"
+				"sumY.rgb += radiance * weight.a;\n"
+				"sumZ.rgb += radiance * sqrt(max(1.0 - dot(weight.ba, weight.ba), 0.0));\n"
+			"}\n"
+
+			"void threeWeightedSamples(ivec2 h_uv, ivec2 w_uv, ivec2 offset)\n"
+			"{\n" // horizontal triple sum
+				"weightedSample(h_uv, w_uv, offset);\n"
+				"offset.x += 2;\n"
+				"weightedSample(h_uv, w_uv, offset);\n"
+				"offset.x += 2;\n"
+				"weightedSample(h_uv, w_uv, offset);\n"
+			"}\n"
+
+			"void main()\n"
+			"{\n" // this is a weighted sum downsampling pass that also sums radiance * direction into the L1 band render targets
+				"vec2 in_uv = (gl_FragCoord.xy - vec2(0.5)) * vec2(6.0, 2.0) + vec2(0.01);\n"
+				"ivec2 h_uv = ivec2(in_uv);\n"
+				"ivec2 w_uv = ivec2(mod(in_uv, vec2(weightsTextureSize)));\n"
+				"sum = sumX = sumY = sumZ = vec4(0.0);\n"
+				"threeWeightedSamples(h_uv, w_uv, ivec2(0, 0));\n"
+				"threeWeightedSamples(h_uv, w_uv, ivec2(1, 0));\n"
+				"threeWeightedSamples(h_uv, w_uv, ivec2(0, 1));\n"
+				"threeWeightedSamples(h_uv, w_uv, ivec2(1, 1));\n"
+				"gl_FragData[0] = sum;\n"
+				"gl_FragData[1] = sumX;\n"
+				"gl_FragData[2] = sumY;\n"
+				"gl_FragData[3] = sumZ;\n"
+			"}\n";
+		ctx->hemisphere.firstPass.programID = lm_LoadProgram(vs, ambientOcclusion ? aofs : directional ? dirfs : fs);
+		if (!ctx->hemisphere.firstPass.programID)
+		{
+			fprintf(stderr, "Error loading the hemisphere first pass shader program... leaving!\n");
+			glDeleteVertexArrays(1, &ctx->hemisphere.vao);
+			glDeleteRenderbuffers(1, &ctx->hemisphere.fbDepth);
+			glDeleteTextures(1, &ctx->hemisphere.fbDepthTexture);
+			glDeleteFramebuffers(3, ctx->hemisphere.fb);
+			glDeleteTextures(3, ctx->hemisphere.fbTexture);
+			glDeleteTextures(9, ctx->hemisphere.fbDirectionTexture[0]);
+			LM_FREE(ctx);
+			return NULL;
+		}
+		ctx->hemisphere.firstPass.hemispheresTextureID = glGetUniformLocation(ctx->hemisphere.firstPass.programID, "hemispheres");
+		ctx->hemisphere.firstPass.hemispheresTextureSizeID = glGetUniformLocation(ctx->hemisphere.firstPass.programID, "hemispheresTextureSize");
+		ctx->hemisphere.firstPass.weightsTextureID = glGetUniformLocation(ctx->hemisphere.firstPass.programID, "weights");
+		ctx->hemisphere.firstPass.weightsTextureSizeID = glGetUniformLocation(ctx->hemisphere.firstPass.programID, "weightsTextureSize");
+		ctx->hemisphere.firstPass.depthParametersID = glGetUniformLocation(ctx->hemisphere.firstPass.programID, "depthParameters");
+	}
+
+	// downsample shader
+	{
+		const char *vs =
+			"#version 120\n"
+        
+            "#extension GL_EXT_gpu_shader4 : require\n"
+
+            "const vec2 ps[4] = vec2[](vec2(1, -1), vec2(1, 1), vec2(-1, -1), vec2(-1, 1));\n"
+			"void main()\n"
+			"{\n"
+				"gl_Position = vec4(ps[gl_VertexID], 0, 1);\n"
 			"}\n";
 		const char *fs =
 			"#version 120\n"
@@ -1255,8 +3009,10 @@ lm_context *lmCreate(int hemisphereSize, float zNear, float zFar,
 			glDeleteProgram(ctx->hemisphere.firstPass.programID);
 			glDeleteVertexArrays(1, &ctx->hemisphere.vao);
 			glDeleteRenderbuffers(1, &ctx->hemisphere.fbDepth);
-			glDeleteFramebuffers(2, ctx->hemisphere.fb);
-			glDeleteTextures(2, ctx->hemisphere.fbTexture);
+			glDeleteTextures(1, &ctx->hemisphere.fbDepthTexture);
+			glDeleteFramebuffers(3, ctx->hemisphere.fb);
+			glDeleteTextures(3, ctx->hemisphere.fbTexture);
+			glDeleteTextures(9, ctx->hemisphere.fbDirectionTexture[0]);
 			LM_FREE(ctx);
 			return NULL;
 		}
@@ -1264,11 +3020,124 @@ lm_context *lmCreate(int hemisphereSize, float zNear, float zFar,
 		ctx->hemisphere.downsamplePass.hemispheresTextureSizeID = glGetUniformLocation(ctx->hemisphere.downsamplePass.programID, "hemispheresTextureSize");
 	}
 
-	// pbo (needed for async GPU->CPU transfers of the downsampled hemisphere results)
-	glGenBuffers(1, &ctx->hemisphere.transfer.pbo);
-	glBindBuffer(GL_PIXEL_PACK_BUFFER, ctx->hemisphere.transfer.pbo);
-	glBufferData(GL_PIXEL_PACK_BUFFER, ctx->hemisphere.fbHemiCountX * ctx->hemisphere.fbHemiCountY * 4 * sizeof(float), 0, GL_STREAM_READ);
-	//glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+#ifdef LM_COMPUTE
+	// reduction compute shader (replaces the downsample passes, the fb copy and the read back if OpenGL 4.3 is available)
+	GLint computeMajor = 0, computeMinor = 0;
+	glGetIntegerv(GL_MAJOR_VERSION, &computeMajor);
+	glGetIntegerv(GL_MINOR_VERSION, &computeMinor);
+	if (!options->downsamplePasses && (computeMajor > 4 || (computeMajor == 4 && computeMinor >= 3)))
+	{
+		int n = ctx->hemisphere.size / 2; // hemisphere size after the first pass
+		int g = n < 16 ? n : 16; // work group size
+		int levels = 0; // quad tree levels of the tile of each invocation
+		while ((g << levels) < n)
+			levels++;
+		char cs[2048];
+		snprintf(cs, sizeof(cs),
+			"#version 430\n"
+			"#define N %d\n"
+			"#define G %d\n"
+			"#define LEVELS %d\n"
+			"#define HALF %d\n"
+			"#define AO %d\n"
+			"layout(local_size_x = G, local_size_y = G) in;\n"
+			"uniform sampler2D hemispheres;\n"
+			"uniform int resultOffset;\n" // the L1 band of directional contexts is reduced into the same buffer after the lightmap values
+			"#if AO\n" // one float per hemisphere
+			"#define T float\n"
+			"#define FETCH(p) texelFetch(hemispheres, p, 0).r\n"
+			"layout(std430, binding = 0) writeonly buffer Results { float results[]; };\n"
+			"#define RESULT(v) v\n"
+			"#else\n"
+			"#define T vec4\n"
+			"#define FETCH(p) texelFetch(hemispheres, p, 0)\n"
+			"#if HALF\n" // the same packed halfs as the glReadPixels readback
+			"layout(std430, binding = 0) writeonly buffer Results { uvec2 results[]; };\n"
+			"#define RESULT(v) uvec2(packHalf2x16(v.rg), packHalf2x16(v.ba))\n"
+			"#else\n"
+			"layout(std430, binding = 0) writeonly buffer Results { vec4 results[]; };\n"
+			"#define RESULT(v) v\n"
+			"#endif\n"
+			"#endif\n"
+			"shared T sums[G * G];\n"
+
+			"void main()\n"
+			"{\n" // every node is summed in the same order as in the downsample passes: lb + rb + lt + rt
+				"ivec2 local = ivec2(gl_LocalInvocationID.xy);\n"
+				"ivec2 base = ivec2(gl_WorkGroupID.xy) * N + (local << LEVELS);\n"
+				"T partial[LEVELS + 1];\n"
+				"int count[LEVELS + 1];\n"
+				"for (int l = 0; l <= LEVELS; l++)\n"
+					"count[l] = 0;\n"
+				"for (int i = 0; i < (1 << (2 * LEVELS)); i++)\n"
+				"{\n" // walk the own tile in morton order and close quad tree nodes when they are complete
+					"ivec2 p = ivec2(0);\n"
+					"for (int b = 0; b < LEVELS; b++)\n"
+						"p |= ivec2((i >> (2 * b)) & 1, (i >> (2 * b + 1)) & 1) << b;\n"
+					"T v = FETCH(base + p);\n"
+					"for (int l = 0; ; l++)\n"
+					"{\n"
+						"partial[l] = count[l] == 0 ? v : partial[l] + v;\n"
+						"if (++count[l] < 4 || l == LEVELS)\n"
+							"break;\n"
+						"v = partial[l];\n"
+						"count[l] = 0;\n"
+					"}\n"
+				"}\n"
+				"int index = local.y * G + local.x;\n"
+				"sums[index] = partial[LEVELS];\n"
+				"memoryBarrierShared();\n"
+				"barrier();\n"
+				"for (int s = 1; s < G; s *= 2)\n"
+				"{\n" // shared memory tree reduction of the tiles
+					"if (((local.x | local.y) & (2 * s - 1)) == 0)\n"
+						"sums[index] = sums[index] + sums[index + s] + sums[index + s * G] + sums[index + s * G + s];\n"
+					"memoryBarrierShared();\n"
+					"barrier();\n"
+				"}\n"
+				"if (index == 0)\n"
+					"results[resultOffset + int(gl_WorkGroupID.y * gl_NumWorkGroups.x + gl_WorkGroupID.x)] = RESULT(sums[0]);\n"
+			"}\n", n, g, levels, halfFloat && !ambientOcclusion ? 1 : 0, ambientOcclusion ? 1 : 0);
+		ctx->hemisphere.reducePass.programID = lm_LoadComputeProgram(cs);
+		if (ctx->hemisphere.reducePass.programID)
+		{
+			glUseProgram(ctx->hemisphere.reducePass.programID);
+			glUniform1i(glGetUniformLocation(ctx->hemisphere.reducePass.programID, "hemispheres"), 0);
+			ctx->hemisphere.reducePass.resultOffsetID = glGetUniformLocation(ctx->hemisphere.reducePass.programID, "resultOffset");
+			glUseProgram(0);
+		}
+		else
+			fprintf(stderr, "Could not load the hemisphere reduction compute shader. Using the downsample passes.\n");
+	}
+#endif
+
+	// pbo ring (needed for async GPU->CPU transfers of the downsampled hemisphere results)
+#ifdef GL_TIME_ELAPSED
+	GLint glMajor = 0, glMinor = 0;
+	glGetIntegerv(GL_MAJOR_VERSION, &glMajor);
+	glGetIntegerv(GL_MINOR_VERSION, &glMinor);
+	ctx->hemisphere.transfer.timerQueries = glMajor > 3 || (glMajor == 3 && glMinor >= 3); // only for statistics
+#endif
+	ctx->hemisphere.transfer.count = transferRingSize;
+	ctx->hemisphere.transfer.ring = (lm_hemisphereTransfer*)LM_CALLOC(transferRingSize, sizeof(lm_hemisphereTransfer));
+	for (int i = 0; i < transferRingSize; i++)
+	{
+		lm_hemisphereTransfer *transfer = ctx->hemisphere.transfer.ring + i;
+		glGenBuffers(1, &transfer->pbo);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, transfer->pbo);
+		if (ambientOcclusion) // always read back as floats (halfs would not save much on a single channel)
+			glBufferData(GL_PIXEL_PACK_BUFFER, ctx->hemisphere.fbHemiCountX * ctx->hemisphere.fbHemiCountY * sizeof(float), 0, GL_STREAM_READ);
+		else // directional: lightmap values followed by the x, y and z L1 band values
+			glBufferData(GL_PIXEL_PACK_BUFFER, ctx->hemisphere.fbHemiCountX * ctx->hemisphere.fbHemiCountY * 4 * (directional ? 4 : 1) * (halfFloat ? sizeof(unsigned short) : sizeof(float)), 0, GL_STREAM_READ);
+		if (ctx->hemisphere.transfer.timerQueries)
+			glGenQueries(1, &transfer->timerQuery);
+		transfer->fbHemiToLightmapLocation = (lm_lightmapLocation*)LM_CALLOC(ctx->hemisphere.fbHemiCountX * ctx->hemisphere.fbHemiCountY, sizeof(lm_lightmapLocation));
+		if (directional)
+			transfer->fbHemiSamples = (lm_hemisphereSample*)LM_CALLOC(ctx->hemisphere.fbHemiCountX * ctx->hemisphere.fbHemiCountY, sizeof(lm_hemisphereSample));
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	if (halfFloat && !ambientOcclusion)
+		ctx->hemisphere.transfer.results = (float*)LM_CALLOC(ctx->hemisphere.fbHemiCountX * ctx->hemisphere.fbHemiCountY * 4 * (directional ? 4 : 1), sizeof(float));
 
 	// hemisphere weights texture
 	glGenTextures(1, &ctx->hemisphere.firstPass.weightsTexture);
@@ -1281,14 +3150,55 @@ lm_context *lmCreate(int hemisphereSize, float zNear, float zFar,
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
 
 	// allocate batchPosition-to-lightmapPosition maps
-	ctx->hemisphere.fbHemiToLightmapLocation = (lm_ivec2*)LM_CALLOC(ctx->hemisphere.fbHemiCountX * ctx->hemisphere.fbHemiCountY, sizeof(lm_ivec2));
-	ctx->hemisphere.transfer.fbHemiToLightmapLocation = (lm_ivec2*)LM_CALLOC(ctx->hemisphere.fbHemiCountX * ctx->hemisphere.fbHemiCountY, sizeof(lm_ivec2));
+	ctx->hemisphere.fbHemiToLightmapLocation = (lm_lightmapLocation*)LM_CALLOC(ctx->hemisphere.fbHemiCountX * ctx->hemisphere.fbHemiCountY, sizeof(lm_lightmapLocation));
+	if (directional)
+		ctx->hemisphere.fbHemiSamples = (lm_hemisphereSample*)LM_CALLOC(ctx->hemisphere.fbHemiCountX * ctx->hemisphere.fbHemiCountY, sizeof(lm_hemisphereSample));
+
+	return ctx;
+}
+
+lm_context *lmCreateCPU(int hemisphereSize, float zNear, float zFar,
+	float clearR, float clearG, float clearB,
+	int interpolationPasses, float interpolationThreshold)
+{
+	lm_context *ctx = lm_createContext(hemisphereSize, zNear, zFar, clearR, clearG, clearB, interpolationPasses, interpolationThreshold);
+	ctx->cpu.enabled = LM_TRUE;
+
+	// hemisphere batch (big enough to keep all cores busy)
+	ctx->hemisphere.fbHemiCountX = 64;
+	ctx->hemisphere.fbHemiCountY = 16;
+	ctx->hemisphere.fbHemiToLightmapLocation = (lm_lightmapLocation*)LM_CALLOC(ctx->hemisphere.fbHemiCountX * ctx->hemisphere.fbHemiCountY, sizeof(lm_lightmapLocation));
+	ctx->cpu.samples = (lm_hemisphereSample*)LM_CALLOC(ctx->hemisphere.fbHemiCountX * ctx->hemisphere.fbHemiCountY, sizeof(lm_hemisphereSample));
+	ctx->cpu.results = (float*)LM_CALLOC(ctx->hemisphere.fbHemiCountX * ctx->hemisphere.fbHemiCountY * 4, sizeof(float));
+
+	// hemicube ray directions: the full center side and the upper halves of the four sides
+	ctx->cpu.directionCount = 3 * hemisphereSize * hemisphereSize;
+	ctx->cpu.directions = (lm_vec3*)LM_CALLOC(ctx->cpu.directionCount, sizeof(lm_vec3));
+	ctx->cpu.weights = (lm_vec2*)LM_CALLOC(ctx->cpu.directionCount, sizeof(lm_vec2));
+	lmSetHemisphereWeights(ctx, lm_defaultWeights, 0);
 
 	return ctx;
 }
 
 void lmDestroy(lm_context *ctx)
 {
+	if (ctx->cpu.enabled)
+	{
+		LM_FREE(ctx->cpu.directions);
+		LM_FREE(ctx->cpu.weights);
+		LM_FREE(ctx->cpu.samples);
+		LM_FREE(ctx->cpu.results);
+		LM_FREE(ctx->cpu.nodes);
+		LM_FREE(ctx->cpu.triangles);
+		LM_FREE(ctx->cpu.uvs);
+		LM_FREE(ctx->cpu.albedo);
+		LM_FREE(ctx->cpu.emission);
+		LM_FREE(ctx->hemisphere.fbHemiToLightmapLocation);
+		lm_freeGeometry(ctx);
+		LM_FREE(ctx);
+		return;
+	}
+
 	// reset state
 	glUseProgram(0);
 	glBindTexture(GL_TEXTURE_2D, 0);
@@ -1300,27 +3210,102 @@ void lmDestroy(lm_context *ctx)
 
 	// delete gl objects
 	glDeleteTextures(1, &ctx->hemisphere.firstPass.weightsTexture);
-	glDeleteBuffers(1, &ctx->hemisphere.transfer.pbo);
+	for (unsigned int i = 0; i < ctx->hemisphere.transfer.count; i++)
+	{
+		if (ctx->hemisphere.transfer.ring[i].fence) // lmDestroy was called before the baking was done
+			glDeleteSync(ctx->hemisphere.transfer.ring[i].fence);
+		glDeleteBuffers(1, &ctx->hemisphere.transfer.ring[i].pbo);
+		if (ctx->hemisphere.transfer.ring[i].timerQuery)
+			glDeleteQueries(1, &ctx->hemisphere.transfer.ring[i].timerQuery);
+		LM_FREE(ctx->hemisphere.transfer.ring[i].fbHemiToLightmapLocation);
+		if (ctx->hemisphere.transfer.ring[i].fbHemiSamples)
+			LM_FREE(ctx->hemisphere.transfer.ring[i].fbHemiSamples);
+	}
+#ifdef LM_COMPUTE
+	if (ctx->hemisphere.reducePass.programID)
+		glDeleteProgram(ctx->hemisphere.reducePass.programID);
+#endif
 	glDeleteProgram(ctx->hemisphere.downsamplePass.programID);
 	glDeleteProgram(ctx->hemisphere.firstPass.programID);
 	glDeleteVertexArrays(1, &ctx->hemisphere.vao);
 	glDeleteRenderbuffers(1, &ctx->hemisphere.fbDepth);
-	glDeleteFramebuffers(2, ctx->hemisphere.fb);
-	glDeleteTextures(2, ctx->hemisphere.fbTexture);
+	glDeleteTextures(1, &ctx->hemisphere.fbDepthTexture);
+	glDeleteFramebuffers(3, ctx->hemisphere.fb);
+	glDeleteTextures(3, ctx->hemisphere.fbTexture);
+	glDeleteTextures(9, ctx->hemisphere.fbDirectionTexture[0]);
 
 	// free memory
-	LM_FREE(ctx->hemisphere.transfer.fbHemiToLightmapLocation);
+	LM_FREE(ctx->hemisphere.transfer.ring);
+	if (ctx->hemisphere.transfer.results)
+		LM_FREE(ctx->hemisphere.transfer.results);
+	LM_FREE(ctx->hemisphere.batch.viewports);
+	LM_FREE(ctx->hemisphere.batch.views);
+	LM_FREE(ctx->hemisphere.batch.projections);
+	lm_freeGeometry(ctx);
 	LM_FREE(ctx->hemisphere.fbHemiToLightmapLocation);
-#ifdef LM_DEBUG_INTERPOLATION
-	LM_FREE(ctx->lightmap.debug);
-#endif
+	if (ctx->hemisphere.fbHemiSamples)
+		LM_FREE(ctx->hemisphere.fbHemiSamples);
+	if (ctx->debug.image)
+		LM_FREE(ctx->debug.image);
 	LM_FREE(ctx);
 }
 
+static void lm_cpuSetHemisphereWeights(lm_context *ctx, lm_weight_func f, void *userdata)
+{
+	// ray directions through the texel centers of the same hemicube that would be rendered otherwise
+	float center = (ctx->hemisphere.size - 1) * 0.5f;
+	double sum = 0.0;
+	int n = 0;
+	for (unsigned int y = 0; y < ctx->hemisphere.size; y++)
+	{
+		float dy = 2.0f * (y - center) / (float)ctx->hemisphere.size;
+		for (unsigned int x = 0; x < ctx->hemisphere.size; x++)
+		{
+			float dx = 2.0f * (x - center) / (float)ctx->hemisphere.size;
+			lm_vec3 v = lm_normalize3(lm_v3(dx, dy, 1.0f));
+
+			float solidAngle = v.z * v.z * v.z;
+
+			// center side
+			ctx->cpu.directions[n] = v;
+			ctx->cpu.weights[n++] = lm_v2(solidAngle * f(v.z, userdata), solidAngle);
+			sum += (double)solidAngle;
+
+			// right, left, up and down sides (only the halves above the surface, dx points along the surface normal)
+			if (dx > 0.0f)
+			{
+				lm_vec2 w = lm_v2(solidAngle * f(v.x, userdata), solidAngle);
+				ctx->cpu.directions[n] = lm_v3( v.z,  v.y, v.x); ctx->cpu.weights[n++] = w;
+				ctx->cpu.directions[n] = lm_v3(-v.z,  v.y, v.x); ctx->cpu.weights[n++] = w;
+				ctx->cpu.directions[n] = lm_v3( v.y,  v.z, v.x); ctx->cpu.weights[n++] = w;
+				ctx->cpu.directions[n] = lm_v3( v.y, -v.z, v.x); ctx->cpu.weights[n++] = w;
+				sum += 4.0 * (double)solidAngle;
+			}
+		}
+	}
+	assert(n == ctx->cpu.directionCount);
+
+	// normalize weights
+	float weightScale = (float)(1.0 / sum);
+	for (int i = 0; i < n; i++)
+		ctx->cpu.weights[i] = lm_scale2(ctx->cpu.weights[i], weightScale);
+}
+
 void lmSetHemisphereWeights(lm_context *ctx, lm_weight_func f, void *userdata)
 {
+	ctx->hemisphere.weightFunc = f;
+	ctx->hemisphere.weightUserdata = userdata;
+	if (ctx->cpu.enabled)
+	{
+		lm_cpuSetHemisphereWeights(ctx, f, userdata);
+		return;
+	}
+
 	// hemisphere weights texture. bakes in material dependent attenuation behaviour.
-	float *weights = (float*)LM_CALLOC(2 * 3 * ctx->hemisphere.size * ctx->hemisphere.size, sizeof(float));
+	// ambient occlusion contexts also store the distance per unit of linear depth of every texel,
+	// directional contexts the x and y of the texel direction in the hemisphere frame (right, up, direction).
+	int c = ctx->hemisphere.ambientOcclusion ? 3 : ctx->hemisphere.directional ? 4 : 2;
+	float *weights = (float*)LM_CALLOC(c * 3 * ctx->hemisphere.size * ctx->hemisphere.size, sizeof(float));
 	float center = (ctx->hemisphere.size - 1) * 0.5f;
 	double sum = 0.0;
 	for (unsigned int y = 0; y < ctx->hemisphere.size; y++)
@@ -1329,14 +3314,34 @@ void lmSetHemisphereWeights(lm_context *ctx, lm_weight_func f, void *userdata)
 		for (unsigned int x = 0; x < ctx->hemisphere.size; x++)
 		{
 			float dx = 2.0f * (x - center) / (float)ctx->hemisphere.size;
+			float *w0 = weights + c * (y * (3 * ctx->hemisphere.size) + x);
+			float *w1 = w0 + c * ctx->hemisphere.size;
+			float *w2 = w1 + c * ctx->hemisphere.size;
+
+			if (ctx->hemisphere.projection == LM_PARABOLOID)
+			{ // only the center square is used. the inverse paraboloid mapping of its unit disk covers the hemisphere.
+				float r2 = dx * dx + dy * dy;
+				if (r2 < 1.0f)
+				{
+					float solidAngle = 4.0f / ((1.0f + r2) * (1.0f + r2));
+					w0[0] = solidAngle * f((1.0f - r2) / (1.0f + r2), userdata);
+					w0[1] = solidAngle;
+					if (c == 3)
+						w0[2] = (1.0f + r2) / (1.0f - r2);
+					if (c == 4)
+					{
+						w0[2] = 2.0f * dx / (1.0f + r2);
+						w0[3] = 2.0f * dy / (1.0f + r2);
+					}
+					sum += (double)solidAngle;
+				}
+				continue;
+			}
+
 			lm_vec3 v = lm_normalize3(lm_v3(dx, dy, 1.0f));
 
 			float solidAngle = v.z * v.z * v.z;
 
-			float *w0 = weights + 2 * (y * (3 * ctx->hemisphere.size) + x);
-			float *w1 = w0 + 2 * ctx->hemisphere.size;
-			float *w2 = w1 + 2 * ctx->hemisphere.size;
-
 			// center weights
 			w0[0] = solidAngle * f(v.z, userdata);
 			w0[1] = solidAngle;
@@ -1349,294 +3354,1762 @@ void lmSetHemisphereWeights(lm_context *ctx, lm_weight_func f, void *userdata)
 			w2[0] = solidAngle * f(lm_absf(v.y), userdata);
 			w2[1] = solidAngle;
 
+			if (c == 3) // the same for all sides
+				w0[2] = w1[2] = w2[2] = 1.0f / v.z;
+			if (c == 4)
+			{ // see the view parameters of the sides in lm_beginSampleHemisphere
+				w0[2] = v.x;                         w0[3] = v.y;
+				w1[2] = dx < 0.0f ? v.z : -v.z;      w1[3] = v.y; // right, left
+				w2[2] = v.x;                         w2[3] = dy > 0.0f ? -v.z : v.z; // down, up
+			}
+
 			sum += 3.0 * (double)solidAngle;
 		}
 	}
 
 	// normalize weights
 	float weightScale = (float)(1.0 / sum);
-	for (unsigned int i = 0; i < 2 * 3 * ctx->hemisphere.size * ctx->hemisphere.size; i++)
-		weights[i] *= weightScale;
+	for (unsigned int i = 0; i < 3 * ctx->hemisphere.size * ctx->hemisphere.size; i++)
+	{
+		weights[i * c + 0] *= weightScale;
+		weights[i * c + 1] *= weightScale;
+	}
 
 	// upload weight texture
 	glBindTexture(GL_TEXTURE_2D, ctx->hemisphere.firstPass.weightsTexture);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32F, 3 * ctx->hemisphere.size, ctx->hemisphere.size, 0, GL_RG, GL_FLOAT, weights);
+	if (c == 4)
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, 3 * ctx->hemisphere.size, ctx->hemisphere.size, 0, GL_RGBA, GL_FLOAT, weights);
+	else if (c == 3)
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB32F, 3 * ctx->hemisphere.size, ctx->hemisphere.size, 0, GL_RGB, GL_FLOAT, weights);
+	else
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32F, 3 * ctx->hemisphere.size, ctx->hemisphere.size, 0, GL_RG, GL_FLOAT, weights);
 	LM_FREE(weights);
 }
 
+void lmSetHemisphereProjection(lm_context *ctx, lm_hemisphere_projection projection)
+{
+	assert(!ctx->cpu.enabled); // rays don't need a projection
+	assert(ctx->hemisphere.fbHemiIndex == 0); // not in the middle of a batch
+	ctx->hemisphere.projection = projection;
+	lmSetHemisphereWeights(ctx, ctx->hemisphere.weightFunc, ctx->hemisphere.weightUserdata);
+}
+
 void lmSetTargetLightmap(lm_context *ctx, float *outLightmap, int w, int h, int c)
 {
-	ctx->lightmap.data = outLightmap;
-	ctx->lightmap.width = w;
-	ctx->lightmap.height = h;
-	ctx->lightmap.channels = c;
+	ctx->geometry.target.data = outLightmap;
+	ctx->geometry.target.width = w;
+	ctx->geometry.target.height = h;
+	ctx->geometry.target.channels = c;
+	ctx->geometry.target.coverage = NULL; // allocated when geometry is added (unless set with lmSetTargetCoverage)
+	ctx->geometry.target.ownsCoverage = LM_FALSE;
+	ctx->geometry.target.tiled = LM_FALSE;
+	ctx->geometry.target.previous = NULL;
+	ctx->geometry.target.converged = NULL;
+	ctx->geometry.target.directions = NULL;
+	ctx->geometry.target.prefilled = LM_FALSE;
+}
 
-#ifdef LM_DEBUG_INTERPOLATION
-	if (ctx->lightmap.debug)
-		LM_FREE(ctx->lightmap.debug);
-	ctx->lightmap.debug = (unsigned char*)LM_CALLOC(ctx->lightmap.width * ctx->lightmap.height, 3);
+unsigned long long lmTiledLightmapSize(int w, int h, int c)
+{
+	unsigned long long tilesX = (w + LM_TILE_SIZE - 1) / LM_TILE_SIZE, tilesY = (h + LM_TILE_SIZE - 1) / LM_TILE_SIZE;
+	return tilesX * tilesY * LM_TILE_SIZE * LM_TILE_SIZE * c * sizeof(float);
+}
+
+void lmSetTargetLightmapTiled(lm_context *ctx, float *outTiledLightmap, int w, int h, int c)
+{
+	lmSetTargetLightmap(ctx, outTiledLightmap, w, h, c);
+	ctx->geometry.target.tiled = LM_TRUE;
+}
+
+float *lmMapTiledLightmap(const char *filename, int w, int h, int c)
+{
+	unsigned long long size = lmTiledLightmapSize(w, h, c);
+	void *data = NULL;
+#if defined(_WIN32)
+	HANDLE file = CreateFileA(filename, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file != INVALID_HANDLE_VALUE)
+	{
+		HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READWRITE, (DWORD)(size >> 32), (DWORD)size, NULL); // grows the file
+		if (mapping)
+		{
+			data = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, (SIZE_T)size);
+			CloseHandle(mapping); // the view keeps the mapping alive
+		}
+		CloseHandle(file);
+	}
+#else
+	int file = open(filename, O_RDWR | O_CREAT, 0644);
+	if (file >= 0)
+	{
+		// grow the file to the full size (new files stay sparse until tiles are written)
+		char zero = 0;
+		if (lseek(file, 0, SEEK_END) >= (off_t)size ||
+			(lseek(file, (off_t)size - 1, SEEK_SET) == (off_t)size - 1 && write(file, &zero, 1) == 1))
+		{
+			data = mmap(NULL, (size_t)size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+			if (data == MAP_FAILED)
+				data = NULL;
+		}
+		close(file); // the mapping keeps the file open
+	}
+#endif
+	if (!data)
+		fprintf(stderr, "Could not map the tiled lightmap file %s!\n", filename);
+	return (float*)data;
+}
+
+void lmFlushTiledLightmap(float *tiledLightmap, int w, int h, int c)
+{
+#if defined(_WIN32)
+	FlushViewOfFile(tiledLightmap, (SIZE_T)lmTiledLightmapSize(w, h, c));
+#else
+	msync(tiledLightmap, (size_t)lmTiledLightmapSize(w, h, c), MS_ASYNC);
+#endif
+}
+
+void lmUnmapTiledLightmap(float *tiledLightmap, int w, int h, int c)
+{
+	if (!tiledLightmap)
+		return;
+#if defined(_WIN32)
+	UnmapViewOfFile(tiledLightmap);
+#else
+	munmap(tiledLightmap, (size_t)lmTiledLightmapSize(w, h, c));
 #endif
 }
 
+int lmCoverageSize(int w, int h)
+{
+	return 2 * ((w * h + 7) / 8);
+}
+
+void lmSetTargetCoverage(lm_context *ctx, unsigned char *coverage)
+{
+	assert(ctx->geometry.target.data); // set the target lightmap first
+	ctx->geometry.target.coverage = coverage;
+	ctx->geometry.target.ownsCoverage = LM_FALSE;
+}
+
+void lmSetTargetDirections(lm_context *ctx, float *outDirections)
+{
+	assert(ctx->hemisphere.directional); // lmCreateEx with options->directional
+	assert(ctx->geometry.target.data && !ctx->geometry.target.tiled); // set the (untiled) target lightmap first
+	ctx->geometry.target.directions = outDirections;
+}
+
+void lmSetInterpolationError(lm_context *ctx, lm_interpolation_error metric, float refinementThreshold)
+{
+	assert(refinementThreshold >= 0.0f);
+	int interpolationPasses = (ctx->meshPosition.passCount - 1) / 3;
+	ctx->interpolationError = metric;
+	ctx->refinementThreshold = interpolationPasses > 0 ? refinementThreshold : 0.0f; // nothing to refine without interpolation
+	ctx->meshPosition.passCount = 1 + 3 * interpolationPasses + (ctx->refinementThreshold > 0.0f ? 1 : 0);
+}
+
+void lmSetDebugCallback(lm_context *ctx, unsigned int stages, lm_debug_func f, void *userdata)
+{
+	assert(!(stages & LM_DEBUG_FIRST_PASS) || !ctx->cpu.enabled); // there is no first pass without rendering
+	ctx->debug.func = f;
+	ctx->debug.userdata = userdata;
+	ctx->debug.stages = f ? stages : 0;
+}
+
+static void lm_restartGeometry(lm_context *ctx)
+{
+	ctx->meshPosition.replay.plan = NULL;
+	ctx->meshPosition.pass = 0;
+	lm_setMeshPosition(ctx, 0);
+	ctx->stats.geometryStartTime = 0.0;
+}
+
 void lmSetGeometry(lm_context *ctx,
 	const float *transformationMatrix,
 	lm_type positionsType, const void *positionsXYZ, int positionsStride,
 	lm_type lightmapCoordsType, const void *lightmapCoordsUV, int lightmapCoordsStride,
 	int count, lm_type indicesType, const void *indices)
 {
-	ctx->mesh.transform = transformationMatrix;
-	ctx->mesh.positions = (const unsigned char*)positionsXYZ;
-	ctx->mesh.positionsType = positionsType;
-	ctx->mesh.positionsStride = positionsStride == 0 ? sizeof(lm_vec3) : positionsStride;
-	ctx->mesh.uvs = (const unsigned char*)lightmapCoordsUV;
-	ctx->mesh.uvsType = lightmapCoordsType;
-	ctx->mesh.uvsStride = lightmapCoordsStride == 0 ? sizeof(lm_vec2) : lightmapCoordsStride;
-	ctx->mesh.indicesType = indicesType;
-	ctx->mesh.indices = (const unsigned char*)indices;
-	ctx->mesh.count = count;
+	lm_clearGeometry(ctx);
+	lm_addGeometry(ctx, transformationMatrix,
+		positionsType, positionsXYZ, positionsStride,
+		lightmapCoordsType, lightmapCoordsUV, lightmapCoordsStride,
+		count, indicesType, indices);
+
+	if (ctx->cpu.enabled)
+		lm_cpuBuildScene(ctx);
+
+	lm_restartGeometry(ctx);
+}
+
+void lmAddGeometry(lm_context *ctx,
+	const float *transformationMatrix,
+	lm_type positionsType, const void *positionsXYZ, int positionsStride,
+	lm_type lightmapCoordsType, const void *lightmapCoordsUV, int lightmapCoordsStride,
+	int count, lm_type indicesType, const void *indices)
+{
+	assert(!ctx->cpu.enabled); // the ray traced scene, its materials and the bounce lightmap are made for one geometry
+	assert(ctx->geometry.geometryCount > 0); // call lmSetGeometry for the first geometry
+	assert(!ctx->dirty.count); // call lmSetDirtyRegions after the last lmAddGeometry
+	lm_addGeometry(ctx, transformationMatrix,
+		positionsType, positionsXYZ, positionsStride,
+		lightmapCoordsType, lightmapCoordsUV, lightmapCoordsStride,
+		count, indicesType, indices);
+	lm_restartGeometry(ctx);
+}
+
+lm_sample_plan *lmCreateSamplePlan(lm_context *ctx)
+{
+	lm_sample_plan *plan = (lm_sample_plan*)LM_CALLOC(1, sizeof(lm_sample_plan));
+	plan->width = ctx->lightmap.width;
+	plan->height = ctx->lightmap.height;
+	plan->passCount = ctx->meshPosition.passCount;
+	plan->triangleCount = ctx->mesh.count / 3;
+
+	// count the rasterizer positions first, then record them with their samples
+	unsigned int entryCount = lm_recordSamplePlan(ctx, plan);
+	plan->triangleFirst = (unsigned int*)LM_CALLOC(plan->passCount * plan->triangleCount + 1, sizeof(unsigned int));
+	plan->entries = (lm_samplePlanEntry*)LM_CALLOC(lm_maxi(entryCount, 1), sizeof(lm_samplePlanEntry));
+	plan->samples = (lm_hemisphereSample*)LM_CALLOC(lm_maxi(entryCount, 1), sizeof(lm_hemisphereSample));
+	lm_recordSamplePlan(ctx, plan);
+
+	// start over like after lmSetGeometry
+	ctx->meshPosition.pass = 0;
+	lm_setMeshPosition(ctx, 0);
+	return plan;
+}
 
+void lmSetSamplePlan(lm_context *ctx, const lm_sample_plan *plan)
+{
+	assert(!plan || (
+		plan->width == ctx->lightmap.width && plan->height == ctx->lightmap.height &&
+		plan->passCount == ctx->meshPosition.passCount && plan->triangleCount == ctx->mesh.count / 3));
+	ctx->meshPosition.replay.plan = plan;
 	ctx->meshPosition.pass = 0;
 	lm_setMeshPosition(ctx, 0);
 }
 
+void lmDestroySamplePlan(lm_sample_plan *plan)
+{
+	if (!plan)
+		return;
+	LM_FREE(plan->triangleFirst);
+	LM_FREE(plan->entries);
+	LM_FREE(plan->samples);
+	LM_FREE(plan);
+}
+
+void lmSetGeometryMaterial(lm_context *ctx,
+	lm_type albedoType, const void *albedoRGB, int albedoStride,
+	lm_type emissionType, const void *emissionRGB, int emissionStride)
+{
+	assert(ctx->cpu.enabled);
+	LM_FREE(ctx->cpu.albedo);
+	LM_FREE(ctx->cpu.emission);
+	ctx->cpu.albedo = NULL;
+	ctx->cpu.emission = NULL;
+
+	// store the vertex values per triangle, so that hits don't need to decode anything
+	unsigned int count = ctx->cpu.triangleCount * 3;
+	if (albedoRGB)
+	{
+		ctx->cpu.albedo = (lm_vec3*)LM_CALLOC(count, sizeof(lm_vec3));
+		int stride = albedoStride == 0 ? 3 * lm_typeSize(albedoType) : albedoStride;
+		lm_vertexDecoder(albedoType)((const unsigned char*)albedoRGB, stride, ctx->mesh.indices, count, &ctx->cpu.albedo->x, 3, lm_typeMax(albedoType));
+	}
+	if (emissionRGB)
+	{
+		ctx->cpu.emission = (lm_vec3*)LM_CALLOC(count, sizeof(lm_vec3));
+		int stride = emissionStride == 0 ? 3 * lm_typeSize(emissionType) : emissionStride;
+		lm_vertexDecoder(emissionType)((const unsigned char*)emissionRGB, stride, ctx->mesh.indices, count, &ctx->cpu.emission->x, 3, lm_typeMax(emissionType));
+	}
+}
+
+void lmSetBounceLightmap(lm_context *ctx, const float *lightmap, int w, int h, int c)
+{
+	assert(ctx->cpu.enabled);
+	assert(!lightmap || (w > 0 && h > 0 && c > 0 && c <= 4));
+	ctx->cpu.bounce.data = lightmap;
+	ctx->cpu.bounce.width = w;
+	ctx->cpu.bounce.height = h;
+	ctx->cpu.bounce.channels = c;
+}
+
+// moves to the next sample position in the current pass. returns false if there are no triangles left.
+static lm_bool lm_moveToNextSamplePosition(lm_context *ctx)
+{
+	double start = lm_time();
+	lm_bool moved = LM_TRUE;
+	// try moving to the next rasterizer position
+	if (lm_findNextConservativeTriangleRasterizerPosition(ctx))
+	{ // if we successfully moved to the next sample position on the current triangle...
+		ctx->meshPosition.hemisphere.side = 0; // start sampling a hemisphere there
+	}
+	// if there are no valid sample positions on the current triangle...
+	else if (ctx->meshPosition.triangle.baseIndex + 3 < ctx->mesh.count)
+	{ // ...and there are triangles left: move to the next triangle and continue sampling.
+		lm_setMeshPosition(ctx, ctx->meshPosition.triangle.baseIndex + 3);
+	}
+	else
+		moved = LM_FALSE; // ...and there are no triangles left
+	ctx->stats.rasterizationTime += lm_time() - start;
+	return moved;
+}
+
+// processes the remaining hemispheres of the current pass and starts the next one. returns false if all passes are done.
+static lm_bool lm_finishPass(lm_context *ctx)
+{
+	lm_processHemisphereBatch(ctx); // start last batch, if there are unprocessed hemispheres
+	lm_finishAllHemisphereBatches(ctx); // the next pass depends on all results of this pass
+
+	if (++ctx->meshPosition.pass == ctx->meshPosition.passCount)
+	{
+		ctx->meshPosition.pass = 0;
+		ctx->meshPosition.triangle.baseIndex = ctx->mesh.count; // set end condition (in case someone accidentally calls lmBegin again)
+
+		// debug output of every target lightmap
+		for (int i = 0; i < ctx->geometry.targetCount; i++)
+		{
+			const lm_targetLightmap *target = ctx->geometry.targets + i;
+			lm_bool saveMask = (ctx->debug.stages & LM_DEBUG_INTERPOLATION_MASK) != 0;
+#ifdef LM_DEBUG_INTERPOLATION
+			saveMask = LM_TRUE;
+#endif
+			if (!saveMask)
+				continue;
+
+			// rendered texels are red, interpolated texels are green
+			int n = target->width * target->height;
+			const unsigned char *interpolatedBits = target->coverage + lmCoverageSize(target->width, target->height) / 2;
+			unsigned char *debug = (unsigned char*)LM_CALLOC(n, 3);
+			for (int j = 0; j < n; j++)
+			{
+				if ((interpolatedBits[j >> 3] >> (j & 7)) & 1)
+					debug[j * 3 + 1] = 255;
+				else if ((target->coverage[j >> 3] >> (j & 7)) & 1)
+					debug[j * 3 + 0] = 255;
+			}
+
+#ifdef LM_DEBUG_INTERPOLATION
+			lmImageSaveTGAub("debug_interpolation.tga", debug, target->width, target->height, 3);
+
+			// lightmap texel statistics
+			int rendered = 0, interpolated = 0, wasted = 0;
+			for (int y = 0; y < target->height; y++)
+			{
+				for (int x = 0; x < target->width; x++)
+				{
+					if (debug[(y * target->width + x) * 3 + 0])
+						rendered++;
+					else if (debug[(y * target->width + x) * 3 + 1])
+						interpolated++;
+					else
+						wasted++;
+				}
+			}
+			int used = rendered + interpolated;
+			int total = used + wasted;
+			printf("\n#######################################################################\n");
+			printf("%10d %6.2f%% rendered hemicubes integrated to lightmap texels.\n", rendered, 100.0f * (float)rendered / (float)total);
+			printf("%10d %6.2f%% interpolated lightmap texels.\n", interpolated, 100.0f * (float)interpolated / (float)total);
+			printf("%10d %6.2f%% wasted lightmap texels.\n", wasted, 100.0f * (float)wasted / (float)total);
+			printf("\n%17.2f%% of used texels were rendered.\n", 100.0f * (float)rendered / (float)used);
+			printf("#######################################################################\n");
+#endif
+
+			if (ctx->debug.stages & LM_DEBUG_INTERPOLATION_MASK)
+			{
+				float *mask = (float*)LM_CALLOC(n * 3, sizeof(float));
+				for (int j = 0; j < n * 3; j++)
+					mask[j] = debug[j] / 255.0f;
+				ctx->debug.func(LM_DEBUG_INTERPOLATION_MASK, mask, target->width, target->height, 3, ctx->debug.userdata);
+				LM_FREE(mask);
+			}
+			LM_FREE(debug);
+		}
+
+		return LM_FALSE;
+	}
+
+	double start = lm_time();
+	lm_setMeshPosition(ctx, 0); // start over with the next pass
+	ctx->stats.rasterizationTime += lm_time() - start;
+	return LM_TRUE;
+}
+
 lm_bool lmBegin(lm_context *ctx, int* outViewport4, float* outView4x4, float* outProjection4x4)
 {
 	assert(ctx->meshPosition.triangle.baseIndex < ctx->mesh.count);
+	if (!ctx->stats.geometryStartTime)
+		ctx->stats.geometryStartTime = lm_time();
 	while (!lm_beginSampleHemisphere(ctx, outViewport4, outView4x4, outProjection4x4))
 	{ // as long as there are no hemisphere sides to render...
-		// try moving to the next rasterizer position
-		if (lm_findNextConservativeTriangleRasterizerPosition(ctx))
-		{ // if we successfully moved to the next sample position on the current triangle...
-			ctx->meshPosition.hemisphere.side = 0; // start sampling a hemisphere there
-		}
-		else
-		{ // if there are no valid sample positions on the current triangle...
-			if (ctx->meshPosition.triangle.baseIndex + 3 < ctx->mesh.count)
-			{ // ...and there are triangles left: move to the next triangle and continue sampling.
-				lm_setMeshPosition(ctx, ctx->meshPosition.triangle.baseIndex + 3);
-			}
-			else
-			{ // ...and there are no triangles left: finish
-				lm_finishProcessHemisphereBatch(ctx); // finish pending batch
-				lm_beginProcessHemisphereBatch(ctx); // start last batch, if there are unprocessed hemispheres
-				lm_finishProcessHemisphereBatch(ctx); // finish last batch
+		if (!lm_moveToNextSamplePosition(ctx) && !lm_finishPass(ctx))
+			return LM_FALSE;
+	}
+	return LM_TRUE;
+}
 
-				if (++ctx->meshPosition.pass == ctx->meshPosition.passCount)
-				{
-					ctx->meshPosition.pass = 0;
-					ctx->meshPosition.triangle.baseIndex = ctx->mesh.count; // set end condition (in case someone accidentally calls lmBegin again)
+int lmBeginBatch(lm_context *ctx, const int **outViewports4, const float **outViews4x4, const float **outProjections4x4)
+{
+	assert(!ctx->cpu.enabled);
+	assert(ctx->meshPosition.triangle.baseIndex < ctx->mesh.count);
+	if (!ctx->stats.geometryStartTime)
+		ctx->stats.geometryStartTime = lm_time();
 
-#ifdef LM_DEBUG_INTERPOLATION
-					lmImageSaveTGAub("debug_interpolation.tga", ctx->lightmap.debug, ctx->lightmap.width, ctx->lightmap.height, 3);
+	unsigned int hemiCount = ctx->hemisphere.fbHemiCountX * ctx->hemisphere.fbHemiCountY;
+	if (!ctx->hemisphere.batch.viewports)
+	{
+		ctx->hemisphere.batch.viewports = (int*)LM_CALLOC(hemiCount * 5 * 4, sizeof(int));
+		ctx->hemisphere.batch.views = (float*)LM_CALLOC(hemiCount * 5 * 16, sizeof(float));
+		ctx->hemisphere.batch.projections = (float*)LM_CALLOC(hemiCount * 5 * 16, sizeof(float));
+	}
+
+	// collect the views of all hemisphere sides until the batch is full or the pass is done
+	int viewCount = 0;
+	while (ctx->hemisphere.fbHemiIndex < hemiCount)
+	{
+		if (lm_beginSampleHemisphere(ctx,
+			ctx->hemisphere.batch.viewports + viewCount * 4,
+			ctx->hemisphere.batch.views + viewCount * 16,
+			ctx->hemisphere.batch.projections + viewCount * 16))
+		{
+			viewCount++;
+			if (++ctx->meshPosition.hemisphere.side == lm_hemisphereSideCount(ctx))
+				ctx->hemisphere.fbHemiIndex++;
+		}
+		else if (!lm_moveToNextSamplePosition(ctx))
+		{
+			if (viewCount)
+				break; // render the partial batch first. the pass is finished by the next lmBeginBatch call.
+			if (!lm_finishPass(ctx))
+				return 0;
+		}
+	}
+
+	*outViewports4 = ctx->hemisphere.batch.viewports;
+	*outViews4x4 = ctx->hemisphere.batch.views;
+	*outProjections4x4 = ctx->hemisphere.batch.projections;
+	return viewCount;
+}
+
+lm_bool lmBakeStep(lm_context *ctx, unsigned int budgetMicroseconds, lm_render_func render, void *userdata)
+{
+	assert(ctx->meshPosition.triangle.baseIndex < ctx->mesh.count);
+	assert(ctx->cpu.enabled || render);
+	double start = lm_time();
+	double end = start + (double)budgetMicroseconds * 1e-6;
+	if (!ctx->stats.geometryStartTime)
+		ctx->stats.geometryStartTime = start;
+
+	// continue a hemisphere that was interrupted by the last step (the application has bound its own framebuffer in the meantime)
+	if (!ctx->cpu.enabled && ctx->meshPosition.hemisphere.side > 0 && ctx->meshPosition.hemisphere.side < lm_hemisphereSideCount(ctx))
+		glBindFramebuffer(GL_FRAMEBUFFER, ctx->hemisphere.fb[0]);
+
+	int vp[4];
+	float view[16], projection[16];
+	for (;;)
+	{
+		while (lm_beginSampleHemisphere(ctx, vp, view, projection))
+		{
+			render(vp, view, projection, userdata);
+			lm_endSampleHemisphere(ctx);
+			if (lm_time() >= end)
+			{
+				glBindFramebuffer(GL_FRAMEBUFFER, 0);
+				return LM_TRUE;
+			}
+		}
+		if (!lm_moveToNextSamplePosition(ctx) && !lm_finishPass(ctx))
+			return LM_FALSE;
+		if (lm_time() >= end)
+		{ // long stretches of interpolated texels or a full ray traced batch
+			if (!ctx->cpu.enabled)
+				glBindFramebuffer(GL_FRAMEBUFFER, 0);
+			return LM_TRUE;
+		}
+	}
+}
+
+void lmCancel(lm_context *ctx)
+{
+	if (!ctx->cpu.enabled)
+	{
+		// the results of the transfers in flight are not needed anymore
+		while (ctx->hemisphere.transfer.pending)
+		{
+			lm_hemisphereTransfer *transfer = ctx->hemisphere.transfer.ring + ctx->hemisphere.transfer.first;
+			glDeleteSync(transfer->fence);
+			transfer->fence = 0;
+			ctx->hemisphere.transfer.first = (ctx->hemisphere.transfer.first + 1) % ctx->hemisphere.transfer.count;
+			ctx->hemisphere.transfer.pending--;
+		}
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	}
+	ctx->hemisphere.fbHemiIndex = 0; // drop the unprocessed hemispheres
+	ctx->meshPosition.hemisphere.side = 5; // put the hemisphere sampler into finished state
+	ctx->meshPosition.pass = 0;
+	ctx->meshPosition.triangle.baseIndex = ctx->mesh.count; // same end condition as a finished bake
+	ctx->stats.geometryStartTime = 0.0;
+}
+
+float lmProgress(lm_context *ctx)
+{
+	float passProgress = (float)ctx->meshPosition.triangle.baseIndex / (float)ctx->mesh.count;
+	return ((float)ctx->meshPosition.pass + passProgress) / (float)ctx->meshPosition.passCount;
+}
+
+void lmEnd(lm_context *ctx)
+{
+	lm_endSampleHemisphere(ctx);
+}
+
+void lmEndBatch(lm_context *ctx)
+{
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	lm_processHemisphereBatch(ctx);
+}
+
+static size_t lm_targetSize(const lm_targetLightmap *target)
+{
+	if (target->tiled)
+		return (size_t)lmTiledLightmapSize(target->width, target->height, target->channels);
+	return (size_t)target->width * target->height * target->channels * sizeof(float);
+}
+
+// marks the texels that changed by less than epsilon since the previous bounce as converged.
+// returns the number of texels that have to be rendered again.
+static unsigned int lm_markConvergedTexels(lm_context *ctx, lm_targetLightmap *target, float epsilon)
+{
+	unsigned int remaining = 0;
+	for (int y = 0; y < target->height; y++)
+	{
+		for (int x = 0; x < target->width; x++)
+		{
+			unsigned int i = y * target->width + x;
+			size_t offset = lm_texelOffset(target, x, y);
+			lm_bool covered = lm_isTexelCovered(target, x, y);
+			if (covered && lm_interpolationError(ctx, target->data + offset, target->previous + offset) < epsilon)
+				target->converged[i >> 3] |= 1 << (i & 7);
+			else
+			{
+				target->converged[i >> 3] &= ~(1 << (i & 7));
+				if (covered)
+					remaining++;
+			}
+		}
+	}
+	return remaining;
+}
+
+// the target values become the previous values
+static void lm_keepTarget(lm_targetLightmap *target)
+{
+	size_t n = lm_targetSize(target) / sizeof(float);
+	for (size_t i = 0; i < n; i++)
+		target->previous[i] = target->data[i];
+}
+
+// the target is cleared for the next bake
+static void lm_clearTarget(lm_targetLightmap *target)
+{
+	size_t n = lm_targetSize(target) / sizeof(float);
+	for (size_t i = 0; i < n; i++)
+		target->data[i] = 0.0f;
+	int coverageSize = lmCoverageSize(target->width, target->height);
+	for (int i = 0; i < coverageSize; i++)
+		target->coverage[i] = 0;
+}
+
+static void lm_restartTarget(lm_targetLightmap *target)
+{
+	lm_keepTarget(target);
+	lm_clearTarget(target);
+}
+
+// lmBakeBounces and lmSetDirtyRegions keep a full copy of the targets, which would defeat the file mapping of tiled ones
+static lm_bool lm_hasTiledTarget(lm_context *ctx)
+{
+	for (int i = 0; i < ctx->geometry.targetCount; i++)
+		if (ctx->geometry.targets[i].tiled)
+			return LM_TRUE;
+	return LM_FALSE;
+}
+
+int lmBakeBounces(lm_context *ctx, int bounceCount, const lm_bounce_callbacks *callbacks)
+{
+	assert(bounceCount > 0);
+	assert(ctx->cpu.enabled || callbacks->render);
+	assert(!ctx->cpu.enabled || (ctx->geometry.targetCount == 1 && !ctx->geometry.targets[0].tiled)); // the bounce lightmap of lmCreateCPU contexts is the previous bounce of the one target
+	assert(ctx->meshPosition.pass == 0 && ctx->meshPosition.triangle.baseIndex < ctx->mesh.count); // call after lmSetGeometry/lmAddGeometry
+	assert(!ctx->dirty.count); // the bounces bake all texels
+	assert(!lm_hasTiledTarget(ctx)); // tiled targets are not supported
+	if (lm_hasTiledTarget(ctx))
+	{
+		fprintf(stderr, "lmBakeBounces doesn't support tiled target lightmaps!\n");
+		return 0;
+	}
+
+	// the sample positions are found once and replayed by every bounce
+	const lm_sample_plan *plan = ctx->meshPosition.replay.plan;
+	lm_sample_plan *ownPlan = NULL;
+	if (!plan)
+		plan = ownPlan = lmCreateSamplePlan(ctx);
+
+	for (int i = 0; i < ctx->geometry.targetCount; i++)
+	{
+		lm_targetLightmap *target = ctx->geometry.targets + i;
+		target->previous = (float*)LM_CALLOC(lm_targetSize(target), 1);
+		target->converged = (unsigned char*)LM_CALLOC((target->width * target->height + 7) / 8, 1);
+	}
+
+	int bounce = 0;
+	while (bounce < bounceCount)
+	{
+		ctx->geometry.current = -1; // reload the target with its converged texels
+		lmSetSamplePlan(ctx, plan);
+		ctx->stats.geometryStartTime = 0.0;
+		if (ctx->cpu.enabled && bounce > 0)
+			lmSetBounceLightmap(ctx, ctx->geometry.targets[0].previous,
+				ctx->geometry.targets[0].width, ctx->geometry.targets[0].height, ctx->geometry.targets[0].channels);
+
+		int vp[4];
+		float view[16], projection[16];
+		while (lmBegin(ctx, vp, view, projection))
+		{
+			callbacks->render(vp, view, projection, callbacks->userdata);
+			lmEnd(ctx);
+		}
+
+		bounce++;
+
+		// a texel has converged if it didn't change from one bounce to the next (the first bounce has nothing to be compared to).
+		// this and the previous values use the unprocessed bake, since bounceDone may post process the targets in place.
+		unsigned int remaining = 0;
+		if (bounce < bounceCount)
+		{
+			for (int i = 0; i < ctx->geometry.targetCount; i++)
+			{
+				ctx->lightmap = ctx->geometry.targets[i]; // lm_interpolationError uses its channel count
+				remaining += lm_markConvergedTexels(ctx, ctx->geometry.targets + i, bounce > 1 ? callbacks->epsilon : 0.0f);
+				lm_keepTarget(ctx->geometry.targets + i);
+			}
+		}
+
+		if ((callbacks->bounceDone && !callbacks->bounceDone(bounce - 1, callbacks->userdata)) || bounce == bounceCount)
+			break;
+		if (!remaining)
+			break; // another bounce wouldn't change anything
+		for (int i = 0; i < ctx->geometry.targetCount; i++)
+			lm_clearTarget(ctx->geometry.targets + i);
+	}
+
+	if (ctx->cpu.enabled && bounce > 1)
+		lmSetBounceLightmap(ctx, NULL, 0, 0, 0); // don't keep a pointer to the freed previous bounce
+	for (int i = 0; i < ctx->geometry.targetCount; i++)
+	{
+		lm_targetLightmap *target = ctx->geometry.targets + i;
+		LM_FREE(target->previous);
+		LM_FREE(target->converged);
+		target->previous = NULL;
+		target->converged = NULL;
+	}
+	ctx->geometry.current = -1;
+	ctx->meshPosition.replay.plan = ownPlan ? NULL : plan;
+	lmDestroySamplePlan(ownPlan);
+	return bounce;
+}
+
+void lmSetDirtyRegions(lm_context *ctx, const float *boundsMinMax6, int count)
+{
+	assert(boundsMinMax6 && count > 0);
+	assert(ctx->meshPosition.pass == 0 && ctx->meshPosition.triangle.baseIndex < ctx->mesh.count); // call after lmSetGeometry/lmAddGeometry
+	assert(!lm_hasTiledTarget(ctx)); // tiled targets are not supported
+	if (lm_hasTiledTarget(ctx))
+	{
+		fprintf(stderr, "lmSetDirtyRegions doesn't support tiled target lightmaps!\n");
+		return;
+	}
+	if (ctx->dirty.bounds)
+		LM_FREE(ctx->dirty.bounds);
+	ctx->dirty.bounds = (lm_vec3*)LM_CALLOC(count * 2, sizeof(lm_vec3));
+	for (int i = 0; i < count * 2; i++)
+		ctx->dirty.bounds[i] = lm_v3(boundsMinMax6[i * 3 + 0], boundsMinMax6[i * 3 + 1], boundsMinMax6[i * 3 + 2]);
+	ctx->dirty.count = count;
+
+	// the targets are baked again from scratch, while the context keeps their previous values for the texels that don't change
+	for (int i = 0; i < ctx->geometry.targetCount; i++)
+	{
+		lm_targetLightmap *target = ctx->geometry.targets + i;
+		if (!target->previous)
+		{
+			target->previous = (float*)LM_CALLOC(lm_targetSize(target), 1);
+			target->converged = (unsigned char*)LM_CALLOC((target->width * target->height + 7) / 8, 1);
+		}
+		for (int j = 0; j < (target->width * target->height + 7) / 8; j++)
+			target->converged[j] = target->coverage[j]; // only the texels with a valid previous value can keep it
+		lm_restartTarget(target);
+	}
+	ctx->geometry.current = -1; // reload the target with its previous values
+	ctx->meshPosition.pass = 0;
+	lm_setMeshPosition(ctx, 0);
+}
+
+// 64 bit FNV-1a
+static unsigned long long lm_hash(unsigned long long hash, const void *data, size_t size)
+{
+	const unsigned char *bytes = (const unsigned char*)data;
+	for (size_t i = 0; i < size; i++)
+		hash = (hash ^ bytes[i]) * 1099511628211ull;
+	return hash;
+}
+
+static unsigned long long lm_cacheKey(lm_context *ctx, unsigned long long sceneHash)
+{
+	unsigned long long hash = lm_hash(14695981039346656037ull, "lm_cache 1", 10); // change the version when the bake results change
+	hash = lm_hash(hash, &sceneHash, sizeof(sceneHash));
+
+	// settings
+	int settings[] = {
+		(int)ctx->hemisphere.size, (int)ctx->hemisphere.projection, ctx->meshPosition.passCount, (int)ctx->interpolationError,
+		ctx->cpu.enabled, ctx->hemisphere.halfFloat, ctx->hemisphere.ambientOcclusion, ctx->hemisphere.directional,
+		(int)ctx->hemisphere.fbHemiCountX, (int)ctx->hemisphere.fbHemiCountY, (int)ctx->hemisphere.transfer.count };
+	float values[] = {
+		ctx->hemisphere.zNear, ctx->hemisphere.zFar,
+		ctx->hemisphere.clearColor.r, ctx->hemisphere.clearColor.g, ctx->hemisphere.clearColor.b,
+		ctx->interpolationThreshold, ctx->refinementThreshold };
+	hash = lm_hash(hash, settings, sizeof(settings));
+	hash = lm_hash(hash, values, sizeof(values));
+	for (int i = 0; i <= 64; i++)
+	{ // the weight function output
+		float weight = ctx->hemisphere.weightFunc((float)i / 64.0f, ctx->hemisphere.weightUserdata);
+		hash = lm_hash(hash, &weight, sizeof(weight));
+	}
+
+	// target formats and geometry
+	for (int i = 0; i < ctx->geometry.targetCount; i++)
+	{
+		const lm_targetLightmap *target = ctx->geometry.targets + i;
+		int format[] = { target->width, target->height, target->channels, target->tiled, target->directions != NULL, target->ownsCoverage }; // values are kept above 0 with internal coverage
+		hash = lm_hash(hash, format, sizeof(format));
+	}
+	for (int i = 0; i < ctx->geometry.geometryCount; i++)
+	{
+		int geometry[] = { (int)ctx->geometry.geometries[i].first, ctx->geometry.geometries[i].target };
+		hash = lm_hash(hash, geometry, sizeof(geometry));
+	}
+	hash = lm_hash(hash, ctx->mesh.positions, ctx->mesh.count * sizeof(lm_vec3));
+	hash = lm_hash(hash, ctx->mesh.uvs, ctx->mesh.count * sizeof(lm_vec2));
+	lm_bool replay = ctx->meshPosition.replay.plan != NULL; // recorded instead of random hemisphere rotations
+	hash = lm_hash(hash, &replay, sizeof(replay));
+
+	// ray traced scene
+	if (ctx->cpu.albedo)
+		hash = lm_hash(hash, ctx->cpu.albedo, ctx->mesh.count * sizeof(lm_vec3));
+	if (ctx->cpu.emission)
+		hash = lm_hash(hash, ctx->cpu.emission, ctx->mesh.count * sizeof(lm_vec3));
+	if (ctx->cpu.bounce.data)
+		hash = lm_hash(hash, ctx->cpu.bounce.data, (size_t)ctx->cpu.bounce.width * ctx->cpu.bounce.height * ctx->cpu.bounce.channels * sizeof(float));
+	return hash;
+}
+
+// cache file: "LMC1", key, then the lightmap, coverage and directions (if set) of every target
+static void lm_cachePath(char *path, size_t size, const char *directory, unsigned long long key)
+{
+	snprintf(path, size, "%s/%016llx.lmc", directory, key);
+}
+
+// bakes that start from texels that are already covered (lmSetDirtyRegions or previous values) depend on their values, which are not hashed
+static lm_bool lm_cacheable(lm_context *ctx)
+{
+	for (int i = 0; i < ctx->geometry.targetCount; i++)
+	{
+		if (ctx->geometry.targets[i].prefilled || ctx->geometry.targets[i].previous)
+			return LM_FALSE;
+	}
+	return LM_TRUE;
+}
+
+static size_t lm_cacheFileSize(lm_context *ctx)
+{
+	size_t size = 4 + sizeof(unsigned long long);
+	for (int i = 0; i < ctx->geometry.targetCount; i++)
+	{
+		const lm_targetLightmap *target = ctx->geometry.targets + i;
+		size += lm_targetSize(target) + lmCoverageSize(target->width, target->height);
+		if (target->directions)
+			size += (size_t)target->width * target->height * 9 * sizeof(float);
+	}
+	return size;
+}
+
+// 64 bit file size (ftell returns a 32 bit long on windows) or -1
+static long long lm_fileSize(const char *path)
+{
+#if defined(_WIN32)
+	WIN32_FILE_ATTRIBUTE_DATA attributes;
+	if (!GetFileAttributesExA(path, GetFileExInfoStandard, &attributes))
+		return -1;
+	return (long long)(((unsigned long long)attributes.nFileSizeHigh << 32) | attributes.nFileSizeLow);
+#else
+	int file = open(path, O_RDONLY);
+	if (file < 0)
+		return -1;
+	off_t size = lseek(file, 0, SEEK_END);
+	close(file);
+	return (long long)size;
+#endif
+}
 
-					// lightmap texel statistics
-					int rendered = 0, interpolated = 0, wasted = 0;
-					for (int y = 0; y < ctx->lightmap.height; y++)
+lm_bool lmCacheLoad(lm_context *ctx, const char *directory, unsigned long long sceneHash)
+{
+	assert(ctx->geometry.targetCount > 0); // set the geometry first
+	if (!lm_cacheable(ctx))
+	{
+		ctx->stats.cacheMisses++;
+		return LM_FALSE;
+	}
+	unsigned long long key = lm_cacheKey(ctx, sceneHash);
+	char path[1024];
+	lm_cachePath(path, sizeof(path), directory, key);
+	FILE *file = fopen(path, "rb");
+	if (!file)
+	{
+		ctx->stats.cacheMisses++;
+		return LM_FALSE;
+	}
+
+	// only read complete files with the same key into the targets
+	char magic[4];
+	unsigned long long fileKey = 0;
+	long long fileSize = lm_fileSize(path);
+	lm_bool ok =
+		fileSize >= 0 && (unsigned long long)fileSize == (unsigned long long)lm_cacheFileSize(ctx) &&
+		fread(magic, 4, 1, file) == 1 && magic[0] == 'L' && magic[1] == 'M' && magic[2] == 'C' && magic[3] == '1' &&
+		fread(&fileKey, sizeof(fileKey), 1, file) == 1 && fileKey == key;
+	for (int i = 0; ok && i < ctx->geometry.targetCount; i++)
+	{
+		const lm_targetLightmap *target = ctx->geometry.targets + i;
+		ok = fread(target->data, lm_targetSize(target), 1, file) == 1 &&
+		     fread(target->coverage, lmCoverageSize(target->width, target->height), 1, file) == 1 &&
+		     (!target->directions || fread(target->directions, (size_t)target->width * target->height * 9 * sizeof(float), 1, file) == 1);
+	}
+	fclose(file);
+	if (!ok)
+		fprintf(stderr, "Ignoring the invalid bake cache file %s!\n", path);
+	if (ok)
+		ctx->stats.cacheHits++;
+	else
+		ctx->stats.cacheMisses++;
+	return ok;
+}
+
+lm_bool lmCacheStore(lm_context *ctx, const char *directory, unsigned long long sceneHash)
+{
+	assert(ctx->geometry.targetCount > 0); // call before the next lmSetGeometry
+	if (!lm_cacheable(ctx))
+		return LM_FALSE;
+	unsigned long long key = lm_cacheKey(ctx, sceneHash);
+	char path[1024], temporaryPath[sizeof(path) + 4];
+	lm_cachePath(path, sizeof(path), directory, key);
+	snprintf(temporaryPath, sizeof(temporaryPath), "%s.tmp", path);
+
+	// write a temporary file and rename it, so that lmCacheLoad never sees a partial file under the key
+	FILE *file = fopen(temporaryPath, "wb");
+	if (!file)
+	{
+		fprintf(stderr, "Could not create the bake cache file %s!\n", temporaryPath);
+		return LM_FALSE;
+	}
+	lm_bool ok = fwrite("LMC1", 4, 1, file) == 1 && fwrite(&key, sizeof(key), 1, file) == 1;
+	for (int i = 0; ok && i < ctx->geometry.targetCount; i++)
+	{
+		const lm_targetLightmap *target = ctx->geometry.targets + i;
+		ok = fwrite(target->data, lm_targetSize(target), 1, file) == 1 &&
+		     fwrite(target->coverage, lmCoverageSize(target->width, target->height), 1, file) == 1 &&
+		     (!target->directions || fwrite(target->directions, (size_t)target->width * target->height * 9 * sizeof(float), 1, file) == 1);
+	}
+	ok = fclose(file) == 0 && ok;
+#if defined(_WIN32)
+	if (ok)
+		remove(path); // rename doesn't replace existing files
+#endif
+	if (!ok || rename(temporaryPath, path) != 0)
+	{
+		fprintf(stderr, "Could not write the bake cache file %s!\n", path);
+		remove(temporaryPath);
+		return LM_FALSE;
+	}
+	return LM_TRUE;
+}
+
+double lmTransferStallTime(lm_context *ctx)
+{
+	return ctx->hemisphere.transfer.stallTime;
+}
+
+void lmGetStats(lm_context *ctx, lm_stats *outStats)
+{
+	lm_stats stats;
+	memset(&stats, 0, sizeof(stats));
+	stats.passCount = ctx->meshPosition.passCount;
+	for (int i = 0; i < ctx->meshPosition.passCount; i++)
+	{
+		stats.rendered[i] = ctx->stats.rendered[i];
+		stats.interpolated[i] = ctx->stats.interpolated[i];
+	}
+	unsigned int rendered = 0, interpolated = 0;
+	for (int i = 0; i < ctx->meshPosition.passCount; i++)
+	{
+		rendered += stats.rendered[i];
+		interpolated += stats.interpolated[i];
+	}
+	stats.renderedRatio = rendered + interpolated ? (float)rendered / (float)(rendered + interpolated) : 0.0f;
+	stats.batches = ctx->stats.batches;
+	stats.rasterizationTime = ctx->stats.rasterizationTime;
+	stats.gpuTime = ctx->stats.gpuTime;
+	stats.transferStallTime = ctx->hemisphere.transfer.stallTime;
+	stats.cacheHits = ctx->stats.cacheHits;
+	stats.cacheMisses = ctx->stats.cacheMisses;
+
+	stats.remainingTime = -1.0;
+	if (ctx->stats.geometryStartTime)
+	{
+		stats.elapsedTime = lm_time() - ctx->stats.geometryStartTime;
+		// lmProgress starts over after the last pass
+		float progress = ctx->meshPosition.triangle.baseIndex < ctx->mesh.count ? lmProgress(ctx) : 1.0f;
+		if (progress > 0.0f)
+			stats.remainingTime = stats.elapsedTime * (1.0 - progress) / progress;
+	}
+	*outStats = stats;
+}
+
+// image processing kernels. rows are processed in parallel and each kernel is instantiated for c = 1..4,
+// so that the channel loops get unrolled. with SSE2, 4 pixels (c vectors) or one RGBA pixel are processed at once.
+// the results are bitwise identical to the plain scalar loops (min/max: apart from ties between -0 and +0).
+typedef struct
+{
+	const float *image;
+	float *outImage;
+	int w, h, c, m;
+	float value;     // add/scale/power argument
+	float *partials; // min/max result of each row
+} lm_imageJob;
+
+#define LM_IMAGE_KERNEL(kernel) \
+	static void kernel##1(void *job, int begin, int end) { kernel((lm_imageJob*)job, begin, end, 1); } \
+	static void kernel##2(void *job, int begin, int end) { kernel((lm_imageJob*)job, begin, end, 2); } \
+	static void kernel##3(void *job, int begin, int end) { kernel((lm_imageJob*)job, begin, end, 3); } \
+	static void kernel##4(void *job, int begin, int end) { kernel((lm_imageJob*)job, begin, end, 4); } \
+	static void kernel##N(void *job, int begin, int end) { kernel((lm_imageJob*)job, begin, end, ((lm_imageJob*)job)->c); } \
+	static const lm_parallel_func kernel##Funcs[5] = { kernel##N, kernel##1, kernel##2, kernel##3, kernel##4 };
+
+static void lm_imageRun(const lm_parallel_func *funcs, lm_imageJob *job, int rows)
+{
+	int grain = lm_maxi(65536 / lm_maxi(job->w * job->c, 1), 1); // about 256kb per chunk
+	lm_parallelFor(rows, grain, funcs[job->c <= 4 ? job->c : 0], job);
+}
+
+#ifdef LM_SSE2
+static inline __m128 lm_select(__m128 mask, __m128 a, __m128 b) { return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b)); }
+
+// masks[k] selects the lanes of the k-th vector of a 4 pixel group that belong to a channel in m
+static LM_FORCE_INLINE void lm_channelMasks(__m128 *masks, const int c, int m)
+{
+	for (int k = 0; k < c; k++)
+	{
+		int lanes[4];
+		for (int l = 0; l < 4; l++)
+			lanes[l] = (m & (1 << ((4 * k + l) % c))) ? -1 : 0;
+		masks[k] = _mm_castsi128_ps(_mm_setr_epi32(lanes[0], lanes[1], lanes[2], lanes[3]));
+	}
+}
+
+// loads/stores the c channels of one pixel. the lanes >= c are zero, so they never count as populated.
+static LM_FORCE_INLINE __m128 lm_loadPixel(const float *p, const int c)
+{
+	switch (c)
+	{
+		case 1: return _mm_load_ss(p);
+		case 2: return _mm_castpd_ps(_mm_load_sd((const double*)p));
+		case 3: return _mm_movelh_ps(_mm_castpd_ps(_mm_load_sd((const double*)p)), _mm_load_ss(p + 2));
+		default: return _mm_loadu_ps(p);
+	}
+}
+
+static LM_FORCE_INLINE void lm_storePixel(float *p, __m128 v, const int c)
+{
+	switch (c)
+	{
+		case 1: _mm_store_ss(p, v); break;
+		case 2: _mm_store_sd((double*)p, _mm_castps_pd(v)); break;
+		case 3: _mm_store_sd((double*)p, _mm_castps_pd(v)); _mm_store_ss(p + 2, _mm_movehl_ps(v, v)); break;
+		default: _mm_storeu_ps(p, v); break;
+	}
+}
+#endif
+
+static LM_FORCE_INLINE void lm_imageAddRows(lm_imageJob *job, int begin, int end, const int c)
+{
+	float *p = job->outImage + begin * job->w * c;
+	int n = (end - begin) * job->w, i = 0;
+#ifdef LM_SSE2
+	__m128 masks[4], value = _mm_set1_ps(job->value);
+	if (c <= 4)
+		lm_channelMasks(masks, c, job->m);
+	for (; c <= 4 && i + 4 <= n; i += 4, p += 4 * c)
+		for (int k = 0; k < c; k++)
+		{
+			__m128 v = _mm_loadu_ps(p + 4 * k);
+			_mm_storeu_ps(p + 4 * k, lm_select(masks[k], _mm_add_ps(v, value), v));
+		}
+#endif
+	for (; i < n; i++, p += c)
+		for (int j = 0; j < c; j++)
+			if (job->m & (1 << j))
+				p[j] += job->value;
+}
+LM_IMAGE_KERNEL(lm_imageAddRows)
+
+static LM_FORCE_INLINE void lm_imageScaleRows(lm_imageJob *job, int begin, int end, const int c)
+{
+	float *p = job->outImage + begin * job->w * c;
+	int n = (end - begin) * job->w, i = 0;
+#ifdef LM_SSE2
+	__m128 masks[4], value = _mm_set1_ps(job->value);
+	if (c <= 4)
+		lm_channelMasks(masks, c, job->m);
+	for (; c <= 4 && i + 4 <= n; i += 4, p += 4 * c)
+		for (int k = 0; k < c; k++)
+		{
+			__m128 v = _mm_loadu_ps(p + 4 * k);
+			_mm_storeu_ps(p + 4 * k, lm_select(masks[k], _mm_mul_ps(v, value), v));
+		}
+#endif
+	for (; i < n; i++, p += c)
+		for (int j = 0; j < c; j++)
+			if (job->m & (1 << j))
+				p[j] *= job->value;
+}
+LM_IMAGE_KERNEL(lm_imageScaleRows)
+
+static LM_FORCE_INLINE void lm_imagePowerRows(lm_imageJob *job, int begin, int end, const int c)
+{
+	// there is no bitwise identical vectorized powf. at least the mask test is hoisted out of the loop.
+	float *p = job->outImage + begin * job->w * c;
+	int n = (end - begin) * job->w;
+	for (int j = 0; j < c; j++)
+		if (job->m & (1 << j))
+			for (int i = 0; i < n; i++)
+				p[i * c + j] = powf(p[i * c + j], job->value);
+}
+LM_IMAGE_KERNEL(lm_imagePowerRows)
+
+static LM_FORCE_INLINE void lm_imageMinRows(lm_imageJob *job, int begin, int end, const int c)
+{
+	for (int y = begin; y < end; y++)
+	{
+		const float *p = job->image + y * job->w * c;
+		int i = 0;
+		float minValue = FLT_MAX;
+#ifdef LM_SSE2
+		__m128 masks[4], acc = _mm_set1_ps(FLT_MAX), neutral = _mm_set1_ps(FLT_MAX);
+		if (c <= 4)
+			lm_channelMasks(masks, c, job->m);
+		for (; c <= 4 && i + 4 <= job->w; i += 4, p += 4 * c)
+			for (int k = 0; k < c; k++)
+				acc = _mm_min_ps(acc, lm_select(masks[k], _mm_loadu_ps(p + 4 * k), neutral));
+		float lanes[4];
+		_mm_storeu_ps(lanes, acc);
+		for (int l = 0; l < 4; l++)
+			minValue = lm_minf(minValue, lanes[l]);
+#endif
+		for (; i < job->w; i++, p += c)
+			for (int j = 0; j < c; j++)
+				if (job->m & (1 << j))
+					minValue = lm_minf(minValue, p[j]);
+		job->partials[y] = minValue;
+	}
+}
+LM_IMAGE_KERNEL(lm_imageMinRows)
+
+static LM_FORCE_INLINE void lm_imageMaxRows(lm_imageJob *job, int begin, int end, const int c)
+{
+	for (int y = begin; y < end; y++)
+	{
+		const float *p = job->image + y * job->w * c;
+		int i = 0;
+		float maxValue = 0.0f;
+#ifdef LM_SSE2
+		__m128 masks[4], acc = _mm_setzero_ps(), neutral = _mm_setzero_ps();
+		if (c <= 4)
+			lm_channelMasks(masks, c, job->m);
+		for (; c <= 4 && i + 4 <= job->w; i += 4, p += 4 * c)
+			for (int k = 0; k < c; k++)
+				acc = _mm_max_ps(acc, lm_select(masks[k], _mm_loadu_ps(p + 4 * k), neutral));
+		float lanes[4];
+		_mm_storeu_ps(lanes, acc);
+		for (int l = 0; l < 4; l++)
+			maxValue = lm_maxf(maxValue, lanes[l]);
+#endif
+		for (; i < job->w; i++, p += c)
+			for (int j = 0; j < c; j++)
+				if (job->m & (1 << j))
+					maxValue = lm_maxf(maxValue, p[j]);
+		job->partials[y] = maxValue;
+	}
+}
+LM_IMAGE_KERNEL(lm_imageMaxRows)
+
+static LM_FORCE_INLINE void lm_imageDilateRows(lm_imageJob *job, int begin, int end, const int c)
+{
+	const float *image = job->image;
+	int w = job->w, h = job->h;
+	const int dx[] = { -1, 0, 1,  0 };
+	const int dy[] = {  0, 1, 0, -1 };
+	for (int y = begin; y < end; y++)
+	{
+		for (int x = 0; x < w; x++)
+		{
+#ifdef LM_SSE2
+			__m128 zero = _mm_setzero_ps();
+			__m128 color = lm_loadPixel(image + (y * w + x) * c, c);
+			if (!_mm_movemask_ps(_mm_cmpgt_ps(color, zero)))
+			{
+				int n = 0;
+				for (int d = 0; d < 4; d++)
+				{
+					int cx = x + dx[d];
+					int cy = y + dy[d];
+					if (cx >= 0 && cx < w && cy >= 0 && cy < h)
+					{
+						__m128 dcolor = lm_loadPixel(image + (cy * w + cx) * c, c);
+						if (_mm_movemask_ps(_mm_cmpgt_ps(dcolor, zero)))
+						{
+							color = _mm_add_ps(color, dcolor);
+							n++;
+						}
+					}
+				}
+				if (n)
+					color = _mm_mul_ps(color, _mm_set1_ps(1.0f / n));
+			}
+			lm_storePixel(job->outImage + (y * w + x) * c, color, c);
+#else
+			float color[4];
+			lm_bool valid = LM_FALSE;
+			for (int i = 0; i < c; i++)
+			{
+				color[i] = image[(y * w + x) * c + i];
+				valid |= color[i] > 0.0f;
+			}
+			if (!valid)
+			{
+				int n = 0;
+				for (int d = 0; d < 4; d++)
+				{
+					int cx = x + dx[d];
+					int cy = y + dy[d];
+					if (cx >= 0 && cx < w && cy >= 0 && cy < h)
+					{
+						float dcolor[4];
+						lm_bool dvalid = LM_FALSE;
+						for (int i = 0; i < c; i++)
+						{
+							dcolor[i] = image[(cy * w + cx) * c + i];
+							dvalid |= dcolor[i] > 0.0f;
+						}
+						if (dvalid)
+						{
+							for (int i = 0; i < c; i++)
+								color[i] += dcolor[i];
+							n++;
+						}
+					}
+				}
+				if (n)
+				{
+					float in = 1.0f / n;
+					for (int i = 0; i < c; i++)
+						color[i] *= in;
+				}
+			}
+			for (int i = 0; i < c; i++)
+				job->outImage[(y * w + x) * c + i] = color[i];
+#endif
+		}
+	}
+}
+LM_IMAGE_KERNEL(lm_imageDilateRows)
+
+static LM_FORCE_INLINE void lm_imageSmoothRows(lm_imageJob *job, int begin, int end, const int c)
+{
+	const float *image = job->image;
+	int w = job->w, h = job->h;
+	for (int y = begin; y < end; y++)
+	{
+		for (int x = 0; x < w; x++)
+		{
+#ifdef LM_SSE2
+			__m128 zero = _mm_setzero_ps();
+			__m128 color = zero;
+			int n = 0;
+			for (int cy = y - 1; cy <= y + 1; cy++)
+			{
+				for (int cx = x - 1; cx <= x + 1; cx++)
+				{
+					if (cx >= 0 && cx < w && cy >= 0 && cy < h)
+					{
+						__m128 v = lm_loadPixel(image + (cy * w + cx) * c, c);
+						if (_mm_movemask_ps(_mm_cmpgt_ps(v, zero)))
+						{
+							color = _mm_add_ps(color, v);
+							n++;
+						}
+					}
+				}
+			}
+			lm_storePixel(job->outImage + (y * w + x) * c, n ? _mm_div_ps(color, _mm_set1_ps((float)n)) : zero, c);
+#else
+			float color[4] = {0};
+			int n = 0;
+			for (int dy = -1; dy <= 1; dy++)
+			{
+				int cy = y + dy;
+				for (int dx = -1; dx <= 1; dx++)
+				{
+					int cx = x + dx;
+					if (cx >= 0 && cx < w && cy >= 0 && cy < h)
+					{
+						lm_bool valid = LM_FALSE;
+						for (int i = 0; i < c; i++)
+							valid |= image[(cy * w + cx) * c + i] > 0.0f;
+						if (valid)
+						{
+							for (int i = 0; i < c; i++)
+								color[i] += image[(cy * w + cx) * c + i];
+							n++;
+						}
+					}
+				}
+			}
+			for (int i = 0; i < c; i++)
+				job->outImage[(y * w + x) * c + i] = n ? color[i] / n : 0.0f;
+#endif
+		}
+	}
+}
+LM_IMAGE_KERNEL(lm_imageSmoothRows)
+
+static LM_FORCE_INLINE void lm_imageDownsampleRows(lm_imageJob *job, int begin, int end, const int c)
+{
+	const float *image = job->image;
+	int w = job->w;
+	for (int y = begin; y < end; y++)
+	{
+		for (int x = 0; x < w / 2; x++)
+		{
+			int p0 = 2 * (y * w + x) * c;
+			int p1 = p0 + w * c;
+			int p = (y * w / 2 + x) * c;
+#ifdef LM_SSE2
+			__m128 zero = _mm_setzero_ps();
+			__m128 v00 = lm_loadPixel(image + p0, c), v01 = lm_loadPixel(image + p0 + c, c);
+			__m128 v10 = lm_loadPixel(image + p1, c), v11 = lm_loadPixel(image + p1 + c, c);
+			int n = (_mm_movemask_ps(_mm_cmpneq_ps(v00, zero)) ? 1 : 0) + (_mm_movemask_ps(_mm_cmpneq_ps(v01, zero)) ? 1 : 0) +
+			        (_mm_movemask_ps(_mm_cmpneq_ps(v10, zero)) ? 1 : 0) + (_mm_movemask_ps(_mm_cmpneq_ps(v11, zero)) ? 1 : 0);
+			__m128 sums = _mm_add_ps(zero, _mm_add_ps(_mm_add_ps(_mm_add_ps(v00, v01), v10), v11));
+			lm_storePixel(job->outImage + p, n ? _mm_div_ps(sums, _mm_set1_ps((float)n)) : zero, c);
+#else
+			int valid[2][2] = {{0}};
+			float sums[4] = {0};
+			for (int i = 0; i < c; i++)
+			{
+				valid[0][0] |= image[p0     + i] != 0.0f ? 1 : 0;
+				valid[0][1] |= image[p0 + c + i] != 0.0f ? 1 : 0;
+				valid[1][0] |= image[p1     + i] != 0.0f ? 1 : 0;
+				valid[1][1] |= image[p1 + c + i] != 0.0f ? 1 : 0;
+				sums[i] += image[p0 + i] + image[p0 + c + i] + image[p1 + i] + image[p1 + c + i];
+			}
+			int n = valid[0][0] + valid[0][1] + valid[1][0] + valid[1][1];
+			for (int i = 0; i < c; i++)
+				job->outImage[p + i] = n ? sums[i] / n : 0.0f;
+#endif
+		}
+	}
+}
+LM_IMAGE_KERNEL(lm_imageDownsampleRows)
+
+float lmImageMin(const float *image, int w, int h, int c, int m)
+{
+	assert(c > 0 && m);
+	lm_imageJob job = { image, NULL, w, h, c, m, 0.0f, (float*)LM_CALLOC(lm_maxi(h, 1), sizeof(float)) };
+	lm_imageRun(lm_imageMinRowsFuncs, &job, h);
+	float minValue = FLT_MAX;
+	for (int y = 0; y < h; y++)
+		minValue = lm_minf(minValue, job.partials[y]);
+	LM_FREE(job.partials);
+	return minValue;
+}
+
+float lmImageMax(const float *image, int w, int h, int c, int m)
+{
+	assert(c > 0 && m);
+	lm_imageJob job = { image, NULL, w, h, c, m, 0.0f, (float*)LM_CALLOC(lm_maxi(h, 1), sizeof(float)) };
+	lm_imageRun(lm_imageMaxRowsFuncs, &job, h);
+	float maxValue = 0.0f;
+	for (int y = 0; y < h; y++)
+		maxValue = lm_maxf(maxValue, job.partials[y]);
+	LM_FREE(job.partials);
+	return maxValue;
+}
+
+void lmImageAdd(float *image, int w, int h, int c, float value, int m)
+{
+	assert(c > 0 && m);
+	lm_imageJob job = { NULL, image, w, h, c, m, value, NULL };
+	lm_imageRun(lm_imageAddRowsFuncs, &job, h);
+}
+
+void lmImageScale(float *image, int w, int h, int c, float factor, int m)
+{
+	assert(c > 0 && m);
+	lm_imageJob job = { NULL, image, w, h, c, m, factor, NULL };
+	lm_imageRun(lm_imageScaleRowsFuncs, &job, h);
+}
+
+void lmImagePower(float *image, int w, int h, int c, float exponent, int m)
+{
+	assert(c > 0 && m);
+	lm_imageJob job = { NULL, image, w, h, c, m, exponent, NULL };
+	lm_imageRun(lm_imagePowerRowsFuncs, &job, h);
+}
+
+void lmImageDilate(const float *image, float *outImage, int w, int h, int c)
+{
+	assert(c > 0 && c <= 4);
+	lm_imageJob job = { image, outImage, w, h, c, LM_ALL_CHANNELS, 0.0f, NULL };
+	lm_imageRun(lm_imageDilateRowsFuncs, &job, h);
+}
+
+void lmImageSmooth(const float *image, float *outImage, int w, int h, int c)
+{
+	assert(c > 0 && c <= 4);
+	lm_imageJob job = { image, outImage, w, h, c, LM_ALL_CHANNELS, 0.0f, NULL };
+	lm_imageRun(lm_imageSmoothRowsFuncs, &job, h);
+}
+
+void lmImageDownsample(const float *image, float *outImage, int w, int h, int c)
+{
+	assert(c > 0 && c <= 4);
+	lm_imageJob job = { image, outImage, w, h, c, LM_ALL_CHANNELS, 0.0f, NULL };
+	lm_imageRun(lm_imageDownsampleRowsFuncs, &job, h / 2);
+}
+
+typedef struct
+{
+	float *image;
+	const int *seeds; // nearest populated pixel for each pixel as (y << 16 | x) or -1
+	int *outSeeds;
+	int w, h, c;
+	int step;
+	int maxDistanceSq;
+} lm_padJob;
+
+static void lm_padInitRows(void *userdata, int begin, int end)
+{
+	lm_padJob *job = (lm_padJob*)userdata;
+	for (int i = begin * job->w; i < end * job->w; i++)
+	{
+		lm_bool valid = LM_FALSE;
+		for (int j = 0; j < job->c; j++)
+			valid |= job->image[i * job->c + j] > 0.0f;
+		job->outSeeds[i] = valid ? ((i / job->w) << 16 | (i % job->w)) : -1;
+	}
+}
+
+static void lm_padJumpFloodRows(void *userdata, int begin, int end)
+{
+	lm_padJob *job = (lm_padJob*)userdata;
+	int w = job->w, h = job->h, k = job->step;
+	for (int y = begin; y < end; y++)
+	{
+		for (int x = 0; x < w; x++)
+		{
+			int best = job->seeds[y * w + x];
+			int bestDistanceSq = INT_MAX;
+			if (best >= 0)
+			{
+				int sx = (best & 0xffff) - x, sy = (best >> 16) - y;
+				bestDistanceSq = sx * sx + sy * sy;
+			}
+			for (int dy = -k; dy <= k; dy += k)
+			{
+				int cy = y + dy;
+				if (cy < 0 || cy >= h)
+					continue;
+				for (int dx = -k; dx <= k; dx += k)
+				{
+					int cx = x + dx;
+					if (cx < 0 || cx >= w)
+						continue;
+					int seed = job->seeds[cy * w + cx];
+					if (seed < 0)
+						continue;
+					int sx = (seed & 0xffff) - x, sy = (seed >> 16) - y;
+					int distanceSq = sx * sx + sy * sy;
+					if (distanceSq < bestDistanceSq)
 					{
-						for (int x = 0; x < ctx->lightmap.width; x++)
-						{
-							if (ctx->lightmap.debug[(y * ctx->lightmap.width + x) * 3 + 0])
-								rendered++;
-							else if (ctx->lightmap.debug[(y * ctx->lightmap.width + x) * 3 + 1])
-								interpolated++;
-							else
-								wasted++;
-						}
+						best = seed;
+						bestDistanceSq = distanceSq;
 					}
-					int used = rendered + interpolated;
-					int total = used + wasted;
-					printf("\n#######################################################################\n");
-					printf("%10d %6.2f%% rendered hemicubes integrated to lightmap texels.\n", rendered, 100.0f * (float)rendered / (float)total);
-					printf("%10d %6.2f%% interpolated lightmap texels.\n", interpolated, 100.0f * (float)interpolated / (float)total);
-					printf("%10d %6.2f%% wasted lightmap texels.\n", wasted, 100.0f * (float)wasted / (float)total);
-					printf("\n%17.2f%% of used texels were rendered.\n", 100.0f * (float)rendered / (float)used);
-					printf("#######################################################################\n");
-#endif
-
-					return LM_FALSE;
 				}
-
-				lm_setMeshPosition(ctx, 0); // start over with the next pass
 			}
+			job->outSeeds[y * w + x] = best;
 		}
 	}
-	return LM_TRUE;
 }
 
-float lmProgress(lm_context *ctx)
+static void lm_padFillRows(void *userdata, int begin, int end)
 {
-	float passProgress = (float)ctx->meshPosition.triangle.baseIndex / (float)ctx->mesh.count;
-	return ((float)ctx->meshPosition.pass + passProgress) / (float)ctx->meshPosition.passCount;
+	lm_padJob *job = (lm_padJob*)userdata;
+	for (int y = begin; y < end; y++)
+	{
+		for (int x = 0; x < job->w; x++)
+		{
+			int seed = job->seeds[y * job->w + x];
+			if (seed < 0)
+				continue;
+			int sx = (seed & 0xffff) - x, sy = (seed >> 16) - y;
+			int distanceSq = sx * sx + sy * sy;
+			if (distanceSq == 0 || distanceSq > job->maxDistanceSq) // only empty pixels point to another pixel. so seeds are never written.
+				continue;
+			int i = y * job->w + x, s = (seed >> 16) * job->w + (seed & 0xffff);
+			for (int j = 0; j < job->c; j++)
+				job->image[i * job->c + j] = job->image[s * job->c + j];
+		}
+	}
 }
 
-void lmEnd(lm_context *ctx)
+void lmImagePadCharts(float *image, int w, int h, int c, int maxDistance)
 {
-	lm_endSampleHemisphere(ctx);
+	assert(c > 0 && c <= 4 && maxDistance >= 0 && w <= 0x8000 && h <= 0x8000);
+	if (!maxDistance)
+		return;
+
+	// jump flooding: propagate the nearest populated pixel with step sizes from maxDistance/2 down to 1
+	int *seeds[2];
+	seeds[0] = (int*)LM_CALLOC(w * h, sizeof(int));
+	seeds[1] = (int*)LM_CALLOC(w * h, sizeof(int));
+	int grain = lm_maxi(16384 / w, 1);
+
+	lm_padJob job = { image, NULL, seeds[0], w, h, c, 0, maxDistance * maxDistance };
+	lm_parallelFor(h, grain, lm_padInitRows, &job);
+
+	int steps[32], stepCount = 0;
+	int step = 1;
+	while (step * 2 <= maxDistance)
+		step *= 2;
+	for (; step > 0; step /= 2)
+		steps[stepCount++] = step;
+	steps[stepCount++] = 1; // one more pass with step 1 fixes most of the remaining jump flooding errors
+
+	int current = 0;
+	for (int i = 0; i < stepCount; i++)
+	{
+		job.seeds = seeds[current];
+		job.outSeeds = seeds[1 - current];
+		job.step = steps[i];
+		lm_parallelFor(h, grain, lm_padJumpFloodRows, &job);
+		current = 1 - current;
+	}
+
+	job.seeds = seeds[current];
+	lm_parallelFor(h, grain, lm_padFillRows, &job);
+
+	LM_FREE(seeds[0]);
+	LM_FREE(seeds[1]);
 }
 
-// these are not performance tuned since their impact on the whole lightmapping duration is insignificant
-float lmImageMin(const float *image, int w, int h, int c, int m)
+void lmImageApplyCoverage(float *image, int w, int h, int c, const unsigned char *coverage)
 {
-	assert(c > 0 && m);
-	float minValue = FLT_MAX;
+	assert(c > 0 && coverage);
 	for (int i = 0; i < w * h; i++)
+	{
+		float *pixel = image + i * c;
+		if (!((coverage[i >> 3] >> (i & 7)) & 1))
+		{
+			for (int j = 0; j < c; j++)
+				pixel[j] = 0.0f;
+			continue;
+		}
+		lm_bool isZero = LM_TRUE;
 		for (int j = 0; j < c; j++)
-			if (m & (1 << j))
-				minValue = lm_minf(minValue, image[i * c + j]);
-	return minValue;
+			isZero &= pixel[j] == 0.0f;
+		if (isZero)
+			for (int j = 0; j < c; j++)
+				pixel[j] = FLT_MIN;
+	}
 }
 
-float lmImageMax(const float *image, int w, int h, int c, int m)
+// lightmap space g-buffer of the geometry that was baked into a target lightmap (guides lmImageDenoise)
+typedef struct
 {
-	assert(c > 0 && m);
-	float maxValue = 0.0f;
-	for (int i = 0; i < w * h; i++)
-		for (int j = 0; j < c; j++)
-			if (m & (1 << j))
-				maxValue = lm_maxf(maxValue, image[i * c + j]);
-	return maxValue;
+	lm_vec3 position;
+	lm_vec3 normal;
+	float texelSize; // world space size of a texel
+	int chart;       // uv chart of the texel or -1 if no triangle touches it
+} lm_gbufferTexel;
+
+typedef struct
+{
+	lm_vec2 uv;
+	int triangle;
+} lm_chartVertex;
+
+static int lm_compareChartVertices(const void *a, const void *b)
+{
+	const lm_chartVertex *va = (const lm_chartVertex*)a, *vb = (const lm_chartVertex*)b;
+	if (va->uv.x != vb->uv.x)
+		return va->uv.x < vb->uv.x ? -1 : 1;
+	if (va->uv.y != vb->uv.y)
+		return va->uv.y < vb->uv.y ? -1 : 1;
+	return 0;
 }
 
-void lmImageAdd(float *image, int w, int h, int c, float value, int m)
+static int lm_findChart(int *parent, int i)
 {
-	assert(c > 0 && m);
-	for (int i = 0; i < w * h; i++)
-		for (int j = 0; j < c; j++)
-			if (m & (1 << j))
-				image[i * c + j] += value;
+	while (parent[i] != i)
+		i = parent[i] = parent[parent[i]];
+	return i;
 }
 
-void lmImageScale(float *image, int w, int h, int c, float factor, int m)
+// triangles that share a lightmap texture coordinate belong to the same chart
+static void lm_computeCharts(lm_context *ctx, const unsigned int *triangles, int triangleCount, int *outCharts)
 {
-	assert(c > 0 && m);
-	for (int i = 0; i < w * h; i++)
-		for (int j = 0; j < c; j++)
-			if (m & (1 << j))
-				image[i * c + j] *= factor;
+	lm_chartVertex *vertices = (lm_chartVertex*)LM_CALLOC(lm_maxi(triangleCount * 3, 1), sizeof(lm_chartVertex));
+	for (int i = 0; i < triangleCount; i++)
+	{
+		outCharts[i] = i;
+		for (int j = 0; j < 3; j++)
+		{
+			vertices[i * 3 + j].uv = ctx->mesh.uvs[triangles[i] * 3 + j];
+			vertices[i * 3 + j].triangle = i;
+		}
+	}
+	qsort(vertices, triangleCount * 3, sizeof(lm_chartVertex), lm_compareChartVertices);
+	for (int i = 1; i < triangleCount * 3; i++)
+	{
+		if (lm_compareChartVertices(vertices + i - 1, vertices + i) == 0)
+		{
+			int a = lm_findChart(outCharts, vertices[i - 1].triangle);
+			int b = lm_findChart(outCharts, vertices[i].triangle);
+			outCharts[lm_maxi(a, b)] = lm_mini(a, b);
+		}
+	}
+	for (int i = 0; i < triangleCount; i++)
+		outCharts[i] = lm_findChart(outCharts, i);
+	LM_FREE(vertices);
 }
 
-void lmImagePower(float *image, int w, int h, int c, float exponent, int m)
+static lm_vec2 lm_closestPointOnSegment2(lm_vec2 a, lm_vec2 b, lm_vec2 p)
 {
-	assert(c > 0 && m);
-	for (int i = 0; i < w * h; i++)
-		for (int j = 0; j < c; j++)
-			if (m & (1 << j))
-				image[i * c + j] = powf(image[i * c + j], exponent);
+	lm_vec2 ab = lm_sub2(b, a);
+	float t = lm_dot2(lm_sub2(p, a), ab) / lm_maxf(lm_length2sq(ab), FLT_MIN);
+	return lm_add2(a, lm_scale2(ab, lm_minf(lm_maxf(t, 0.0f), 1.0f)));
 }
 
-void lmImageDilate(const float *image, float *outImage, int w, int h, int c)
+// conservatively rasterizes the triangles into the g-buffer. every texel gets the data of the nearest triangle point to its center.
+static void lm_rasterizeGBuffer(lm_context *ctx, const unsigned int *triangles, const int *charts, int triangleCount, lm_gbufferTexel *gbuffer, int w, int h)
 {
-	assert(c > 0 && c <= 4);
-	for (int y = 0; y < h; y++)
+	float *distances = (float*)LM_CALLOC(w * h, sizeof(float));
+	for (int i = 0; i < w * h; i++)
 	{
-		for (int x = 0; x < w; x++)
+		gbuffer[i].chart = -1;
+		distances[i] = 0.5f; // squared texel center to corner distance: farther triangles don't touch the texel
+	}
+
+	for (int i = 0; i < triangleCount; i++)
+	{
+		unsigned int t = triangles[i];
+		const lm_vec3 *p = ctx->mesh.positions + t * 3;
+		const lm_vec2 *uv = ctx->mesh.uvs + t * 3;
+		float uvArea = lm_absf(lm_cross2(lm_sub2(uv[1], uv[0]), lm_sub2(uv[2], uv[0])));
+		if (uvArea < 1e-8f || !lm_finite3(ctx->mesh.normals[t]))
+			continue; // degenerate
+		float texelSize = sqrtf(lm_length3(lm_cross3(lm_sub3(p[1], p[0]), lm_sub3(p[2], p[0]))) / uvArea);
+
+		for (int y = ctx->mesh.rectMin[t].y; y < ctx->mesh.rectMax[t].y; y++)
 		{
-			float color[4];
-			lm_bool valid = LM_FALSE;
-			for (int i = 0; i < c; i++)
-			{
-				color[i] = image[(y * w + x) * c + i];
-				valid |= color[i] > 0.0f;
-			}
-			if (!valid)
+			for (int x = ctx->mesh.rectMin[t].x; x < ctx->mesh.rectMax[t].x; x++)
 			{
-				int n = 0;
-				const int dx[] = { -1, 0, 1,  0 };
-				const int dy[] = {  0, 1, 0, -1 };
-				for (int d = 0; d < 4; d++)
-				{
-					int cx = x + dx[d];
-					int cy = y + dy[d];
-					if (cx >= 0 && cx < w && cy >= 0 && cy < h)
-					{
-						float dcolor[4];
-						lm_bool dvalid = LM_FALSE;
-						for (int i = 0; i < c; i++)
-						{
-							dcolor[i] = image[(cy * w + cx) * c + i];
-							dvalid |= dcolor[i] > 0.0f;
-						}
-						if (dvalid)
-						{
-							for (int i = 0; i < c; i++)
-								color[i] += dcolor[i];
-							n++;
-						}
-					}
-				}
-				if (n)
-				{
-					float in = 1.0f / n;
-					for (int i = 0; i < c; i++)
-						color[i] *= in;
+				lm_vec2 center = lm_v2((float)x + 0.5f, (float)y + 0.5f);
+				lm_vec2 b = lm_toBarycentric(uv[0], uv[1], uv[2], center);
+				if (b.x < 0.0f || b.y < 0.0f || b.x + b.y > 1.0f)
+				{ // outside: use the nearest point on the triangle border
+					lm_vec2 nearest = lm_closestPointOnSegment2(uv[0], uv[1], center);
+					lm_vec2 candidates[2] = { lm_closestPointOnSegment2(uv[1], uv[2], center), lm_closestPointOnSegment2(uv[2], uv[0], center) };
+					for (int j = 0; j < 2; j++)
+						if (lm_length2sq(lm_sub2(candidates[j], center)) < lm_length2sq(lm_sub2(nearest, center)))
+							nearest = candidates[j];
+					float distance = lm_length2sq(lm_sub2(nearest, center));
+					if (distance >= distances[y * w + x])
+						continue;
+					distances[y * w + x] = distance;
+					b = lm_toBarycentric(uv[0], uv[1], uv[2], nearest);
 				}
+				else
+					distances[y * w + x] = 0.0f;
+
+				lm_gbufferTexel *texel = gbuffer + y * w + x;
+				texel->position = lm_add3(p[0], lm_add3(lm_scale3(lm_sub3(p[2], p[0]), b.x), lm_scale3(lm_sub3(p[1], p[0]), b.y)));
+				texel->normal = ctx->mesh.normals[t];
+				texel->texelSize = texelSize;
+				texel->chart = charts[i];
 			}
-			for (int i = 0; i < c; i++)
-				outImage[(y * w + x) * c + i] = color[i];
 		}
 	}
+	LM_FREE(distances);
 }
 
-void lmImageSmooth(const float *image, float *outImage, int w, int h, int c)
+typedef struct
 {
-	assert(c > 0 && c <= 4);
-	for (int y = 0; y < h; y++)
+	const float *image;
+	float *outImage;
+	const lm_gbufferTexel *gbuffer;
+	const lm_targetLightmap *target;
+	int step;
+	float colorSigma;
+	float luminanceFloor; // keeps the relative difference of near-black texels finite
+} lm_denoiseJob;
+
+static float lm_denoiseLuminance(const float *pixel, int c)
+{
+	return c >= 3 ? 0.2126f * pixel[0] + 0.7152f * pixel[1] + 0.0722f * pixel[2] : pixel[0];
+}
+
+// one a-trous iteration: 5x5 B3 spline kernel with holes of the step size, weighted by the g-buffer and luminance similarity
+static void lm_denoiseRows(void *userdata, int begin, int end)
+{
+	const lm_denoiseJob *job = (const lm_denoiseJob*)userdata;
+	const float kernel[5] = { 1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+	int w = job->target->width, h = job->target->height, c = job->target->channels;
+	for (int y = begin; y < end; y++)
 	{
 		for (int x = 0; x < w; x++)
 		{
-			float color[4] = {0};
-			int n = 0;
-			for (int dy = -1; dy <= 1; dy++)
+			int i = y * w + x;
+			const lm_gbufferTexel *g = job->gbuffer + i;
+			const float *pixel = job->image + i * c;
+			float *outPixel = job->outImage + i * c;
+			if (g->chart < 0 || !lm_isTexelCovered(job->target, x, y))
 			{
-				int cy = y + dy;
-				for (int dx = -1; dx <= 1; dx++)
+				for (int j = 0; j < c; j++)
+					outPixel[j] = pixel[j];
+				continue;
+			}
+
+			float luminance = lm_denoiseLuminance(pixel, c);
+			float positionSigma = 2.0f * (float)job->step * g->texelSize;
+			float sum[4] = { 0 }, weightSum = 0.0f;
+			for (int ky = -2; ky <= 2; ky++)
+			{
+				int qy = y + ky * job->step;
+				if (qy < 0 || qy >= h)
+					continue;
+				for (int kx = -2; kx <= 2; kx++)
 				{
-					int cx = x + dx;
-					if (cx >= 0 && cx < w && cy >= 0 && cy < h)
-					{
-						lm_bool valid = LM_FALSE;
-						for (int i = 0; i < c; i++)
-							valid |= image[(cy * w + cx) * c + i] > 0.0f;
-						if (valid)
-						{
-							for (int i = 0; i < c; i++)
-								color[i] += image[(cy * w + cx) * c + i];
-							n++;
-						}
-					}
+					int qx = x + kx * job->step;
+					if (qx < 0 || qx >= w)
+						continue;
+					int q = qy * w + qx;
+					const lm_gbufferTexel *gq = job->gbuffer + q;
+					if (gq->chart != g->chart || !lm_isTexelCovered(job->target, qx, qy))
+						continue;
+
+					const float *neighbor = job->image + q * c;
+					float normalWeight = powf(lm_maxf(lm_dot3(g->normal, gq->normal), 0.0f), 32.0f);
+					float positionWeight = expf(-lm_length3sq(lm_sub3(g->position, gq->position)) / (positionSigma * positionSigma));
+					float colorDifference = lm_absf(lm_denoiseLuminance(neighbor, c) - luminance) / (lm_maxf(luminance, 0.0f) + job->luminanceFloor);
+					float colorWeight = expf(-colorDifference * colorDifference / (job->colorSigma * job->colorSigma));
+					float weight = kernel[kx + 2] * kernel[ky + 2] * normalWeight * positionWeight * colorWeight;
+					for (int j = 0; j < c; j++)
+						sum[j] += neighbor[j] * weight;
+					weightSum += weight;
 				}
 			}
-			for (int i = 0; i < c; i++)
-				outImage[(y * w + x) * c + i] = n ? color[i] / n : 0.0f;
+			for (int j = 0; j < c; j++)
+				outPixel[j] = sum[j] / weightSum; // the center tap always has a weight > 0
 		}
 	}
 }
 
-void lmImageDownsample(const float *image, float *outImage, int w, int h, int c)
+void lmImageDenoise(lm_context *ctx, float *lightmap, int iterations, float colorSigma)
 {
-	assert(c > 0 && c <= 4);
-	for (int y = 0; y < h / 2; y++)
+	assert(iterations >= 0 && colorSigma > 0.0f);
+	int target = 0;
+	while (target < ctx->geometry.targetCount && ctx->geometry.targets[target].data != lightmap)
+		target++;
+	assert(target < ctx->geometry.targetCount); // the lightmap has to be a target of the current geometry
+	if (target == ctx->geometry.targetCount || !iterations)
+		return;
+	const lm_targetLightmap *t = ctx->geometry.targets + target;
+	assert(!t->tiled); // untile it first
+	int w = t->width, h = t->height, c = t->channels;
+
+	// collect the triangles of all geometries that were baked into this lightmap
+	unsigned int *triangles = (unsigned int*)LM_CALLOC(lm_maxi(ctx->mesh.count / 3, 1), sizeof(unsigned int));
+	int triangleCount = 0;
+	for (int i = 0; i < ctx->geometry.geometryCount; i++)
 	{
-		for (int x = 0; x < w / 2; x++)
+		if (ctx->geometry.geometries[i].target != target)
+			continue;
+		unsigned int end = i + 1 < ctx->geometry.geometryCount ? ctx->geometry.geometries[i + 1].first : ctx->mesh.count;
+		for (unsigned int j = ctx->geometry.geometries[i].first; j < end; j += 3)
+			triangles[triangleCount++] = j / 3;
+	}
+
+	int *charts = (int*)LM_CALLOC(lm_maxi(triangleCount, 1), sizeof(int));
+	lm_computeCharts(ctx, triangles, triangleCount, charts);
+	lm_gbufferTexel *gbuffer = (lm_gbufferTexel*)LM_CALLOC(w * h, sizeof(lm_gbufferTexel));
+	lm_rasterizeGBuffer(ctx, triangles, charts, triangleCount, gbuffer, w, h);
+	LM_FREE(charts);
+	LM_FREE(triangles);
+
+	// differences in dark areas are measured against 1% of the average luminance instead of the almost zero texel luminance
+	double luminanceSum = 0.0;
+	int covered = 0;
+	for (int y = 0; y < h; y++)
+	{
+		for (int x = 0; x < w; x++)
 		{
-			int p0 = 2 * (y * w + x) * c;
-			int p1 = p0 + w * c;
-			int valid[2][2] = {0};
-			float sums[4] = {0};
-			for (int i = 0; i < c; i++)
+			if (gbuffer[y * w + x].chart >= 0 && lm_isTexelCovered(t, x, y))
 			{
-				valid[0][0] |= image[p0     + i] != 0.0f ? 1 : 0;
-				valid[0][1] |= image[p0 + c + i] != 0.0f ? 1 : 0;
-				valid[1][0] |= image[p1     + i] != 0.0f ? 1 : 0;
-				valid[1][1] |= image[p1 + c + i] != 0.0f ? 1 : 0;
-				sums[i] += image[p0 + i] + image[p0 + c + i] + image[p1 + i] + image[p1 + c + i];
+				luminanceSum += lm_maxf(lm_denoiseLuminance(lightmap + (y * w + x) * c, c), 0.0f);
+				covered++;
 			}
-			int n = valid[0][0] + valid[0][1] + valid[1][0] + valid[1][1];
-			int p = (y * w / 2 + x) * c;
-			for (int i = 0; i < c; i++)
-				outImage[p + i] = n ? sums[i] / n : 0.0f;
 		}
 	}
+	float luminanceFloor = lm_maxf(covered ? 0.01f * (float)(luminanceSum / covered) : 0.0f, FLT_MIN);
+
+	float *images[2];
+	images[0] = lightmap;
+	images[1] = (float*)LM_CALLOC(w * h * c, sizeof(float));
+	lm_denoiseJob job = { NULL, NULL, gbuffer, t, 1, colorSigma, luminanceFloor };
+	int current = 0;
+	for (int i = 0; i < iterations; i++)
+	{
+		job.image = images[current];
+		job.outImage = images[1 - current];
+		lm_parallelFor(h, lm_maxi(4096 / w, 1), lm_denoiseRows, &job);
+		job.step *= 2;
+		job.colorSigma *= 0.5f;
+		current = 1 - current;
+	}
+	if (current)
+		for (int i = 0; i < w * h * c; i++)
+			lightmap[i] = images[1][i];
+
+	LM_FREE(images[1]);
+	LM_FREE(gbuffer);
 }
 
 void lmImageFtoUB(const float *image, unsigned char *outImage, int w, int h, int c, float max)
@@ -1647,12 +5120,53 @@ void lmImageFtoUB(const float *image, unsigned char *outImage, int w, int h, int
 		outImage[i] = (unsigned char)lm_minf(lm_maxf(image[i] * scale, 0.0f), 255.0f);
 }
 
-// TGA output helpers
-static void lm_swapRandBub(unsigned char *image, int w, int h, int c)
+void lmImageUntile(const float *tiledImage, float *outImage, int w, int h, int c)
+{
+	lm_targetLightmap layout;
+	memset(&layout, 0, sizeof(layout));
+	layout.width = w;
+	layout.height = h;
+	layout.channels = c;
+	layout.tiled = LM_TRUE;
+	for (int y = 0; y < h; y++)
+	{
+		for (int x = 0; x < w; x += LM_TILE_SIZE)
+		{ // one tile row at a time
+			const float *in = tiledImage + lm_texelOffset(&layout, x, y);
+			float *out = outImage + ((size_t)y * w + x) * c;
+			int n = lm_mini(LM_TILE_SIZE, w - x) * c;
+			for (int i = 0; i < n; i++)
+				out[i] = in[i];
+		}
+	}
+}
+
+// file output helpers
+static FILE *lm_openFile(const char *filename)
+{
+#if defined(_MSC_VER) && _MSC_VER >= 1400
+	FILE *file;
+	if (fopen_s(&file, filename, "wb") != 0) return NULL;
+	return file;
+#else
+	return fopen(filename, "wb");
+#endif
+}
+
+static lm_bool lm_closeFile(FILE *file)
 {
-	assert(c >= 3);
-	for (int i = 0; i < w * h * c; i += c)
-		LM_SWAP(unsigned char, image[i], image[i + 2]);
+	lm_bool success = !ferror(file);
+	return fclose(file) == 0 && success;
+}
+
+static void lm_writeTGAHeader(FILE *file, int w, int h, int c)
+{ // uncompressed greyscale or true color image, 8 bit alpha for c == 4
+	unsigned char header[18] = {
+		0, 0, (unsigned char)(c == 1 ? 3 : 2), 0, 0, 0, 0, 0, 0, 0, 0, 0,
+		(unsigned char)(w & 0xff), (unsigned char)((w >> 8) & 0xff),
+		(unsigned char)(h & 0xff), (unsigned char)((h >> 8) & 0xff),
+		(unsigned char)(8 * c), (unsigned char)(c == 4 ? 8 : 0) };
+	fwrite(header, 1, sizeof(header), file);
 }
 
 lm_bool lmImageSaveTGAub(const char *filename, const unsigned char *image, int w, int h, int c)
@@ -1660,34 +5174,249 @@ lm_bool lmImageSaveTGAub(const char *filename, const unsigned char *image, int w
 	assert(c == 1 || c == 3 || c == 4);
 	lm_bool isGreyscale = c == 1;
 	lm_bool hasAlpha = c == 4;
-	unsigned char header[18] = { 0, 0, isGreyscale ? 3 : 2, 0, 0, 0, 0, 0, 0, 0, 0, 0, w & 0xff, (w >> 8) & 0xff, h & 0xff, (h >> 8) & 0xff, (unsigned char)(8 * c), hasAlpha ? 8 : 0 };
-#if defined(_MSC_VER) && _MSC_VER >= 1400
-	FILE *file;
-	if (fopen_s(&file, filename, "wb") != 0) return LM_FALSE;
-#else
-	FILE *file = fopen(filename, "wb");
+	FILE *file = lm_openFile(filename);
 	if (!file) return LM_FALSE;
-#endif
-	fwrite(header, 1, sizeof(header), file);
+	lm_writeTGAHeader(file, w, h, c);
 
-	// we make sure to swap it back! trust me. :)
-	if (!isGreyscale)
-		lm_swapRandBub((unsigned char*)image, w, h, c);
-	fwrite(image, 1, w * h * c , file);
-	if (!isGreyscale)
-		lm_swapRandBub((unsigned char*)image, w, h, c);
+	if (isGreyscale)
+		fwrite(image, 1, w * h * c, file);
+	else
+	{ // tga wants BGR(A). swap every scanline in a copy instead of the caller's image
+		unsigned char *row = (unsigned char*)LM_CALLOC(w * c, sizeof(unsigned char));
+		for (int y = 0; y < h; y++)
+		{
+			const unsigned char *in = image + y * w * c;
+			for (int i = 0; i < w * c; i += c)
+			{
+				row[i + 0] = in[i + 2];
+				row[i + 1] = in[i + 1];
+				row[i + 2] = in[i + 0];
+				if (hasAlpha)
+					row[i + 3] = in[i + 3];
+			}
+			fwrite(row, 1, w * c, file);
+		}
+		LM_FREE(row);
+	}
 
-	fclose(file);
-	return LM_TRUE;
+	return lm_closeFile(file);
 }
 
 lm_bool lmImageSaveTGAf(const char *filename, const float *image, int w, int h, int c, float max)
 {
-	unsigned char *temp = (unsigned char*)LM_CALLOC(w * h * c, sizeof(unsigned char));
-	lmImageFtoUB(image, temp, w, h, c, max);
-	lm_bool success = lmImageSaveTGAub(filename, temp, w, h, c);
-	LM_FREE(temp);
-	return success;
+	assert(c == 1 || c == 3 || c == 4);
+	if (max == 0.0f)
+		max = lmImageMax(image, w, h, c, LM_ALL_CHANNELS);
+	lm_bool isGreyscale = c == 1;
+	FILE *file = lm_openFile(filename);
+	if (!file) return LM_FALSE;
+	lm_writeTGAHeader(file, w, h, c);
+
+	// convert one scanline at a time
+	unsigned char *row = (unsigned char*)LM_CALLOC(w * c, sizeof(unsigned char));
+	for (int y = 0; y < h; y++)
+	{
+		lmImageFtoUB(image + y * w * c, row, w, 1, c, max);
+		if (!isGreyscale)
+			for (int i = 0; i < w * c; i += c)
+				LM_SWAP(unsigned char, row[i], row[i + 2]);
+		fwrite(row, 1, w * c, file);
+	}
+	LM_FREE(row);
+
+	return lm_closeFile(file);
+}
+
+static void lm_floatToRGBE(const float *pixel, int c, unsigned char *rgbe)
+{
+	float r, g, b;
+	if (c < 3)
+		r = g = b = pixel[0];
+	else
+	{
+		r = pixel[0];
+		g = pixel[1];
+		b = pixel[2];
+	}
+	r = lm_maxf(r, 0.0f); // rgbe can't store negative values
+	g = lm_maxf(g, 0.0f);
+	b = lm_maxf(b, 0.0f);
+	float v = lm_maxf(r, lm_maxf(g, b));
+	if (v < 1e-32f)
+	{
+		rgbe[0] = rgbe[1] = rgbe[2] = rgbe[3] = 0;
+		return;
+	}
+	int e;
+	float scale = frexpf(v, &e) * 256.0f / v;
+	rgbe[0] = (unsigned char)(r * scale);
+	rgbe[1] = (unsigned char)(g * scale);
+	rgbe[2] = (unsigned char)(b * scale);
+	rgbe[3] = (unsigned char)(e + 128);
+}
+
+// new style radiance rle: every component of a scanline is encoded on its own in runs (count > 128) and literals (count <= 128)
+static void lm_writeRLEComponent(FILE *file, const unsigned char *data, int stride, int n)
+{
+	int i = 0;
+	while (i < n)
+	{
+		// find the next run of at least 4 equal values
+		int runStart = i, runLength = 0;
+		while (runStart < n)
+		{
+			runLength = 1;
+			while (runStart + runLength < n && runLength < 127 && data[(runStart + runLength) * stride] == data[runStart * stride])
+				runLength++;
+			if (runLength >= 4)
+				break;
+			runStart += runLength;
+		}
+		if (runStart >= n)
+			runLength = 0;
+
+		// literals up to the run
+		while (i < runStart)
+		{
+			unsigned char count = (unsigned char)lm_mini(runStart - i, 128);
+			fputc(count, file);
+			for (int j = 0; j < count; j++)
+				fputc(data[(i + j) * stride], file);
+			i += count;
+		}
+
+		if (runLength)
+		{
+			fputc(128 + runLength, file);
+			fputc(data[runStart * stride], file);
+			i += runLength;
+		}
+	}
+}
+
+lm_bool lmImageSaveHDR(const char *filename, const float *image, int w, int h, int c)
+{
+	assert(c > 0 && c <= 4);
+	FILE *file = lm_openFile(filename);
+	if (!file) return LM_FALSE;
+	fprintf(file, "#?RADIANCE\nFORMAT=32-bit_rle_rgbe\n\n-Y %d +X %d\n", h, w);
+
+	unsigned char *row = (unsigned char*)LM_CALLOC(w * 4, sizeof(unsigned char));
+	lm_bool rle = w >= 8 && w < 32768; // the rle scanline header can't describe other widths
+	for (int y = h - 1; y >= 0; y--) // the top scanline comes first
+	{
+		const float *in = image + y * w * c;
+		for (int x = 0; x < w; x++)
+			lm_floatToRGBE(in + x * c, c, row + x * 4);
+		if (rle)
+		{
+			unsigned char header[4] = { 2, 2, (unsigned char)(w >> 8), (unsigned char)(w & 0xff) };
+			fwrite(header, 1, 4, file);
+			for (int j = 0; j < 4; j++)
+				lm_writeRLEComponent(file, row + j, 4, w);
+		}
+		else
+			fwrite(row, 1, w * 4, file);
+	}
+	LM_FREE(row);
+
+	return lm_closeFile(file);
+}
+
+// little endian values for the exr header and scanlines
+static unsigned char *lm_putU32(unsigned char *p, unsigned int v)
+{
+	p[0] = (unsigned char)v; p[1] = (unsigned char)(v >> 8); p[2] = (unsigned char)(v >> 16); p[3] = (unsigned char)(v >> 24);
+	return p + 4;
+}
+
+static unsigned char *lm_putF32(unsigned char *p, float f)
+{
+	union { float f; unsigned int u; } v;
+	v.f = f;
+	return lm_putU32(p, v.u);
+}
+
+static unsigned char *lm_putString(unsigned char *p, const char *s)
+{
+	do *p++ = (unsigned char)*s; while (*s++); // including the terminator
+	return p;
+}
+
+static unsigned char *lm_putAttribute(unsigned char *p, const char *name, const char *type, unsigned int size)
+{
+	p = lm_putString(p, name);
+	p = lm_putString(p, type);
+	return lm_putU32(p, size);
+}
+
+lm_bool lmImageSaveEXR(const char *filename, const float *image, int w, int h, int c)
+{
+	assert(c > 0 && c <= 4);
+	// exr channels are sorted by name. index of the image channel of each one:
+	static const char *names[4][4] = { { "Y" }, { "A", "Y" }, { "B", "G", "R" }, { "A", "B", "G", "R" } };
+	static const int channels[4][4] = { { 0 }, { 1, 0 }, { 2, 1, 0 }, { 3, 2, 1, 0 } };
+
+	unsigned char header[512], *p = header;
+	p = lm_putU32(p, 20000630); // magic number
+	p = lm_putU32(p, 2); // version 2, single part scanline file
+	p = lm_putAttribute(p, "channels", "chlist", c * 18 + 1);
+	for (int i = 0; i < c; i++)
+	{
+		p = lm_putString(p, names[c - 1][i]);
+		p = lm_putU32(p, 2); // FLOAT
+		p = lm_putU32(p, 0); // pLinear, reserved
+		p = lm_putU32(p, 1); // xSampling
+		p = lm_putU32(p, 1); // ySampling
+	}
+	*p++ = 0;
+	p = lm_putAttribute(p, "compression", "compression", 1);
+	*p++ = 0; // NO_COMPRESSION
+	p = lm_putAttribute(p, "dataWindow", "box2i", 16);
+	p = lm_putU32(p, 0); p = lm_putU32(p, 0); p = lm_putU32(p, w - 1); p = lm_putU32(p, h - 1);
+	p = lm_putAttribute(p, "displayWindow", "box2i", 16);
+	p = lm_putU32(p, 0); p = lm_putU32(p, 0); p = lm_putU32(p, w - 1); p = lm_putU32(p, h - 1);
+	p = lm_putAttribute(p, "lineOrder", "lineOrder", 1);
+	*p++ = 0; // INCREASING_Y
+	p = lm_putAttribute(p, "pixelAspectRatio", "float", 4);
+	p = lm_putF32(p, 1.0f);
+	p = lm_putAttribute(p, "screenWindowCenter", "v2f", 8);
+	p = lm_putF32(p, 0.0f); p = lm_putF32(p, 0.0f);
+	p = lm_putAttribute(p, "screenWindowWidth", "float", 4);
+	p = lm_putF32(p, 1.0f);
+	*p++ = 0; // end of header
+	assert(p - header <= (int)sizeof(header));
+
+	FILE *file = lm_openFile(filename);
+	if (!file) return LM_FALSE;
+	fwrite(header, 1, p - header, file);
+
+	// offset table: one uncompressed scanline per block
+	unsigned long long blockSize = 8 + (unsigned long long)w * c * 4;
+	unsigned long long offset = (unsigned long long)(p - header) + (unsigned long long)h * 8;
+	for (int y = 0; y < h; y++, offset += blockSize)
+	{
+		unsigned char entry[8];
+		lm_putU32(entry, (unsigned int)offset);
+		lm_putU32(entry + 4, (unsigned int)(offset >> 32));
+		fwrite(entry, 1, 8, file);
+	}
+
+	// scanlines: y, size, then all values of one channel after the other
+	unsigned char *row = (unsigned char*)LM_CALLOC(blockSize, 1);
+	for (int y = 0; y < h; y++)
+	{
+		const float *in = image + (h - 1 - y) * w * c; // exr y points down
+		unsigned char *q = lm_putU32(row, (unsigned int)y);
+		q = lm_putU32(q, (unsigned int)(blockSize - 8));
+		for (int i = 0; i < c; i++)
+			for (int x = 0; x < w; x++)
+				q = lm_putF32(q, in[x * c + channels[c - 1][i]]);
+		fwrite(row, 1, (size_t)blockSize, file);
+	}
+	LM_FREE(row);
+
+	return lm_closeFile(file);
 }
 
 #endif // LIGHTMAPPER_IMPLEMENTATION
@@ -3,7 +3,6 @@
 #include <QDirIterator>
 #include <QMouseEvent>
 #include <QElapsedTimer>
-#include <QWaitCondition>
 #include <QPainter>
 #include <QWindow>
 #include <QOpenGLContext>
@@ -38,15 +37,6 @@
 #endif
 
 
-class SleepSimulator {
-	QMutex localMutex;
-	QWaitCondition sleepSimulator;
-public:
-	SleepSimulator() { localMutex.lock(); }
-	void sleep(unsigned long sleepMS) { sleepSimulator.wait(&localMutex, sleepMS); }
-	void CancelSleep() { sleepSimulator.wakeAll(); }
-};
-
 double qtGetTime() {
 	static QElapsedTimer timer;
 	if (!timer.isValid())
@@ -54,11 +44,6 @@ double qtGetTime() {
 	return timer.elapsed() / 1000.; 
 }
 
-void qtDelay(long ms) {
-	SleepSimulator s;
-	s.sleep(ms);
-}
-
 
 // == Lightmapper utilities ==
 
@@ -83,10 +68,19 @@ typedef struct
 	unsigned int vertexCount, indexCount;
 } scene_t;
 
+typedef struct
+{
+	lm_context *ctx; // != 0 while baking
+	float *data;
+	double lastUpdateTime;
+} bake_t;
+
 static int initScene(scene_t *scene);
 static void drawScene(scene_t *scene, float *view, float *projection);
 static void destroyScene(scene_t *scene);
-static int bake(scene_t *scene);
+static int bakeBegin(bake_t *bake, scene_t *scene);
+static int bakeStep(bake_t *bake, scene_t *scene, unsigned int budgetMicroseconds);
+static void bakeCancel(bake_t *bake);
 
 static void multiplyMatrices(float *out, float *a, float *b);
 static void translationMatrix(float *out, float x, float y, float z);
@@ -116,6 +110,7 @@ private:
 	QOpenGLContext *m_context;
 	QOpenGLPaintDevice *m_device;
 	scene_t m_scene;
+	bake_t m_bake;
 public:
 	QPoint m_cursor; QSize m_size;
     float m_view[16], m_projection[16];
@@ -127,11 +122,14 @@ public:
 	, m_auto_refresh(true)
 	, m_context(0)
 	, m_device(0)
-    , m_scene({0}), m_view{}, m_projection{}, m_mouse_left(0), m_keys{}
+    , m_scene({0}), m_bake({0}), m_view{}, m_projection{}, m_mouse_left(0), m_keys{}
 	, m_done(false) {
 		setSurfaceType(QWindow::OpenGLSurface);
 	}
-	~Window() { destroyScene(&m_scene); delete m_device; }
+	~Window() {
+		if (m_bake.ctx) { m_context->makeCurrent(this); bakeCancel(&m_bake); }
+		destroyScene(&m_scene); delete m_device;
+	}
 	void setAutoRefresh(bool a) { m_auto_refresh = a; }	
     void fpsCameraViewMatrix(float *view, bool left_mouse, bool *keys)
     {
@@ -179,6 +177,10 @@ public:
     void render(QPainter *painter) {
 		Q_UNUSED(painter);
 
+		// bake a few hemispheres per frame, so that the window stays responsive (the rest of the frame is drawn as usual)
+		if (m_bake.ctx && !bakeStep(&m_bake, &m_scene, 8000))
+			dbgAppendMessage("Press SPACE to bake the next light bounce.");
+
 		glViewport(0, 0, m_size.width() * devicePixelRatio(), m_size.height() * devicePixelRatio());
 
 		// camera for window
@@ -215,7 +217,7 @@ public:
         dbgAppendMessage("Ambient Occlusion Baking Example.");
         dbgAppendMessage("Use your mouse and the W, A, S, D, E, Q keys to navigate.");
         dbgAppendMessage("Press SPACE to start baking one light bounce!");
-        dbgAppendMessage("This will take a few seconds and bake a lightmap illuminated by:");
+        dbgAppendMessage("This will take a few seconds (press ESCAPE to cancel) and bake a lightmap illuminated by:");
         dbgAppendMessage("1. The mesh itself (initially black)");
         dbgAppendMessage("2. A white sky (1.0f, 1.0f, 1.0f)");
 	}
@@ -241,11 +243,23 @@ public:
 	}
 	void keyPressEvent(QKeyEvent* event) {
 		switch(event->key()) {
-			case Qt::Key_Escape: close(); break;
+			case Qt::Key_Escape:
+				if (m_bake.ctx)
+				{
+					m_context->makeCurrent(this); // lmCancel and lmDestroy delete gl objects
+					bakeCancel(&m_bake);
+					dbgSetStatusLine("Baking cancelled.");
+				}
+				else
+					close();
+				break;
             case Qt::Key_Space:
-                QApplication::setOverrideCursor(QCursor(Qt::WaitCursor));
-                bake(&m_scene);
-                QApplication::restoreOverrideCursor();
+                if (!m_bake.ctx)
+                {
+                    m_context->makeCurrent(this); // lmCreate and lmSetGeometry create gl objects
+                    if (!bakeBegin(&m_bake, &m_scene))
+                        dbgSetStatusLine("Could not initialize lightmapper.");
+                }
                 break;
 			default: event->ignore();
 			break;
@@ -352,62 +366,69 @@ static void svg_end(FILE *f)
 	fclose(f);
 }
 
-static int bake(scene_t *scene)
+static void bakeRenderScene(const int *viewport4, const float *view4x4, const float *projection4x4, void *userdata)
+{
+	// render to lightmapper framebuffer
+	glViewport(viewport4[0], viewport4[1], viewport4[2], viewport4[3]);
+	drawScene((scene_t *)userdata, (float *)view4x4, (float *)projection4x4);
+}
+
+static int bakeBegin(bake_t *bake, scene_t *scene)
 {
-	lm_context *ctx = lmCreate(
+	bake->ctx = lmCreate(
 		64,               // hemisphere resolution (power of two, max=512)
 		0.001f, 100.0f,   // zNear, zFar of hemisphere cameras
 		1.0f, 1.0f, 1.0f, // background color (white for ambient occlusion)
 		2, 0.01f);        // lightmap interpolation threshold (small differences are interpolated rather than sampled)
 	                      // check debug_interpolation.tga for an overview of sampled (red) vs interpolated (green) pixels.
-	if (!ctx)
+	if (!bake->ctx)
 	{
 		fprintf(stderr, "Error: Could not initialize lightmapper.\n");
 		return 0;
 	}
 	
 	int w = scene->w, h = scene->h;
-	float *data = (float *)calloc(w * h * 4, sizeof(float));
-	lmSetTargetLightmap(ctx, data, w, h, 4);
+	bake->data = (float *)calloc(w * h * 4, sizeof(float));
+	lmSetTargetLightmap(bake->ctx, bake->data, w, h, 4);
 
-	lmSetGeometry(ctx, NULL,
+	lmSetGeometry(bake->ctx, NULL,
 		LM_FLOAT, (unsigned char*)scene->vertices + offsetof(vertex_t, p), sizeof(vertex_t),
 		LM_FLOAT, (unsigned char*)scene->vertices + offsetof(vertex_t, t), sizeof(vertex_t),
 		scene->indexCount, LM_UNSIGNED_SHORT, scene->indices);
 
-	int vp[4];
-	float view[16], projection[16];
-	double lastUpdateTime = 0.0;
-	while (lmBegin(ctx, vp, view, projection))
-	{
-		// render to lightmapper framebuffer
-		glViewport(vp[0], vp[1], vp[2], vp[3]);
-		drawScene(scene, view, projection);
+	bake->lastUpdateTime = 0.0;
+	return 1;
+}
 
+// returns 0 when the lightmap is finished and uploaded
+static int bakeStep(bake_t *bake, scene_t *scene, unsigned int budgetMicroseconds)
+{
+	if (lmBakeStep(bake->ctx, budgetMicroseconds, bakeRenderScene, scene))
+	{
 		// display progress every second (printf is expensive)
 		double time = qtGetTime();
-		if (time - lastUpdateTime > 1.0)
+		if (time - bake->lastUpdateTime > 1.0)
 		{
-			lastUpdateTime = time;
-			printf("\r%6.2f%%", lmProgress(ctx) * 100.0f);
+			bake->lastUpdateTime = time;
+			printf("\r%6.2f%%", lmProgress(bake->ctx) * 100.0f);
 			fflush(stdout);
+			dbgSetStatusLine("Baking... %6.2f%%", lmProgress(bake->ctx) * 100.0f);
 		}
-
-		lmEnd(ctx);
+		return 1;
 	}
 	printf("\rFinished baking %d triangles.\n", scene->indexCount / 3);
+	dbgSetStatusLine("Finished baking %d triangles.", scene->indexCount / 3);
 	
-	lmDestroy(ctx);
+	lmDestroy(bake->ctx);
+	bake->ctx = 0;
 
 	// postprocess texture
+	int w = scene->w, h = scene->h;
+	float *data = bake->data;
 	float *temp = (float *)calloc(w * h * 4, sizeof(float));
 	lmImageSmooth(data, temp, w, h, 4);
 	lmImageDilate(temp, data, w, h, 4);
-	for (int i = 0; i < 16; i++)
-	{
-		lmImageDilate(data, temp, w, h, 4);
-		lmImageDilate(temp, data, w, h, 4);
-	}
+	lmImagePadCharts(data, w, h, 4, 32);
 	lmImagePower(data, w, h, 4, 1.0f / 2.2f, 0x7); // gamma correct color channels
 	free(temp);
 
@@ -419,8 +440,21 @@ static int bake(scene_t *scene)
 	glBindTexture(GL_TEXTURE_2D, scene->lightmap);
 	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, w, h, 0, GL_RGBA, GL_FLOAT, data);
 	free(data);
+	bake->data = 0;
 
-	return 1;
+	return 0;
+}
+
+// stops a running bake. the lightmap of the last finished bake stays in use.
+static void bakeCancel(bake_t *bake)
+{
+	if (!bake->ctx)
+		return;
+	lmCancel(bake->ctx);
+	lmDestroy(bake->ctx);
+	free(bake->data);
+	bake->ctx = 0;
+	bake->data = 0;
 }
 
 